@@ -0,0 +1,266 @@
+// browser.cpp
+//   folder listing for the file browser
+
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include "browser.h"
+#include "os.h"
+
+// A background job lists the folder, sorts it, and hands the whole listing
+// over at once, then reads the details of each song, visible entries first.
+// Everything from here to the public interface is shared with the job, and
+// is only touched under the background lock once the listing is handed over.
+
+static char folder[1024] = ".";
+static char joined[1024 + 256];
+
+static browser::Entry* entries = NULL;
+static int listed = 0; // entries handed over
+static int next_read = 0; // entries before this are all ready
+static int want_first = 0;
+static int want_count = 0;
+static int change = 0; // revision
+static bool reading = false;
+static bool cancel = false;
+
+struct BackgroundLock
+{
+	BackgroundLock() { os::lock_background(true); }
+	~BackgroundLock() { os::lock_background(false); }
+};
+
+// listing built by os::list_dir
+
+struct Listing
+{
+	browser::Entry* entries;
+	int count;
+	int capacity;
+};
+
+// adds a blank entry, NULL if out of memory
+browser::Entry* listing_grow(Listing* list)
+{
+	if (list->count >= list->capacity)
+	{
+		int capacity = (list->capacity < 64) ? 64 : (list->capacity * 2);
+		browser::Entry* grown = (browser::Entry*)realloc(list->entries, capacity * sizeof(browser::Entry));
+		if (grown == NULL) return NULL;
+		list->entries = grown;
+		list->capacity = capacity;
+	}
+
+	browser::Entry* e = &list->entries[list->count++];
+	memset(e, 0, sizeof(browser::Entry));
+	return e;
+}
+
+void listing_add(const char* name, bool is_folder, void* data)
+{
+	if (name[0] == '.') return; // hidden
+	if (!is_folder && !files::can_load(name)) return;
+	if (strlen(name) >= sizeof(entries[0].name)) return;
+
+	browser::Entry* e = listing_grow((Listing*)data);
+	if (e == NULL) return;
+	strcpy(e->name, name);
+	e->folder = is_folder;
+	e->ready = is_folder; // folders have nothing to read
+}
+
+// folders first, then by name
+int entry_compare(const void* a, const void* b)
+{
+	const browser::Entry* ea = (const browser::Entry*)a;
+	const browser::Entry* eb = (const browser::Entry*)b;
+	if (ea->folder != eb->folder) return ea->folder ? -1 : 1;
+	return strcmp(ea->name, eb->name);
+}
+
+// finds the next entry to read, -1 if none are left, call with the lock held
+int next_unread()
+{
+	int end = want_first + want_count;
+	if (end > listed) end = listed;
+	for (int i=want_first; i < end; ++i)
+	{
+		if (!entries[i].ready) return i;
+	}
+
+	while (next_read < listed && entries[next_read].ready) ++next_read;
+	return (next_read < listed) ? next_read : -1;
+}
+
+const char* join_path(const char* name, char* path)
+{
+	int l = strlen(folder);
+	bool separated = (l > 0) && (folder[l-1] == '/' || folder[l-1] == '\\');
+	sprintf(path, separated ? "%s%s" : "%s/%s", folder, name);
+	return path;
+}
+
+void read_job(void* data)
+{
+	Listing list = { NULL, 0, 0 };
+	browser::Entry* parent = listing_grow(&list);
+	if (parent != NULL)
+	{
+		strcpy(parent->name, "..");
+		parent->folder = true;
+		parent->ready = true;
+	}
+	os::list_dir(folder, listing_add, &list);
+	if (list.count > 1)
+		qsort(list.entries + 1, list.count - 1, sizeof(browser::Entry), entry_compare);
+
+	{
+		BackgroundLock lock;
+		entries = list.entries;
+		listed = list.count;
+		++change;
+	}
+
+	char path[sizeof(joined)];
+	while (true)
+	{
+		int index;
+		{
+			BackgroundLock lock;
+			index = cancel ? -1 : next_unread();
+			if (index >= 0) join_path(entries[index].name, path);
+		}
+		if (index < 0) break;
+
+		files::SongInfo info;
+		bool valid = files::read_info(path, &info);
+
+		BackgroundLock lock;
+		entries[index].info = info;
+		entries[index].valid = valid;
+		entries[index].ready = true;
+		++change;
+	}
+
+	BackgroundLock lock;
+	reading = false;
+	++change;
+}
+
+// the last part of a path, after its final separator
+char* last_part(char* path)
+{
+	char* s = strrchr(path, '/');
+	char* b = strrchr(path, '\\');
+	if (b > s) s = b;
+	return s ? (s + 1) : path;
+}
+
+// public interface
+
+namespace browser
+{
+
+void open(const char* path)
+{
+	close();
+
+	free(entries);
+	entries = NULL;
+	listed = 0;
+	next_read = 0;
+	want_first = 0;
+	want_count = 0;
+	reading = true;
+	cancel = false;
+	++change;
+
+	strncpy(folder, path, sizeof(folder));
+	folder[sizeof(folder)-1] = 0;
+
+	// without threads the listing is read here instead
+	if (!os::start_background(read_job, NULL))
+		read_job(NULL);
+}
+
+void enter(const char* name)
+{
+	char path[sizeof(folder)];
+	strcpy(path, folder);
+
+	if (strcmp(name, ".."))
+	{
+		if ((strlen(join(name)) + 1) > sizeof(folder)) return;
+		open(join(name));
+		return;
+	}
+
+	char* part = last_part(path);
+	if (part[0] == 0) return; // root
+	if (!strcmp(part, ".")) strcpy(part, "..");
+	else if (!strcmp(part, ".."))
+	{
+		if ((strlen(path) + 4) > sizeof(path)) return;
+		strcat(path, "/..");
+	}
+	else if (part == path) strcpy(path, ".");
+	else if (part == (path + 1) || part[-2] == ':') part[0] = 0; // keep the root's separator
+	else part[-1] = 0;
+	open(path);
+}
+
+void close()
+{
+	{
+		BackgroundLock lock;
+		cancel = true;
+	}
+	os::wait_background();
+}
+
+bool busy()
+{
+	BackgroundLock lock;
+	return reading;
+}
+
+int revision()
+{
+	BackgroundLock lock;
+	return change;
+}
+
+int count()
+{
+	BackgroundLock lock;
+	return listed;
+}
+
+bool get_entry(int index, Entry* entry)
+{
+	BackgroundLock lock;
+	if (index < 0 || index >= listed) return false;
+	*entry = entries[index];
+	return true;
+}
+
+void want(int first, int count)
+{
+	BackgroundLock lock;
+	want_first = (first < 0) ? 0 : first;
+	want_count = count;
+}
+
+const char* get_folder()
+{
+	return folder;
+}
+
+const char* join(const char* name)
+{
+	return join_path(name, joined);
+}
+
+} // namespace browser
+
+// end of file
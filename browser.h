@@ -0,0 +1,38 @@
+#pragma once
+
+// browser.h
+//   folder listing for the file browser, song details are read in the background
+
+#include "files.h" // for files::SongInfo
+
+namespace browser
+{
+
+struct Entry
+{
+	char name[256];
+	bool folder;
+	bool ready; // info has been read, or reading it failed
+	bool valid; // info describes a song
+	files::SongInfo info;
+};
+
+// lists a folder in the background, replacing the previous listing
+extern void open(const char* path);
+// opens a folder of the current listing, ".." for its parent
+extern void enter(const char* name);
+// stops the background work, the listing remains
+extern void close();
+
+extern bool busy(); // true until every entry is ready
+extern int  revision(); // changes whenever the listing or an entry changes
+extern int  count(); // entries listed so far, folders first
+extern bool get_entry(int index, Entry* entry); // copies an entry, false if out of range
+extern void want(int first, int count); // these entries are read before the rest
+
+extern const char* get_folder();
+extern const char* join(const char* name); // path of a name in the folder, valid until the next call
+
+} // namespace browser
+
+// end of file
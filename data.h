@@ -5,31 +5,54 @@
 
 #include "os.h"
 
+// rectangle of an icon in the atlas
 typedef struct
 {
+    int x;
+    int y;
     int w;
     int h;
-    const unsigned char* d;
 } IconData;
 
 typedef struct
 {
     unsigned int len;
-    const sint16* d;
+    unsigned int offset; // in ASSET_SAMPLES
 } SampleData;
 
-const unsigned int ZST_SIZE = 307035;
-extern const unsigned char zst_block[ZST_SIZE];
+// an asset compressed in data.pak, which is linked into the program
+typedef struct
+{
+    unsigned int offset; // in data.pak
+    unsigned int packed; // compressed size
+    unsigned int size;
+    unsigned int word; // bytes in each little endian value
+} AssetData;
+
+enum {
+    ASSET_ZST,
+    ASSET_S9X,
+    ASSET_SAMPLES,
+    ASSET_ATLAS,
+    ASSET_COUNT
+};
+
+extern const AssetData assetdata[ASSET_COUNT];
 
-const unsigned int S9X_SIZE = 71609;
-extern const unsigned char s9x_block[S9X_SIZE];
+// unpacks an asset on first use, NULL if it could not be unpacked
+extern const void* asset_block(int asset);
+
+const unsigned int ZST_SIZE = 307035; // ASSET_ZST
+const unsigned int S9X_SIZE = 71609; // ASSET_S9X
 
-extern const sint16 sample_block[];
 extern const SampleData sampledata[(15*13)+8];
 
+const int ATLAS_W = 512;
+const int ATLAS_H = 551;
+// ASSET_ATLAS is ATLAS_W*ATLAS_H of 0x00RRGGBB, magenta is transparent
+
 const int ICON_COUNT = 69;
-extern const unsigned char icon_block[];
-extern const IconData* icondata[ICON_COUNT];
+extern const IconData icondata[ICON_COUNT];
 
 enum {
     ICON_BG,
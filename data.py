@@ -1,20 +1,23 @@
 # data builder for mariopants
-# builds contents of data/ folder into data.h and data.cpp
+# builds contents of data/ folder into data.h, data.cpp and data.pak
 #
 # python 3
 
 import array
 import struct
 import os
+import sys
+import zlib
 
 folder = "data"
+ATLAS_W = 512 # width of the packed icon atlas
 
 def get_files(folder):
     f = []
     for (root, folders, files) in os.walk(folder):
         for filename in files:
             f.append(os.path.join(root,filename))
-    return f
+    return sorted(f) # keeps the icon enum stable across platforms
 
 def build_icon(file):
     f = open(file, mode="rb")
@@ -126,29 +129,51 @@ def build_samples(file):
         sample_start = sample_end
     return entries
 
+# packs icons into rows of one atlas image, tallest first
+# returns (w, h, pixels, rects) with rects in the order of icons
+def build_atlas(icons, atlas_w):
+    order = sorted(range(len(icons)), key=lambda i: (-icons[i][2], icons[i][0]))
+    rects = [None] * len(icons)
+    x = 0
+    y = 0
+    row_h = 0
+    for i in order:
+        (name,w,h,d) = icons[i]
+        if (x + w) > atlas_w:
+            x = 0
+            y += row_h
+            row_h = 0
+        rects[i] = (x,y,w,h)
+        x += w
+        row_h = max(row_h, h)
+    atlas_h = y + row_h
+    # unused space is transparent magenta, like the transparent pixels of icons
+    a = array.array("B",[0xFF,0x00,0xFF,0x00]*(atlas_w*atlas_h))
+    for i in range(len(icons)):
+        (name,w,h,d) = icons[i]
+        (ax,ay,aw,ah) = rects[i]
+        for y in range(0,h):
+            dst = ((ay+y)*atlas_w+ax)*4
+            a[dst:dst+(w*4)] = d[(y*w*4):((y+1)*w*4)]
+    print("build_atlas() > %d x %d" % (atlas_w,atlas_h))
+    return (atlas_w, atlas_h, a, rects)
+
 def build_bin(file):
     f = open(file,"rb")
     d = f.read()
     print("build_zst(%s) > %d bytes" % (file,len(d)))
     return d
 
-def hex_block(d):
-    s = "  { "
-    for i in range(0,len(d)):
-        s += ("0x%02X," % (d[i]))
-        if (i & 15) == 15:
-            s += "\n    "
-    s += "}"
-    return s
-
-def int_block(d):
-    s = "  { "
-    for i in range(0,len(d)):
-        s += ("%6d," % (d[i]))
-        if (i & 15) == 15:
-            s += "\n    "
-    s += "}"
-    return s
+# converts RGBA bytes to 0x00RRGGBB words, the layout of a 32-bit SDL display,
+# transparent pixels are magenta, the colour key
+def display_pixels(d):
+    p = array.array("I",[0]*(len(d)//4))
+    for i in range(0,len(p)):
+        if d[(i*4)+3] < 128:
+            p[i] = 0xFF00FF
+        else:
+            p[i] = (d[(i*4)+0] << 16) | (d[(i*4)+1] << 8) | d[(i*4)+2]
+    return p
 
 # main
 
@@ -169,6 +194,33 @@ if __name__ == "__main__":
             zst = build_bin(f)
         if (f.endswith(".000")):
             s9x = build_bin(f)
+    (atlas_w, atlas_h, atlas, rects) = build_atlas(icons, ATLAS_W)
+    sample_block = array.array("h",[])
+    for (l,d) in samples:
+        sample_block.extend(d)
+    # assets are compressed one after another into data.pak, little endian
+    # whatever machine runs this script, asset_block() swaps them for big endian
+    atlas_pixels = display_pixels(atlas)
+    if sys.byteorder == "big":
+        sample_block.byteswap()
+        atlas_pixels.byteswap()
+    assets = [
+        ("ZST", bytes(zst), 1),
+        ("S9X", bytes(s9x), 1),
+        ("SAMPLES", sample_block.tobytes(), 2),
+        ("ATLAS", atlas_pixels.tobytes(), 4),
+        ]
+    pack = bytearray()
+    index = []
+    for (name,d,word) in assets:
+        z = zlib.compress(d, 9)
+        index.append((name, len(pack), len(z), len(d), word))
+        print("pack %s > %d bytes, %d packed" % (name,len(d),len(z)))
+        pack += z
+    o = open("data.pak", "wb")
+    o.write(pack)
+    o.close()
+    print("data.pak saved.");
     # format data into text
     # header
     h  = "#pragma once\n"
@@ -178,31 +230,52 @@ if __name__ == "__main__":
     h += "\n"
     h += "#include \"os.h\"\n"
     h += "\n"
+    h += "// rectangle of an icon in the atlas\n"
     h += "typedef struct\n"
     h += "{\n"
+    h += "    int x;\n"
+    h += "    int y;\n"
     h += "    int w;\n"
     h += "    int h;\n"
-    h += "    const unsigned char* d;\n"
     h += "} IconData;\n"
     h += "\n"
     h += "typedef struct\n"
     h += "{\n"
     h += "    unsigned int len;\n"
-    h += "    const sint16* d;\n"
+    h += "    unsigned int offset; // in ASSET_SAMPLES\n"
     h += "} SampleData;\n"
     h += "\n"
-    h += ("const unsigned int ZST_SIZE = %d;\n" % (len(zst)))
-    h += "extern const unsigned char zst_block[ZST_SIZE];\n"
+    h += "// an asset compressed in data.pak, which is linked into the program\n"
+    h += "typedef struct\n"
+    h += "{\n"
+    h += "    unsigned int offset; // in data.pak\n"
+    h += "    unsigned int packed; // compressed size\n"
+    h += "    unsigned int size;\n"
+    h += "    unsigned int word; // bytes in each little endian value\n"
+    h += "} AssetData;\n"
+    h += "\n"
+    h += "enum {\n"
+    for (name,offset,packed,size,word) in index:
+        h += ("    ASSET_%s,\n" % (name))
+    h += "    ASSET_COUNT\n"
+    h += "};\n"
+    h += "\n"
+    h += "extern const AssetData assetdata[ASSET_COUNT];\n"
+    h += "\n"
+    h += "// unpacks an asset on first use, NULL if it could not be unpacked\n"
+    h += "extern const void* asset_block(int asset);\n"
     h += "\n"
-    h += ("const unsigned int S9X_SIZE = %d;\n" % (len(s9x)))
-    h += "extern const unsigned char s9x_block[S9X_SIZE];\n"
+    h += ("const unsigned int ZST_SIZE = %d; // ASSET_ZST\n" % (len(zst)))
+    h += ("const unsigned int S9X_SIZE = %d; // ASSET_S9X\n" % (len(s9x)))
     h += "\n"
-    h += "extern const sint16 sample_block[];\n"
     h += "extern const SampleData sampledata[(15*13)+8];\n"
     h += "\n"
+    h += ("const int ATLAS_W = %d;\n" % (atlas_w))
+    h += ("const int ATLAS_H = %d;\n" % (atlas_h))
+    h += "// ASSET_ATLAS is ATLAS_W*ATLAS_H of 0x00RRGGBB, magenta is transparent\n"
+    h += "\n"
     h += ("const int ICON_COUNT = %d;\n" % (len(icons)))
-    h += "extern const unsigned char icon_block[];\n"
-    h += "extern const IconData* icondata[ICON_COUNT];\n"
+    h += "extern const IconData icondata[ICON_COUNT];\n"
     h += "\n"
     h += "enum {\n"
     for (name,w,h_,d) in icons:
@@ -219,52 +292,108 @@ if __name__ == "__main__":
     s  = "// data.cpp\n"
     s += "//   auto generated by data.py\n"
     s += "\n"
+    s += "#include <cstdlib> // malloc, free\n"
     s += "#include \"data.h\"\n"
     s += "\n"
-    s += "const unsigned char zst_block[ZST_SIZE] =\n"
-    s += hex_block(zst)
-    s += ";\n"
+    s += "#ifdef __unix__\n"
+    s += "    #include \"zlib.h\"\n"
+    s += "#else\n"
+    s += "    #include <zlib/zlib.h>\n"
+    s += "#endif\n"
     s += "\n"
-    print("zst_block[] complete.");
-    s += "const unsigned char s9x_block[S9X_SIZE] =\n"
-    s += hex_block(s9x)
-    s += ";\n"
+    s += "#if defined(_MSC_VER)\n"
     s += "\n"
-    print("s9x_block[] complete.");
-    data_block = array.array("i",[])
-    for (l,d) in samples:
-        data_block.extend(d)
-    s += "const sint16 sample_block[] =\n"
-    s += int_block(data_block)
-    s += ";\n"
+    s += "#define WIN32_LEAN_AND_MEAN\n"
+    s += "#include <windows.h>\n"
+    s += "\n"
+    s += "// MSVC has no .incbin, mariopants.rc links data.pak as a resource instead\n"
+    s += "static const unsigned char* pack_block()\n"
+    s += "{\n"
+    s += "    HRSRC r = FindResourceA(NULL, \"DATA_PACK\", MAKEINTRESOURCEA(10)); // RT_RCDATA\n"
+    s += "    HGLOBAL g = (r == NULL) ? NULL : LoadResource(NULL, r);\n"
+    s += "    return (g == NULL) ? NULL : (const unsigned char*)LockResource(g);\n"
+    s += "}\n"
     s += "\n"
-    print("sample_block[] complete.");
-    data_block = array.array("B",[])
-    for (name,w,h,d) in icons:
-        data_block.extend(d)
-    s += "const unsigned char icon_block[] =\n"
-    s += hex_block(data_block)
-    s += ";\n"
+    s += "#else\n"
+    s += "\n"
+    s += "// data.pak is found next to data.cpp, or in an -I include folder\n"
+    s += "#ifdef __APPLE__\n"
+    s += "    #define PACK_SECTION \".const\"\n"
+    s += "    #define PACK_SYMBOL \"_data_pak\"\n"
+    s += "#else\n"
+    s += "    #define PACK_SECTION \".section .rodata\"\n"
+    s += "    #define PACK_SYMBOL \"data_pak\"\n"
+    s += "#endif\n"
+    s += "\n"
+    s += "__asm__(\n"
+    s += "    PACK_SECTION \"\\n\"\n"
+    s += "    \".globl \" PACK_SYMBOL \"\\n\"\n"
+    s += "    PACK_SYMBOL \":\\n\"\n"
+    s += "    \".incbin \\\"data.pak\\\"\\n\"\n"
+    s += "    \".text\\n\");\n"
+    s += "\n"
+    s += "extern \"C\" const unsigned char data_pak[];\n"
+    s += "\n"
+    s += "static const unsigned char* pack_block()\n"
+    s += "{\n"
+    s += "    return data_pak;\n"
+    s += "}\n"
+    s += "\n"
+    s += "#endif\n"
+    s += "\n"
+    s += "const AssetData assetdata[ASSET_COUNT] = {\n"
+    for (name,offset,packed,size,word) in index:
+        s += ("    { %7d, %7d, %7d, %d }, // %s\n" % (offset,packed,size,word,name))
+    s += "};\n"
+    s += "\n"
+    s += "static void* unpacked[ASSET_COUNT];\n"
+    s += "\n"
+    s += "const void* asset_block(int asset)\n"
+    s += "{\n"
+    s += "    if (asset < 0 || asset >= ASSET_COUNT) return NULL;\n"
+    s += "    if (unpacked[asset] != NULL) return unpacked[asset];\n"
+    s += "\n"
+    s += "    const AssetData& a = assetdata[asset];\n"
+    s += "    const unsigned char* pack = pack_block();\n"
+    s += "    void* block = malloc((a.size > 0) ? a.size : 1);\n"
+    s += "    uLongf size = a.size;\n"
+    s += "    if (pack == NULL || block == NULL ||\n"
+    s += "        Z_OK != uncompress((Bytef*)block, &size, pack + a.offset, a.packed) ||\n"
+    s += "        size != a.size)\n"
+    s += "    {\n"
+    s += "        free(block);\n"
+    s += "        return NULL;\n"
+    s += "    }\n"
+    s += "\n"
+    s += "    // data.pak is little endian, a big endian host swaps each value\n"
+    s += "    const unsigned int one = 1;\n"
+    s += "    if (*(const unsigned char*)&one == 0)\n"
+    s += "    {\n"
+    s += "        unsigned char* b = (unsigned char*)block;\n"
+    s += "        for (unsigned int i=0; (i + a.word) <= a.size; i += a.word)\n"
+    s += "        for (unsigned int j=0; j < (a.word / 2); ++j)\n"
+    s += "        {\n"
+    s += "            unsigned char t = b[i+j];\n"
+    s += "            b[i+j] = b[i+a.word-1-j];\n"
+    s += "            b[i+a.word-1-j] = t;\n"
+    s += "        }\n"
+    s += "    }\n"
+    s += "    unpacked[asset] = block;\n"
+    s += "    return block;\n"
+    s += "}\n"
     s += "\n"
-    print("icon_block[] complete.");
     s += "const SampleData sampledata[(15*13)+8] = {\n"
     data_offset = 0
     for (l,d) in samples:
-        s += ("    { %d, sample_block + %d },\n" % \
-              (l,data_offset))
+        s += ("    { %d, %d },\n" % (l,data_offset))
         data_offset += len(d)
     s += "};\n"
     s += "\n"
     print("sampledata[] complete.");
-    data_offset = 0
-    for (name,w,h,d) in icons:
-        s += ("const IconData icondata_%s = { %d, %d, icon_block + %d };\n" % \
-              (name,w,h,data_offset))
-        data_offset += len(d)
-    s += "\n"
-    s += "const IconData* icondata[ICON_COUNT] = {\n"
-    for (name,w,h,d) in icons:
-        s += ("    &icondata_%s,\n" % (name))
+    s += "const IconData icondata[ICON_COUNT] = {\n"
+    for i in range(len(icons)):
+        (x,y,w,h) = rects[i]
+        s += ("    { %3d, %3d, %3d, %3d }, // %s\n" % (x,y,w,h,icons[i][0]))
     s += "};\n"
     s += "\n"
     print("icondata[] complete.");
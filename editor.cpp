@@ -1,15 +1,18 @@
 // editor.cpp
 //   the mariopants editor
 
-#include <cstring> // memset, strlen
+#include <cstring> // memset, memcmp, strlen
+#include <cstdlib> // malloc, realloc, free
 #include <cstdio> // sprintf
 #include <cmath> // sin
 #include "editor.h"
+#include "song.h"
 #include "files.h"
 #include "data.h"
 #include "os.h"
 #include "gui.h"
 #include "player.h"
+#include "browser.h"
 
 namespace editor
 {
@@ -21,11 +24,17 @@ const unsigned int END_STOP = 2000; // ms to stop after end of song reached
 
 const int MAX_TEMPO = 0x9F;
 
-const int UNDO_SIZE = 2048;
+const unsigned int UNDO_BUDGET = 256 * 1024; // bytes of packed undo history kept
+const int UNDO_HEADER = 72; // song fields stored by undo
 
 const int INFO_TITLE_Y = 64;
 const int INFO_AUTHOR_Y = INFO_TITLE_Y + 24;
 
+const int BROWSE_Y = 40; // first row of the file browser
+const int BROWSE_ROWS = 9;
+const int BROWSE_DETAIL_Y = 127; // title and author of the selected song
+const unsigned int PREVIEW_WAIT = 300; // ms an entry is selected before its preview plays
+
 const int inst_icon[17] = {
 	ICON_INST0, ICON_INST1, ICON_INST2, ICON_INST3, ICON_INST4, ICON_INST5, ICON_INST6, ICON_INST7,
 	ICON_INST8, ICON_INST9, ICON_INSTA, ICON_INSTB, ICON_INSTC, ICON_INSTD, ICON_INSTE, ICON_INSTF,
@@ -35,21 +44,6 @@ const int num_icon[10] = {
 	ICON_NUMBER0, ICON_NUMBER1, ICON_NUMBER2, ICON_NUMBER3, ICON_NUMBER4,
 	ICON_NUMBER5, ICON_NUMBER6, ICON_NUMBER7, ICON_NUMBER8, ICON_NUMBER9 };
 
-enum { // undo actions
-	UNDO_COL, // column of notes
-	UNDO_TEMPO,
-	UNDO_METRE,
-	UNDO_LENGTH,
-	UNDO_LOOP,
-	UNDO_TITLE,
-	UNDO_AUTHOR,
-	UNDO_DELETE, // delete a column on undo
-	UNDO_INSERT, // insert a column on undo
-	UNDO_MULTI, // causes previous UNDO actions to be undone as a group
-	UNDO_CLEAR, // not undoable, this marks the beginning of the list
-	UNDO_BLANK, // do nothing operation for initialization
-};
-
 enum { // editor sounds, all play on "instrument 15"
        // note: index starts at 1, because there is an internal -1 on note value
 	SOUND_STARTUP = 1,
@@ -70,6 +64,8 @@ enum { // right click behaviour
 
 // editor state
 
+// the player only reads notes while playing, and any edit stops playback,
+// so note storage can grow or move without locking audio
 static Song song;
 
 static int instrument;
@@ -77,6 +73,7 @@ static bool play;
 static int scroll;
 static int scroll_fine;
 static bool info;
+static bool browse; // file browser replaces the pattern
 
 static int info_focus; // selected infobox field
 static int channel_select; // 0 = all, 1-3 = A,B,C
@@ -96,16 +93,37 @@ int playback_beat;
 unsigned int playback_end;
 int playback_tempo;
 
-typedef struct {
-	unsigned char action;
-	unsigned char param[8];
-} UndoEntry;
-
-UndoEntry undo_buffer[UNDO_SIZE];
-int undo_index;
-int undo_change;
-
-unsigned char clipboard[576 * EXTRA_SIZE];
+// undo history, one record per user action
+//   a record replaces the columns [at,at+before) with after columns,
+//   and XORs the song fields, its packed data holds:
+//     UNDO_HEADER bytes of song fields XOR
+//     before == after: the columns XOR
+//     otherwise: the before columns then the after columns
+typedef struct UndoRecord {
+	struct UndoRecord* prev;
+	struct UndoRecord* next;
+	int serial; // state id after this record
+	int at;
+	int before;
+	int after;
+	unsigned int size; // packed data bytes
+	unsigned char data[1];
+} UndoRecord;
+
+UndoRecord* undo_first; // oldest
+UndoRecord* undo_last; // newest, records after undo_current can be redone
+UndoRecord* undo_current; // last applied, NULL if at the oldest state
+unsigned int undo_bytes; // total size of records
+int undo_base; // state id before undo_first
+int undo_serial; // last state id issued
+int undo_change; // state id of the saved file, -1 if unreachable
+Song undo_shadow; // song as of the last undo record
+bool undo_dirty; // song edited since undo_shadow, commit_undo has work to do
+unsigned char undo_raw[UNDO_HEADER + (2 * COLUMN_SIZE * SONG_MAX)];
+unsigned char undo_packed[sizeof(undo_raw) + (sizeof(undo_raw) / 128) + 2];
+
+unsigned char* clipboard; // grows to fit the largest selection copied
+int clip_capacity;
 int clip_left;
 int clip_right;
 int clip_len;
@@ -115,14 +133,29 @@ static int mousex, mousey;
 
 char current_file[1024] = "";
 
+// file browser
+static bool browse_listed; // the browser has been opened before
+static int browse_top; // first row shown
+static int browse_select;
+static int browse_seen; // browser revision last drawn
+static Song preview_song; // the first beats of the selected song
+static bool previewing;
+static int preview_entry; // entry previewed, -1 if none
+static unsigned int preview_wait;
+
 // *--------------------------------------------------------------------------*
 // editor state actions
 
 // forward declarations
-void push_undo(unsigned char action, int param);
+void reset_undo();
+void commit_undo();
+int undo_state();
 void preview_note(int note, int inst);
 void preview_column(int sx);
 void refresh_limit();
+int scroll_limit();
+void close_browse();
+void set_browse_top(int top);
 
 // song modifiers
 
@@ -135,11 +168,7 @@ void clear_song(bool confirm)
 			return;
 	}
 
-	for (int i=0; i < sizeof(song.notes); i+=2)
-	{
-		song.notes[i+0] = 0xFF;
-		song.notes[i+1] = 0xDF;
-	}
+	song_resize(&song,0);
 	song.tempo = 80;
 	song.metre = 4;
 	song.length = 96;
@@ -149,7 +178,8 @@ void clear_song(bool confirm)
 	memset(song.author,0,sizeof(song.author));
 
 	song.changed = false;
-	push_undo(UNDO_CLEAR,0);
+	reset_undo();
+	files::free_export_cache();
 	clip_left = -10;
 	clip_right = -11;
 	clip_len = 0;
@@ -167,21 +197,18 @@ void collapse_col(int sx)
 	if (sx < 0) return;
 	if (sx > song.limit) return;
 
-	int index = 6*sx;
+	unsigned char* c = song_edit(&song,sx);
+	if (c == NULL) return;
 
-	if (song.notes[index+0] != 0xFF && song.notes[index+2] == 0xFF)
+	if (c[0] != VOICE_EMPTY && c[1] == VOICE_EMPTY)
 	{
-		song.notes[index+2] = song.notes[index+0];
-		song.notes[index+3] = song.notes[index+1];
-		song.notes[index+0] = 0xFF;
-		song.notes[index+1] = 0xDF;
+		c[1] = c[0];
+		c[0] = VOICE_EMPTY;
 	}
-	if (song.notes[index+2] != 0xFF && song.notes[index+4] == 0xFF)
+	if (c[1] != VOICE_EMPTY && c[2] == VOICE_EMPTY)
 	{
-		song.notes[index+4] = song.notes[index+2];
-		song.notes[index+5] = song.notes[index+3];
-		song.notes[index+2] = 0xFF;
-		song.notes[index+3] = 0xDF;
+		c[2] = c[1];
+		c[1] = VOICE_EMPTY;
 	}
 }
 
@@ -198,9 +225,9 @@ void set_note(int sx, int note, int inst)
 	{
 		if (sx < 1) return;
 		if (sx > song.limit) sx = song.limit;
-		push_undo(UNDO_LENGTH,0);
 		song.length = sx;
 		song.changed = true;
+		undo_dirty = true;
 		preview_note(SOUND_LENGTH,15);
 		return;
 	}
@@ -212,11 +239,11 @@ void set_note(int sx, int note, int inst)
 	{
 		bool erased = false;
 
+		const unsigned char* c = song_column(&song,sx);
 		int note_to_erase = -1;
 		for (int i=0; i<3; ++i)
 		{
-			int index = (6*sx)+(2*i);
-			if(song.notes[index] == note)
+			if(c[i] != VOICE_EMPTY && voice_note(c[i]) == note)
 			{
 				if ( note_to_erase == -1 || // take first note found
 				   (i == (3 - channel_select))) // or give this channel priority if selected
@@ -225,12 +252,12 @@ void set_note(int sx, int note, int inst)
 		}
 		if (note_to_erase >= 0)
 		{
-			int index = (6*sx)+(2*note_to_erase);
-			push_undo(UNDO_COL,sx);
-			song.notes[index+0] = 0xFF;
-			song.notes[index+1] = 0xDF;
+			unsigned char* e = song_edit(&song,sx);
+			if (e == NULL) return;
+			e[note_to_erase] = VOICE_EMPTY;
 			if(channel_select==0) collapse_col(sx);
 			song.changed = true;
+			undo_dirty = true;
 			preview_note(SOUND_ERASE,15);
 		}
 		return;
@@ -240,27 +267,26 @@ void set_note(int sx, int note, int inst)
 		bool noted = false;
 		preview_note(note,inst);
 
+		unsigned char* c = song_edit(&song,sx);
+		if (c == NULL) return;
+
 		if (channel_select > 0) // note on specific channel
 		{
 			int i = 3 - channel_select;
-			int index = (6*sx)+(2*i);
-			push_undo(UNDO_COL,sx);
-			song.notes[index+0] = note;
-			song.notes[index+1] = inst;
+			c[i] = make_voice(note,inst);
 			song.changed = true;
+			undo_dirty = true;
 			noted = true;
 		}
 		else // find first free channel
 		{
 			for (int i=2; i>=0; --i)
 			{
-				int index = (6*sx)+(2*i);
-				if (song.notes[index] == 0xFF)
+				if (c[i] == VOICE_EMPTY)
 				{
-					push_undo(UNDO_COL,sx);
-					song.notes[index+0] = note;
-					song.notes[index+1] = inst;
+					c[i] = make_voice(note,inst);
 					song.changed = true;
+					undo_dirty = true;
 					noted = true;
 					break;
 				}
@@ -275,48 +301,43 @@ void set_note(int sx, int note, int inst)
 	}
 }
 
-bool delete_column(int sx, bool undo)
+bool delete_columns(int sx, int n)
 {
-	if (sx < 0 || sx >= song.length) return false;
-	if (undo) push_undo(UNDO_INSERT,sx);
-	for (int i=sx; (i+1) < (96*EXTRA_SIZE); ++i)
-		memcpy(song.notes+(i*6),song.notes+((i+1)*6),6);
-	--song.length;
-	song.notes[(((96*EXTRA_SIZE)-1)*6)+0] = 0xFF;
-	song.notes[(((96*EXTRA_SIZE)-1)*6)+1] = 0xDF;
-	song.notes[(((96*EXTRA_SIZE)-1)*6)+2] = 0xFF;
-	song.notes[(((96*EXTRA_SIZE)-1)*6)+3] = 0xDF;
-	song.notes[(((96*EXTRA_SIZE)-1)*6)+4] = 0xFF;
-	song.notes[(((96*EXTRA_SIZE)-1)*6)+5] = 0xDF;
+	if (sx < 0 || sx >= song.length || n < 1) return false;
+	if (n > (song.length - sx)) n = song.length - sx;
+	song_delete(&song,sx,n);
+	song.length -= n;
+	undo_dirty = true;
 	return true;
 }
 
-bool insert_column(int sx, const unsigned char* col, bool undo)
+bool insert_columns(int sx, const unsigned char* cols, int n)
 {
-	if (sx < 0 || sx > song.length) return false;
-	if (undo) push_undo(UNDO_DELETE,sx);
-	for (int i=((96*EXTRA_SIZE)-1); i > sx; --i)
-		memcpy(song.notes+(i*6),song.notes+((i-1)*6),6);
-	memcpy(song.notes+(sx*6),col,6);
-	if (song.length < song.limit) ++song.length;
+	if (sx < 0 || sx > song.length || n < 1) return false;
+	if (!song_insert(&song,sx,cols,n)) return false;
+	song.length += n;
+	if (song.length > song.limit) song.length = song.limit;
+	undo_dirty = true;
 	return true;
 }
 
 bool set_column(int sx, const unsigned char* col)
 {
 	if (sx < 0 || sx >= song.length) return false;
-	push_undo(UNDO_COL,sx);
-	memcpy(song.notes+(sx*6),col,6);
+	unsigned char* c = song_edit(&song,sx);
+	if (c == NULL) return false;
+	memcpy(c,col,COLUMN_SIZE);
+	undo_dirty = true;
 	return true;
 }
 
 void set_tempo(int tempo)
 {
-	push_undo(UNDO_TEMPO,song.tempo);
 	song.tempo = tempo;
 	if      (song.tempo < 0        ) song.tempo = 0;
 	else if (song.tempo > MAX_TEMPO) song.tempo = MAX_TEMPO;
 	song.changed = true;
+	undo_dirty = true;
 }
 
 void tempo_up()   { set_tempo(song.tempo+1); }
@@ -324,9 +345,9 @@ void tempo_down() { set_tempo(song.tempo-1); }
 
 void set_metre(int metre)
 {
-	push_undo(UNDO_METRE,song.metre);
 	song.metre = metre;
 	song.changed = true;
+	undo_dirty = true;
 	preview_note(SOUND_CLICK,15);
 }
 
@@ -336,9 +357,9 @@ void toggle_metre() { set_metre((song.metre==4)?3:4); }
 
 void set_loop(bool loop)
 {
-	push_undo(UNDO_LOOP,song.loop);
 	song.loop = loop;
 	song.changed = true;
+	undo_dirty = true;
 	preview_note(SOUND_CLICK,15);
 }
 
@@ -359,11 +380,20 @@ void set_scroll(int scroll_)
 {
 	scroll = scroll_;
 	if (scroll < 0 ) scroll = 0;
-	if (scroll > (song.limit-4)) scroll = (song.limit-4);
+	if (scroll > (scroll_limit()-4)) scroll = (scroll_limit()-4);
+}
+
+void scroll_up()
+{
+	if (browse) set_browse_top(browse_top+1);
+	else        set_scroll(scroll+1);
 }
 
-void scroll_up()   { set_scroll(scroll+1); }
-void scroll_down() { set_scroll(scroll-1); }
+void scroll_down()
+{
+	if (browse) set_browse_top(browse_top-1);
+	else        set_scroll(scroll-1);
+}
 
 void stop()
 {
@@ -374,6 +404,7 @@ void stop()
 
 void begin_play(bool from_start)
 {
+	close_browse();
 	os::pause_audio(true); // pause to make sure we can get the beat length before it starts
 
 	player::play_song();
@@ -434,8 +465,8 @@ void save()
 	preview_note(SOUND_CLICK,15);
 	os::pause_audio(true);
 
-	const char* SAVE_MASKS[5] = { "*.sho", "*.zst", "*.000", "*.wav", "*.*" };
-	const char* filename = os::file_save(current_file,5,SAVE_MASKS);
+	const char* SAVE_MASKS[6] = { "*.sho", "*.zst", "*.000", "*.wav", "*.flac", "*.*" };
+	const char* filename = os::file_save(current_file,6,SAVE_MASKS);
 	if (filename)
 	{
 		if (!files::save_file(filename, &song))
@@ -448,14 +479,14 @@ void save()
 			current_file[sizeof(current_file)-1] = 0;
 			if (!files::match_extension(filename,".wav"))
 			{
+				commit_undo();
 				song.changed = false;
-				undo_change = undo_index;
+				undo_change = undo_state();
 				os::set_caption(current_file);
 			}
 		}
 	}
 
-	player::set_samplerate(samplerate); // .wav export changes samplerate
 	os::pause_audio(false);
 }
 
@@ -477,12 +508,12 @@ void quick_save()
 	{
 		if (!files::match_extension(current_file,".wav"))
 		{
+			commit_undo();
 			song.changed = false;
-			undo_change = undo_index;
+			undo_change = undo_state();
 		}
 	}
 
-	player::set_samplerate(samplerate); // .wav export changes samplerate
 	os::pause_audio(false);
 }
 
@@ -492,8 +523,8 @@ void multi_save()
 	preview_note(SOUND_CLICK,15);
 	os::pause_audio(true);
 
-	const char* SAVE_MASKS[2] = { "*.000", "*.zs0" };
-	const char* filename = os::file_save(current_file,2,SAVE_MASKS);
+	const char* SAVE_MASKS[3] = { "*.000", "*.zs0", "*.wav" };
+	const char* filename = os::file_save(current_file,3,SAVE_MASKS);
 	if (filename)
 	{
 		if (!files::save_multi_file(filename, &song))
@@ -505,6 +536,26 @@ void multi_save()
 	os::pause_audio(false);
 }
 
+bool load_song(const char* filename)
+{
+	if (!files::load_file(filename, &song))
+	{
+		os::alert(files::get_file_error());
+		return false;
+	}
+
+	strncpy(current_file,filename,sizeof(current_file));
+	current_file[sizeof(current_file)-1] = 0;
+	if (song.changed)
+		os::alert("Errors were found in the file.\n"
+		          "These have been automatically corrected.");
+	reset_undo();
+	files::free_export_cache();
+	scroll = 0;
+	os::set_caption(current_file);
+	return true;
+}
+
 void load()
 {
 	preview_note(SOUND_CLICK,15);
@@ -517,24 +568,7 @@ void load()
 
 	const char* LOAD_MASKS[4] = { "*.sho", "*.zst", "*.000", "*.*" };
 	const char* filename = os::file_load(current_file,4,LOAD_MASKS);
-	if (filename)
-	{
-		if (!files::load_file(filename, &song))
-		{
-			os::alert(files::get_file_error());
-		}
-		else
-		{
-			strncpy(current_file,filename,sizeof(current_file));
-			current_file[sizeof(current_file)-1] = 0;
-			if (song.changed)
-				os::alert("Errors were found in the file.\n"
-				          "These have been automatically corrected.");
-			push_undo(UNDO_CLEAR,0);
-			scroll = 0;
-			os::set_caption(current_file);
-		}
-	}
+	if (filename) load_song(filename);
 	refresh_limit();
 }
 
@@ -548,181 +582,470 @@ void toggle_info()
 {
 	preview_note(SOUND_CLICK,15);
 	info = !info;
+	if (info) close_browse();
+}
+
+// file browser
+//   the listing and song details come from browser, read in the background,
+//   and the selected song's first beats play once it has been selected a moment
+
+void stop_preview()
+{
+	preview_entry = -1;
+	if (!previewing) return;
+
+	player::stop_song();
+	player::silence();
+	player::setup(&song);
+	player::set_samplerate(samplerate);
+	previewing = false;
 }
 
-void push_undo(unsigned char action, int param)
+void start_preview(const files::SongInfo& details)
 {
-	// UNDO_CLEAR resets the undo entirely
-	if (action == UNDO_CLEAR)
+	int columns = (details.length < files::INFO_COLUMNS) ? details.length : files::INFO_COLUMNS;
+	song_resize(&preview_song,0);
+	if (!song_insert(&preview_song,0,details.notes,columns)) return;
+	preview_song.length = columns;
+	preview_song.limit = 96;
+	preview_song.tempo = details.tempo;
+	preview_song.metre = details.metre;
+	preview_song.loop = false;
+
+	player::setup(&preview_song);
+	player::set_samplerate(samplerate);
+	player::play_song();
+	previewing = true;
+}
+
+void update_preview(unsigned int ms)
+{
+	if (browse_select == preview_entry) return;
+
+	preview_wait += ms;
+	if (preview_wait < PREVIEW_WAIT) return;
+
+	browser::Entry e;
+	bool listed = browser::get_entry(browse_select,&e);
+	if (listed && !e.ready) return; // try again once it has been read
+
+	stop_preview();
+	preview_entry = browse_select;
+	if (listed && e.valid) start_preview(e.info);
+}
+
+int browse_limit()
+{
+	int limit = browser::count() - BROWSE_ROWS;
+	return (limit > 0) ? limit : 0;
+}
+
+void set_browse_top(int top)
+{
+	browse_top = top;
+	if (browse_top > browse_limit()) browse_top = browse_limit();
+	if (browse_top < 0) browse_top = 0;
+	browser::want(browse_top,BROWSE_ROWS);
+}
+
+void set_browse_select(int select)
+{
+	int count = browser::count();
+	if (select >= count) select = count - 1;
+	if (select < 0) select = 0;
+	if (select == browse_select) return;
+
+	browse_select = select;
+	preview_wait = 0;
+	stop_preview();
+
+	if (browse_select < browse_top)
+		set_browse_top(browse_select);
+	else if (browse_select >= (browse_top + BROWSE_ROWS))
+		set_browse_top(browse_select - BROWSE_ROWS + 1);
+}
+
+void open_browse()
+{
+	info = false;
+	browse = true;
+
+	if (!browse_listed) // start in the folder of the current file
 	{
-		undo_buffer[0].action = UNDO_CLEAR;
-		undo_index = 0;
+		char folder[sizeof(current_file)];
+		strcpy(folder,current_file);
+		char* end = strrchr(folder,'/');
+		char* end_back = strrchr(folder,'\\');
+		if (end_back != NULL && (end == NULL || end_back > end)) end = end_back;
+		if      (end == NULL)   strcpy(folder,".");
+		else if (end == folder) end[1] = 0; // root
+		else                    end[0] = 0;
+
+		browser::open(folder);
+		browse_listed = true;
+		browse_top = 0;
+		browse_select = 0;
+	}
+
+	preview_entry = browse_select; // wait for a new selection before previewing
+	set_browse_top(browse_top);
+	refresh_limit();
+}
+
+void close_browse()
+{
+	if (!browse) return;
+	stop_preview();
+	browse = false;
+	refresh_limit();
+}
+
+void toggle_browse()
+{
+	preview_note(SOUND_CLICK,15);
+	if (browse) close_browse();
+	else        open_browse();
+}
 
-		if (!song.changed)
-			undo_change = 0;
-		else // newly loaded song may have corrected data
-			undo_change = -1;
+// opens a folder, or loads a song
+void browse_open(int index)
+{
+	browser::Entry e;
+	if (!browser::get_entry(index,&e)) return;
 
-		for (int i=1; i < UNDO_SIZE; ++i)
-			undo_buffer[i].action = UNDO_BLANK;
+	preview_note(SOUND_CLICK,15);
+	stop_preview();
+
+	if (e.folder)
+	{
+		browser::enter(e.name);
+		browse_top = 0;
+		browse_select = 0;
+		preview_entry = 0; // ".." has nothing to preview
+		set_browse_top(0);
 		return;
 	}
 
-	// move to next space in undo buffer
-	undo_index = (undo_index + 1) % UNDO_SIZE;
+	if (song.changed)
+	{
+		bool yesno = os::yesno("You have unsaved changes.\nProceed?");
+		if (!yesno) return;
+	}
 
-	// if we've hit the clear point, need to move it forward
-	if (undo_buffer[undo_index].action == UNDO_CLEAR)
+	if (load_song(browser::join(e.name)))
+		close_browse();
+	refresh_limit();
+}
+
+// the browser row at a screen position, -1 if none
+int browse_row(int y)
+{
+	if (y < BROWSE_Y) return -1;
+	int row = (y - BROWSE_Y) / 9;
+	return (row < BROWSE_ROWS) ? row : -1;
+}
+
+// keys that move around the browser, returns false for other keys
+bool browse_key(SDLKey key)
+{
+	switch (key)
 	{
-		int next_index = (undo_index+1)%UNDO_SIZE;
-		undo_buffer[next_index].action = UNDO_CLEAR;
-		if (next_index == undo_change)
-			undo_change = -1; // no longer possible to undo to unchanged state
+		case SDLK_UP:        set_browse_select(browse_select-1);           break;
+		case SDLK_DOWN:      set_browse_select(browse_select+1);           break;
+		case SDLK_PAGEUP:    set_browse_select(browse_select-BROWSE_ROWS); break;
+		case SDLK_PAGEDOWN:  set_browse_select(browse_select+BROWSE_ROWS); break;
+		case SDLK_HOME:      set_browse_select(0);                         break;
+		case SDLK_END:       set_browse_select(browser::count()-1);        break;
+		case SDLK_RETURN:    browse_open(browse_select);                   break;
+		case SDLK_BACKSPACE: browse_open(0);                               break; // ".." is always first
+		case SDLK_ESCAPE:    toggle_browse();                              break;
+		default: return false;
 	}
-	if (undo_index == undo_change)
-		undo_change = -1; // no longer possible to undo to unchanged state
+	return true;
+}
+
+int undo_state()
+{
+	return undo_current ? undo_current->serial : undo_base;
+}
+
+void undo_free(UndoRecord* r)
+{
+	if (r->prev) r->prev->next = r->next;
+	else         undo_first = r->next;
+	if (r->next) r->next->prev = r->prev;
+	else         undo_last = r->prev;
+	undo_bytes -= sizeof(UndoRecord) + r->size;
+	free(r);
+}
+
+void reset_undo()
+{
+	while (undo_first) undo_free(undo_first);
+	undo_current = NULL;
+	undo_base = ++undo_serial;
+
+	if (!song.changed)
+		undo_change = undo_base;
+	else // newly loaded song may have corrected data
+		undo_change = -1;
 
-	UndoEntry& u = undo_buffer[undo_index];
-	u.action = action;
-	switch(action)
+	song_copy(&undo_shadow,&song);
+	undo_dirty = false;
+}
+
+void undo_header(const Song* s, unsigned char* h)
+{
+	memset(h,0,UNDO_HEADER);
+	h[0] = s->tempo;
+	h[1] = s->metre;
+	h[2] = s->loop ? 1 : 0;
+	h[4] = s->length & 0xFF;
+	h[5] = (s->length >> 8) & 0xFF;
+	h[6] = s->limit & 0xFF;
+	h[7] = (s->limit >> 8) & 0xFF;
+	memcpy(h+ 8,s->title, 32);
+	memcpy(h+40,s->author,32);
+}
+
+void undo_set_header(Song* s, const unsigned char* h)
+{
+	s->tempo  = h[0];
+	s->metre  = h[1];
+	s->loop   = (h[2] != 0);
+	s->length = h[4] + (h[5] << 8);
+	s->limit  = h[6] + (h[7] << 8);
+	memcpy(s->title, h+ 8,32);
+	memcpy(s->author,h+40,32);
+}
+
+// number of columns up to the last one that isn't blank
+int undo_extent(const Song* s)
+{
+	int e = s->size;
+	while (e > 0)
 	{
-		case UNDO_COL:
-			{
-				int sx = param;
-				u.param[0] = sx & 0xFF;
-				u.param[1] = (sx >> 8) & 0xFF;
-				for (int i=0; i < 6; ++i)
-					u.param[i+2] = song.notes[(sx*6)+i];
-			}
-			break;
-		case UNDO_TEMPO:  u.param[0] = song.tempo;  break;
-		case UNDO_METRE:  u.param[0] = song.metre;  break;
-		case UNDO_LENGTH:
-			u.param[0] = song.length & 0xFF;
-			u.param[1] = (song.length >> 8) & 0xFF;
-			break;
-		case UNDO_LOOP:   u.param[0] = song.loop;   break;
-		// UNDO_TITLE / UNDO_AUTHOR save two characters at end of string,
-		// restoring both of these will undo a character typed or deleted
-		case UNDO_TITLE:
-			u.param[0] = param;
-			u.param[1] = song.title[ param+0];
-			u.param[2] = song.title[ param+1];
-			break;
-		case UNDO_AUTHOR:
-			u.param[0] = param;
-			u.param[1] = song.author[param+0];
-			u.param[2] = song.author[param+1];
-			break;
-		case UNDO_DELETE:
-			{
-				u.param[0] = param & 0xFF;
-				u.param[1] = (param >> 8) & 0x7F;
-				if (song.length == song.limit) // do not decrease length on undo
-					u.param[1] |= 0x80;
-				for (int i=0; i < 6; ++i)
-					u.param[i+2] = song.notes[((song.limit-1)*6)+i];
-			}
-			break;
-		case UNDO_INSERT:
-			{
-				int sx = param;
-				u.param[0] = sx & 0xFF;
-				u.param[1] = (sx >> 8) & 0xFF;
-				for (int i=0; i < 6; ++i)
-					u.param[i+2] = song.notes[(sx*6)+i];
-			}
-			break;
-		case UNDO_MULTI:
-			u.param[0] = param & 0xFF;
-			u.param[1] = (param >> 8) & 0xFF;
-			break;
-		default:
-			os::alert("Improper undo action!");
+		const unsigned char* c = song_column(s,e-1);
+		if (c[0] != VOICE_EMPTY || c[1] != VOICE_EMPTY || c[2] != VOICE_EMPTY)
 			break;
+		--e;
 	}
+	return e;
 }
 
-void undo()
+// run length packing over bytes (a voice)
+//   control 0-127: 1-128 literal bytes follow
+//   control 128-255: the following byte repeats 2-129 times
+unsigned int undo_pack(const unsigned char* src, int len, unsigned char* dst)
 {
-	int multi_count = 0;
+	unsigned int o = 0;
+	int i = 0;
+	while (i < len)
+	{
+		int run = 1;
+		while ((i+run) < len && run < 129 && src[i] == src[i+run])
+			++run;
 
-	preview_note(SOUND_UNDO,15);
+		if (run >= 2)
+		{
+			dst[o++] = 126 + run;
+			dst[o++] = src[i];
+			i += run;
+			continue;
+		}
 
-	UndoEntry& u = undo_buffer[undo_index];
-	switch (u.action)
+		// literals continue until a run of 3 begins, shorter runs cost as much
+		int lit = 1;
+		while ((i+lit) < len && lit < 128)
+		{
+			if ((i+lit+2) < len && src[i+lit] == src[i+lit+1] && src[i+lit] == src[i+lit+2])
+				break;
+			++lit;
+		}
+		dst[o++] = lit - 1;
+		memcpy(dst+o,src+i,lit);
+		o += lit;
+		i += lit;
+	}
+	return o;
+}
+
+void undo_unpack(const unsigned char* src, unsigned int size, unsigned char* dst)
+{
+	unsigned int i = 0;
+	while (i < size)
 	{
-		case UNDO_COL: // column of notes
-			{
-				int sx = u.param[0] + (u.param[1] << 8);
-				for (int i=0; i < 6; ++i)
-				{
-					song.notes[(sx*6)+i] = u.param[i+2];
-				}
-			}
-			break;
-		case UNDO_TEMPO:  song.tempo = u.param[0];          break;
-		case UNDO_METRE:  song.metre = u.param[0];          break;
-		case UNDO_LENGTH:
-			{
-				song.length = u.param[0] + (u.param[1] << 8);
-				if (song.length > 96)
-				{
-					song.limit = (96 * EXTRA_SIZE);
-					refresh_limit();
-				}
-			}
-			break;
-		case UNDO_LOOP:   song.loop = (u.param[0] ? 1 : 0); break;
-		case UNDO_TITLE:
-			song.title[ u.param[0]+0] = u.param[1];
-			song.title[ u.param[0]+1] = u.param[2];
-			break;
-		case UNDO_AUTHOR:
-			song.author[u.param[0]+0] = u.param[1];
-			song.author[u.param[0]+1] = u.param[2];
-			break;
-		case UNDO_DELETE:
-			{
-				int sx = u.param[0] + ((u.param[1] & 0x7F) << 8);
-				delete_column(sx,false);
-				memcpy(song.notes+(((96*EXTRA_SIZE)-1)*6),u.param+2,6);
-				if ((u.param[1] & 0x80) != 0 && song.length < song.limit)
-					++song.length; // undo length contraction
-			}
-			break;
-		case UNDO_INSERT:
-			{
-				int sx = u.param[0] + (u.param[1] << 8);
-				insert_column(sx,u.param+2,false);
-			}
-			break;
-		case UNDO_MULTI:
-			multi_count = u.param[0] + (u.param[1] << 8);
-			break;
-		case UNDO_CLEAR: // bottom of undo stack, do not erase
-			return;
-		case UNDO_BLANK: // shouldn't encounter these
-		default:
-			os::alert("Undo error! Blank undo action?");
-			break;
+		int c = src[i++];
+		if (c >= 128)
+		{
+			memset(dst,src[i],c-126);
+			dst += c - 126;
+			i += 1;
+		}
+		else
+		{
+			memcpy(dst,src+i,c+1);
+			dst += c + 1;
+			i += c + 1;
+		}
 	}
-	// mark unused
-	u.action = UNDO_BLANK;
-	// return to previous undo point
-	undo_index = (undo_index - 1);
-	while (undo_index < 0) undo_index += UNDO_SIZE;
+}
 
-	if (undo_change == undo_index)
-		song.changed = false; // have undone all changes
+// applies a record's unpacked data to a song
+void undo_patch(Song* s, const UndoRecord* r, const unsigned char* raw, bool forward)
+{
+	unsigned char h[UNDO_HEADER];
+	undo_header(s,h);
+	for (int i=0; i < UNDO_HEADER; ++i)
+		h[i] ^= raw[i];
+	undo_set_header(s,h);
+
+	const unsigned char* d = raw + UNDO_HEADER;
+	if (r->before == r->after)
+	{
+		for (int x=0; x < r->before; ++x)
+		{
+			unsigned char* c = song_edit(s,r->at+x);
+			if (c == NULL) break;
+			for (int i=0; i < COLUMN_SIZE; ++i)
+				c[i] ^= d[(x*COLUMN_SIZE)+i];
+		}
+	}
 	else
-		song.changed = true; // have undone producing a change
+	{
+		song_delete(s,r->at,forward ? r->before : r->after);
+		if (forward) song_insert(s,r->at,d+(r->before*COLUMN_SIZE),r->after);
+		else         song_insert(s,r->at,d,r->before);
+	}
+}
 
-	while (multi_count > 0)
+// records the changes made since the last record as one undoable action
+void commit_undo()
+{
+	if (!undo_dirty) return; // nothing edited since the last record
+	undo_dirty = false;
+
+	unsigned char hb[UNDO_HEADER];
+	unsigned char ha[UNDO_HEADER];
+	undo_header(&undo_shadow,hb);
+	undo_header(&song,ha);
+
+	// the changed columns lie between everything shared at the start and end
+	const Song* a = &undo_shadow;
+	const Song* b = &song;
+	int ea = undo_extent(a);
+	int eb = undo_extent(b);
+	int at = 0;
+	while (at < ea && at < eb &&
+	       !memcmp(song_column(a,at),song_column(b,at),COLUMN_SIZE))
+		++at;
+	int tail = 0;
+	while ((ea-tail) > at && (eb-tail) > at &&
+	       !memcmp(song_column(a,ea-tail-1),song_column(b,eb-tail-1),COLUMN_SIZE))
+		++tail;
+	int before = ea - tail - at;
+	int after  = eb - tail - at;
+
+	if (before == 0 && after == 0 && !memcmp(hb,ha,UNDO_HEADER))
+		return; // nothing changed
+
+	int len = UNDO_HEADER;
+	for (int i=0; i < UNDO_HEADER; ++i)
+		undo_raw[i] = hb[i] ^ ha[i];
+	if (before == after)
+	{
+		for (int x=0; x < before; ++x)
+		{
+			const unsigned char* ca = song_column(a,at+x);
+			const unsigned char* cb = song_column(b,at+x);
+			for (int i=0; i < COLUMN_SIZE; ++i)
+				undo_raw[len+i] = ca[i] ^ cb[i];
+			len += COLUMN_SIZE;
+		}
+	}
+	else
+	{
+		song_read(a,at,before,undo_raw+len);
+		len += before * COLUMN_SIZE;
+		song_read(b,at,after,undo_raw+len);
+		len += after * COLUMN_SIZE;
+	}
+	unsigned int size = undo_pack(undo_raw,len,undo_packed);
+
+	// a new action replaces anything that could have been redone
+	while (undo_last != undo_current)
+		undo_free(undo_last);
+
+	UndoRecord* r = (UndoRecord*)malloc(sizeof(UndoRecord) + size);
+	if (r == NULL)
+	{
+		reset_undo();
+		return;
+	}
+	r->prev = undo_last;
+	r->next = NULL;
+	r->serial = ++undo_serial;
+	r->at = at;
+	r->before = before;
+	r->after = after;
+	r->size = size;
+	memcpy(r->data,undo_packed,size);
+
+	if (undo_last) undo_last->next = r;
+	else           undo_first = r;
+	undo_last = r;
+	undo_current = r;
+	undo_bytes += sizeof(UndoRecord) + size;
+
+	// forget the oldest actions once over budget, always keep the newest
+	while (undo_bytes > UNDO_BUDGET && undo_first != undo_last)
 	{
-		undo();
-		--multi_count;
+		undo_base = undo_first->serial;
+		undo_free(undo_first);
 	}
+
+	undo_patch(&undo_shadow,r,undo_raw,true);
+}
+
+// applies a record forward (redo) or backward (undo)
+void undo_apply(const UndoRecord* r, bool forward)
+{
+	undo_unpack(r->data,r->size,undo_raw);
+	undo_patch(&song,r,undo_raw,forward);
+	undo_patch(&undo_shadow,r,undo_raw,forward);
+
+	song.changed = (undo_state() != undo_change);
+	refresh_limit();
+}
+
+void undo()
+{
+	preview_note(SOUND_UNDO,15);
+
+	commit_undo(); // an action in progress is undone first
+	if (undo_current == NULL) return; // bottom of undo history
+
+	UndoRecord* r = undo_current;
+	undo_current = r->prev;
+	undo_apply(r,false);
+}
+
+void redo()
+{
+	preview_note(SOUND_UNDO,15);
+
+	commit_undo();
+	UndoRecord* r = undo_current ? undo_current->next : undo_first;
+	if (r == NULL) return; // top of undo history
+
+	undo_current = r;
+	undo_apply(r,true);
+}
+
+void undo_or_redo() // redoes instead with shift held
+{
+	if (erase_override) redo();
+	else                undo();
 }
 
 void quit()
@@ -759,7 +1082,12 @@ void edit_coord_to_pixel(int sx, int sy, int* ox, int* oy)
 
 void pattern_panel(int x, int y)
 {
-	if (!info)
+	if (browse)
+	{
+		int row = browse_row(y);
+		if (row >= 0) browse_open(browse_top + row);
+	}
+	else if (!info)
 	{
 		int sx,sy;
 		pixel_to_edit_coord(mousex,mousey,&sx,&sy);
@@ -779,6 +1107,8 @@ void pattern_panel(int x, int y)
 
 void pattern_panel_rclick(int x, int y)
 {
+	if (browse) return;
+
 	bool mouse_listen_temp = mouse_listen;
 	bool erase_override_temp = erase_override;
 	
@@ -866,37 +1196,38 @@ void select_clear()
 void select_erase()
 {
 	if (clip_right < clip_left) return;
-	int pastes = 0;
 	for (int i=clip_left; i<=clip_right; ++i)
 	{
-		unsigned char blank[6] = { 0xFF, 0xDF, 0xFF, 0xDF, 0xFF, 0xDF };
-		if (set_column(i,blank))
-			++pastes;
+		unsigned char blank[COLUMN_SIZE] = { VOICE_EMPTY, VOICE_EMPTY, VOICE_EMPTY };
+		set_column(i,blank);
 	}
-	if (pastes > 0)
-		push_undo(UNDO_MULTI,pastes);
 }
 
-void select_cut() // remove selection pulling later entries back
+bool copy_selection()
 {
-	if (clip_right < clip_left) return;
-	clip_len = (clip_right + 1) - clip_left;
-	memcpy(clipboard,song.notes + (clip_left * 6), 6 * clip_len);
-	int cuts = 0;
-	for (int i=0; i < clip_len; ++i)
+	if (clip_right < clip_left) return false;
+	int len = (clip_right + 1) - clip_left;
+	if (len > clip_capacity)
 	{
-		if (delete_column(clip_left,true))
-			++cuts;
+		unsigned char* c = (unsigned char*)realloc(clipboard, COLUMN_SIZE * len);
+		if (c == NULL) return false;
+		clipboard = c;
+		clip_capacity = len;
 	}
-	if (cuts > 0)
-		push_undo(UNDO_MULTI,cuts);
+	clip_len = len;
+	song_read(&song,clip_left,clip_len,clipboard);
+	return true;
+}
+
+void select_cut() // remove selection pulling later entries back
+{
+	if (!copy_selection()) return;
+	delete_columns(clip_left,clip_len);
 }
 
 void select_copy() // copy selection, no change
 {
-	if (clip_right < clip_left) return;
-	clip_len = (clip_right + 1) - clip_left;
-	memcpy(clipboard,song.notes + (clip_left * 6), 6 * clip_len);
+	copy_selection();
 }
 
 void select_paste(int x, int y) // paste overwrite
@@ -906,14 +1237,8 @@ void select_paste(int x, int y) // paste overwrite
 	if (sx < 0) return;
 	if (sx >= song.limit) return;
 
-	int pastes = 0;
 	for (int i=0; i<clip_len; ++i)
-	{
-		if (set_column(sx+i,clipboard+(i*6)))
-			++pastes;
-	}
-	if (pastes > 0)
-		push_undo(UNDO_MULTI,pastes);
+		set_column(sx+i,clipboard+(i*COLUMN_SIZE));
 }
 
 void select_insert(int x, int y) // paste insert
@@ -923,14 +1248,7 @@ void select_insert(int x, int y) // paste insert
 	if (sx < 0) return;
 	if (sx >= song.limit) return;
 
-	int pastes = 0;
-	for (int i=0; i<clip_len; ++i)
-	{
-		if (insert_column(sx+i,clipboard+(i*6),true))
-			++pastes;
-	}
-	if (pastes > 0)
-		push_undo(UNDO_MULTI,pastes);
+	insert_columns(sx,clipboard,clip_len);
 }
 
 // *--------------------------------------------------------------------------*
@@ -965,7 +1283,7 @@ gui::BobButton bob_qsave(  129,202, 15, 17, ICON_QSAVE,  0,  0,&quick_save);
 gui::BobButton bob_save(   147,202, 15, 17, ICON_SAVE,   0,  0,&save      );
 gui::BobButton bob_load(   165,202, 15, 17, ICON_LOAD,   0,  0,&load      );
 gui::BobPoke   bob_info  ( 183,202, 15, 17, &toggle_info   );
-gui::BobButton bob_undo(   216,203, 14, 15, ICON_UNDO,   0,  0,&undo      );
+gui::BobButton bob_undo(   216,203, 14, 15, ICON_UNDO,   0,  0,&undo_or_redo);
 
 // make sure they all go in here
 gui::Bob* bobs[] = {
@@ -1002,58 +1320,253 @@ const int BOBS = sizeof(bobs) / sizeof(bobs[0]);
 // *--------------------------------------------------------------------------*
 // drawing sub-functions
 
-void draw_pattern()
+// how far the notes of the playing beat bounce down
+int note_bounce()
 {
-	using namespace os; // for draw_icon
+	if (!play || playback_beat_pos <= 0.0) return 0;
+	return int(7.0 * sin((playback_beat_pos / playback_beat_len) * 3.14159));
+}
 
-	// draw background
-	int px = 8 - scroll_fine;
-	for (int i=0; i<9; ++i)
+// returns the bouncing mario icon for playback, -1 if stopped
+int mario_pose(int* x, int* y)
+{
+	if (!play) return -1;
+
+	bool jump = false;
+	if ((playback_beat+1) < song.length)
 	{
-		int sx = scroll + i - 2;
-		bool bar = (0 == (sx % song.metre)) && (sx < song.length);
+		const unsigned char* nc = song_column(&song,playback_beat+1);
+		jump =
+			(nc[0] != VOICE_EMPTY) |
+			(nc[1] != VOICE_EMPTY) |
+			(nc[2] != VOICE_EMPTY) ;
+	}
 
-		// draw staff
-		int staff;
-		if      (sx == -2)          staff = ICON_PATTERN0; // clef
-		else if (sx == -1)          staff = ICON_PATTERN1; // blank
-		else if (sx == song.length) staff = ICON_PATTERN4; // end
-		else if (bar)               staff = ICON_PATTERN2; // bar
-		else                        staff = ICON_PATTERN3; // beat
-		if (song.loop)
+	int px = 73;
+	if (playback_beat >= (song.length - 4))
+	{
+		px += 32 * (playback_beat - scroll);
+		if (playback_beat < song.length && playback_beat_pos > 0.0)
+			px += int(32.0 * playback_beat_pos / playback_beat_len);
+	}
+
+	px += int(32.0 * playback_end / playback_beat_len); // keep running past end
+
+	int bob = 0;
+	int icon = ICON_MARIO0;
+
+	if (playback_beat_pos < 0.0) // fall to first note
+	{
+		bob = int(playback_beat_pos * (-128.0 / LATENCY));
+		icon = (bob < 6) ? ICON_MARIO0 : ICON_MARIO1;
+	}
+	else if (jump) // jump to next note
+	{
+		bob = int(16.0 * sin((playback_beat_pos / playback_beat_len) * 3.14159));
+		icon = (bob < 6) ? ICON_MARIO0 : ICON_MARIO1;
+	}
+	else // run to next note
+	{
+		int segment = int(4.0 * playback_beat_pos / playback_beat_len);
+		icon = (segment & 1) ? ICON_MARIO2 : ICON_MARIO0;
+	}
+
+	*x = px;
+	*y = 17-bob;
+	return icon;
+}
+
+// returns the mouse cursor icon
+int cursor_pose(int* x, int* y)
+{
+	if (!info && bob_pattern.bound(mousex,mousey))
+	{
+		if (mouse_listen || play)
+		{
+			*x = mousex-8; *y = mousey-8;
+			return ICON_LISTEN;
+		}
+		else if (erase_override || instrument == 16) // eraser is off centre
 		{
-			if      (staff == ICON_PATTERN1) staff = ICON_PATTERN6; // repeat start
-			else if (staff == ICON_PATTERN4) staff = ICON_PATTERN5; // repeat end
+			*x = mousex-3; *y = mousey-2;
+			return inst_icon[16];
 		}
-		draw_icon(px,41,staff);
+		*x = mousex-8; *y = mousey-8;
+		return inst_icon[instrument];
+	}
+	*x = mousex; *y = mousey;
+	return ICON_MOUSE;
+}
 
-		// draw copy selection
-		if (sx == clip_left ) draw_icon(px,33,ICON_SEL1);
-		if (sx == clip_right) draw_icon(px,33,ICON_SEL2);
-		if (sx > clip_left && sx < clip_right) draw_icon(px,33,ICON_SEL0);
+// pattern column tiles
+//   each visible column of the staff is drawn from a cached tile holding its
+//   staff, selection, bar number, ledger lines and notes, keyed by everything
+//   that goes into it, so an edited or reselected column simply misses the cache
+
+const int TILE_W = 32;
+const int TILE_Y = 33; // top of the selection bar
+const int TILE_H = 151 - TILE_Y; // lowest note reaches below the staff
+const int TILE_BUCKETS = 16;
+const int TILE_WAYS = 4;
+
+struct TileKey
+{
+	int staff;
+	int sel; // bits: 1 left, 2 right, 4 inside
+	int bar; // bar number, -1 if none
+	int ledger; // bits: 1 this column, 2 next column (overlaps the right edge)
+	unsigned char notes[COLUMN_SIZE]; // blank if not drawn in the tile
+};
+
+struct Tile
+{
+	TileKey key;
+	int tile; // os tile index
+	unsigned int used; // frame last drawn, for eviction
+	bool valid;
+};
+
+static Tile tile_cache[TILE_BUCKETS][TILE_WAYS];
+static unsigned int tile_frame;
+
+void setup_tiles()
+{
+	for (int b=0; b < TILE_BUCKETS; ++b)
+	for (int w=0; w < TILE_WAYS; ++w)
+	{
+		tile_cache[b][w].tile = os::add_tile(TILE_W,TILE_H);
+		tile_cache[b][w].valid = false;
+	}
+	tile_frame = 0;
+}
+
+// true if column sx is drawn with a ledger line below the staff
+bool column_ledger(int sx, int mx, int my)
+{
+	if (sx < 0 || sx >= song.length) return false;
+	if (mx == sx && my <= 2) return true; // mouse demands a line
+
+	const unsigned char* nd = song_column(&song,sx);
+	for (int n=2; n>=0; --n)
+	{
+		int note = voice_note(nd[n]);
+		if (note >= 0x01 && note <= 0x02) // note demands a line
+			return true;
+	}
+	return false;
+}
 
-		// draw bar numbers
-		if (bar)
+// draws the notes of a column, with px the left of the column and bottom the staff's bottom
+void draw_notes(const unsigned char* nd, int px, int bottom)
+{
+	for (int n=2; n>=0; --n)
+	{
+		if (nd[n] != VOICE_EMPTY)
 		{
-			int bi = sx / song.metre;
-			if (bi < 10)
-			{
-				draw_icon(px+10, 33,num_icon[bi]);
-			}
-			else if (bi < 100)
+			int note = voice_note(nd[n]);
+			int stack = 0; // notes in the same spot stack
+			for (int m=n-1; m>=0; --m)
 			{
-				draw_icon(px+10,33,num_icon[bi/10]);
-				draw_icon(px+15,33,num_icon[bi%10]);
+				if (voice_note(nd[m]) == note) // empty is never a note
+					++stack;
 			}
-			else if (bi < 1000)
+
+			int py = bottom-((8*note)+(stack*2));
+			os::draw_icon((stack*4)+px,py,inst_icon[voice_inst(nd[n])]);
+		}
+	}
+}
+
+// channel labels beside the lowest note of each stack
+void draw_labels(const unsigned char* nd, int px, int bottom)
+{
+	const char* CHANNEL_LABELS[3] = { "C", "B", "A" };
+	for (int n=2; n>=0; --n)
+	{
+		if (nd[n] != VOICE_EMPTY)
+		{
+			int note = voice_note(nd[n]);
+			bool stacked = false;
+			for (int m=n-1; m>=0; --m)
 			{
-				draw_icon(px+10,33,num_icon[bi/100]);
-				draw_icon(px+15,33,num_icon[(bi/10)%10]);
-				draw_icon(px+20,33,num_icon[bi%10]);
+				if (voice_note(nd[m]) == note)
+					stacked = true;
 			}
+
+			if (!stacked)
+				os::draw_font(px-10,bottom-(8*note)+3,CHANNEL_LABELS[n]);
 		}
-		px += 32;
 	}
+}
+
+void render_tile(const TileKey& k)
+{
+	using namespace os; // for draw_icon
+
+	// tile coordinates are relative to the column's left at TILE_Y
+	draw_icon(0,41-TILE_Y,k.staff);
+
+	// draw copy selection
+	if (k.sel & 1) draw_icon(0,0,ICON_SEL1);
+	if (k.sel & 2) draw_icon(0,0,ICON_SEL2);
+	if (k.sel & 4) draw_icon(0,0,ICON_SEL0);
+
+	// draw bar numbers
+	if (k.bar >= 0)
+	{
+		int bi = k.bar;
+		int digits = 1;
+		for (int d = bi; d >= 10; d /= 10)
+			++digits;
+		int left = 10; // past 4 digits, start further left to stay in the tile
+		if (digits > 4) left -= (digits - 4) * 5;
+		for (int d = digits-1; d >= 0; --d, bi /= 10)
+			draw_icon(left+(d*5),0,num_icon[bi%10]);
+	}
+
+	// ledger lines sit 8 pixels left of their column
+	if (k.ledger & 1) draw_icon(-8,134-TILE_Y,ICON_LEDGER);
+	if (k.ledger & 2) draw_icon(TILE_W-8,134-TILE_Y,ICON_LEDGER);
+
+	draw_notes(k.notes,0,143-TILE_Y);
+}
+
+// finds or renders the tile for a key
+int get_tile(const TileKey& k)
+{
+	unsigned int hash = 2166136261u;
+	const unsigned char* kb = (const unsigned char*)&k;
+	for (unsigned int i=0; i < sizeof(TileKey); ++i)
+		hash = (hash ^ kb[i]) * 16777619u;
+	Tile* bucket = tile_cache[hash % TILE_BUCKETS];
+
+	Tile* oldest = bucket;
+	for (int w=0; w < TILE_WAYS; ++w)
+	{
+		Tile* t = bucket + w;
+		if (t->valid && !memcmp(&t->key,&k,sizeof(TileKey)))
+		{
+			t->used = tile_frame;
+			return t->tile;
+		}
+		if (!t->valid || (oldest->valid && t->used < oldest->used))
+			oldest = t;
+	}
+
+	oldest->key = k;
+	oldest->used = tile_frame;
+	oldest->valid = true;
+	os::begin_tile(oldest->tile);
+	render_tile(k);
+	os::end_tile();
+	return oldest->tile;
+}
+
+void draw_pattern()
+{
+	using namespace os; // for draw_icon
+
+	++tile_frame;
 
 	// get mouse position to see if it demands ledger lines
 	int mx,my;
@@ -1061,78 +1574,66 @@ void draw_pattern()
 	if (!bob_pattern.bound(mousex,mousey)) // off pattern grid
 		my = 15;
 
-	// draw ledger lines
-	px = 0 - scroll_fine;
+	// draw columns
+	int px = 8 - scroll_fine;
 	for (int i=0; i<9; ++i)
 	{
 		int sx = scroll + i - 2;
+		bool bar = (0 == (sx % song.metre)) && (sx < song.length);
 
-		bool ledger = false;
+		TileKey k;
+		memset(&k,0,sizeof(k)); // padding too, keys are compared with memcmp
 
-		// draw notes
-		const unsigned char* nd = song.notes + (sx * 6);
-		if (sx >= 0 && sx < song.length)
+		// staff
+		if      (sx == -2)          k.staff = ICON_PATTERN0; // clef
+		else if (sx == -1)          k.staff = ICON_PATTERN1; // blank
+		else if (sx == song.length) k.staff = ICON_PATTERN4; // end
+		else if (bar)               k.staff = ICON_PATTERN2; // bar
+		else                        k.staff = ICON_PATTERN3; // beat
+		if (song.loop)
 		{
-			if (mx == sx && my <= 2) // if mouse demands a line
-				ledger = true;
-
-			for (int n=2; n>=0; --n)
-			{
-				unsigned char note = nd[(n*2)+0];
-				if (note >= 0x01 && note <= 0x02) // if note demands a line
-					ledger = true;
-			}
+			if      (k.staff == ICON_PATTERN1) k.staff = ICON_PATTERN6; // repeat start
+			else if (k.staff == ICON_PATTERN4) k.staff = ICON_PATTERN5; // repeat end
 		}
 
-		if (ledger)
-			draw_icon(px,134,ICON_LEDGER);
+		if (sx == clip_left ) k.sel |= 1;
+		if (sx == clip_right) k.sel |= 2;
+		if (sx > clip_left && sx < clip_right) k.sel |= 4;
 
-		px += 32;
-	}
+		k.bar = bar ? (sx / song.metre) : -1;
 
-	// draw notes
-	px = 8 - scroll_fine;
-	for (int i=0; i<9; ++i)
-	{
-		int sx = scroll + i - 2;
-		int bottom = 143;
+		if (column_ledger(sx,  mx,my)) k.ledger |= 1;
+		if (column_ledger(sx+1,mx,my)) k.ledger |= 2;
 
-		if (play && sx == playback_beat && playback_beat_pos > 0.0) // bounce the notes
-		{
-			int bob = int(7.0 * sin((playback_beat_pos / playback_beat_len) * 3.14159));
-			bottom += bob;
-		}
+		// the bouncing column's notes are drawn over its tile
+		if (sx >= 0 && sx < song.length && !(play && sx == playback_beat))
+			memcpy(k.notes,song_column(&song,sx),COLUMN_SIZE);
+		else
+			memset(k.notes,VOICE_EMPTY,COLUMN_SIZE);
 
-		// draw notes
-		const unsigned char* nd = song.notes + (sx * 6);
-		if (sx >= 0 && sx < song.length)
-		{
-			for (int n=2; n>=0; --n)
-			{
-				unsigned char note = nd[(n*2)+0];
-				unsigned char inst = nd[(n*2)+1];
-				if (note >= 0x01 && note <= 0x0D && inst >= 0x00 && inst <= 0x0E)
-				{
-					int stack = 0; // notes in the same spot stack
-					for (int m=n-1; m>=0; --m)
-					{
-						if (nd[(m*2)+0] == note)
-							++stack;
-					}
+		draw_tile(px,TILE_Y,get_tile(k));
+		px += 32;
+	}
 
-					int py = bottom-((8*note)+(stack*2));
-					draw_icon((stack*4)+px,py,inst_icon[inst]);
+	// bouncing notes
+	int beat = playback_beat - (scroll - 2);
+	if (play && beat >= 0 && beat < 9 && playback_beat < song.length)
+		draw_notes(song_column(&song,playback_beat),8-scroll_fine+(beat*32),143+note_bounce());
 
-					if (show_channels && stack == 0)
-					{
-						const char* CHANNEL_LABELS[3] = { "C", "B", "A" };
-						draw_font(px-10,py+3,CHANNEL_LABELS[n]);
-					}
-				}
-			}
+	// channel labels hang left over the previous column
+	if (show_channels)
+	{
+		px = 8 - scroll_fine;
+		for (int i=0; i<9; ++i)
+		{
+			int sx = scroll + i - 2;
+			int bottom = 143;
+			if (play && sx == playback_beat)
+				bottom += note_bounce();
+			if (sx >= 0 && sx < song.length)
+				draw_labels(song_column(&song,sx),px,bottom);
+			px += 32;
 		}
-
-		px += 32;
 	}
 
 	// mask edges of pattern
@@ -1160,9 +1661,86 @@ void draw_info()
 	os::draw_font(0,136,"             mariopants " VERSION_STRING " ");
 }
 
+void draw_browse()
+{
+	os::draw_icon(2,25,ICON_BG_INFO);
+
+	// the end of the folder's path, if it doesn't fit
+	const char* folder = browser::get_folder();
+	int l = strlen(folder);
+	os::draw_font(0,28,(l > 32) ? (folder + l - 32) : folder);
+
+	int count = browser::count();
+	if (count < 1 && browser::busy())
+		os::draw_font(8,BROWSE_Y,"...");
+
+	for (int i=0; i < BROWSE_ROWS; ++i)
+	{
+		browser::Entry e;
+		if (!browser::get_entry(browse_top+i,&e)) break;
+
+		char length[8] = "";
+		if (!e.ready) strcpy(length,"...");
+		else if (!e.valid && !e.folder) strcpy(length,"?");
+		else if (e.valid)
+		{
+			unsigned int seconds = player::get_song_ms(e.info.length,e.info.tempo) / 1000;
+			if (seconds > (99*60)+59) seconds = (99*60)+59;
+			sprintf(length,"%d:%02d",seconds/60,seconds%60);
+		}
+
+		char name[32];
+		sprintf(name,e.folder ? "%.24s/" : "%.25s",e.name);
+		char row[40];
+		sprintf(row,"%-25s %5s",name,length);
+		int y = BROWSE_Y + (i * 9);
+		os::draw_font(8,y,row);
+		if ((browse_top+i) == browse_select)
+			os::draw_icon(2,y+3,ICON_DOT);
+	}
+
+	browser::Entry e;
+	if (browser::get_entry(browse_select,&e) && e.valid)
+	{
+		os::draw_font(0,BROWSE_DETAIL_Y,   e.info.title[0] ? e.info.title : e.name);
+		os::draw_font(0,BROWSE_DETAIL_Y+9, e.info.author);
+	}
+}
+
+// extended songs scroll a little past their end, rather than to the limit
+int scroll_limit()
+{
+	if (song.limit == 96) return 96;
+	int l = song.length + 96;
+	return (l < song.limit) ? l : song.limit;
+}
+
+// the scroll bar moves the browser's rows while it is open
 void refresh_limit()
 {
-	bob_scroll.set_range(0,song.limit-4,2);
+	if (browse)
+	{
+		bob_scroll.pos = &browse_top;
+		bob_scroll.set_range(0,browse_limit(),2);
+	}
+	else
+	{
+		bob_scroll.pos = &scroll;
+		bob_scroll.set_range(0,scroll_limit()-4,2);
+	}
+}
+
+int scroll_bar_pos()
+{
+	if (browse)
+	{
+		int limit = browse_limit();
+		return (limit > 0) ? ((browse_top * (236-191)) / limit) : 0;
+	}
+
+	int scroll_pos = (scroll * (236-191)) / (scroll_limit()-4);
+	if (scroll_pos > (236-191)) scroll_pos = 236-191; // song shortened past scroll
+	return scroll_pos;
 }
 
 // *--------------------------------------------------------------------------*
@@ -1184,6 +1762,10 @@ void setup(unsigned int samplerate_, int argc, char** argv)
 	scroll = 0;
 	scroll_fine = 0;
 	info = false;
+	browse = false;
+	browse_listed = false;
+	previewing = false;
+	preview_entry = -1;
 
 	info_focus = 0;
 	channel_select = 0;
@@ -1199,7 +1781,7 @@ void setup(unsigned int samplerate_, int argc, char** argv)
 	mousex = -20;
 	mousey = -20;
 
-	push_undo(UNDO_CLEAR,0);
+	reset_undo();
 
 	gui::focus = NULL;
 	for (int i=0; i < BOBS; ++i)
@@ -1207,11 +1789,13 @@ void setup(unsigned int samplerate_, int argc, char** argv)
 		bobs[i]->down = false;
 	}
 
+	os::set_atlas(ATLAS_W, ATLAS_H, asset_block(ASSET_ATLAS));
 	for (int i=0; i < ICON_COUNT; ++i)
 	{
-		const IconData* icon = icondata[i];
-		os::add_icon(i, icon->w, icon->h, (const void*)icon->d);
+		const IconData& icon = icondata[i];
+		os::add_icon(i, icon.x, icon.y, icon.w, icon.h);
 	}
+	setup_tiles();
 
 	os::add_font(ICON_FONT, 8, 9, 26, 11, 14, 15, 15,
 		"ABCDEFGHIJKLMNO"
@@ -1254,7 +1838,8 @@ void setup(unsigned int samplerate_, int argc, char** argv)
 				if (song.changed)
 					os::alert("Errors were found in the file.\n"
 					          "These have been automatically corrected.");
-				push_undo(UNDO_CLEAR,0);
+				reset_undo();
+				files::free_export_cache();
 				scroll = 0;
 			}
 		}
@@ -1271,9 +1856,27 @@ bool get_changed()
 	return song.changed;
 }
 
+const Song* get_song()
+{
+	return &song;
+}
+
 void update(unsigned int ms)
 {
 	update_time = ms;
+
+	if (browse) // details arrive from the background
+	{
+		int revision = browser::revision();
+		if (revision != browse_seen)
+		{
+			browse_seen = revision;
+			redraw = true;
+		}
+		set_browse_top(browse_top); // follows the scroll bar and the listing's length
+		update_preview(ms);
+	}
+
 	if (gui::focus)
 	{
 		if (gui::focus->update(ms))
@@ -1331,23 +1934,22 @@ void update(unsigned int ms)
 	}
 }
 
-void draw()
+// draws the whole screen, os::set_region limits it to the damaged part
+void draw_screen()
 {
 	using namespace os; // for draw_icon
 
-	redraw = false;
-
 	// draw pattern
 	draw_icon(0,0,ICON_BG);
-	if (!info) draw_pattern();
-	else draw_info();
+	if      (browse) draw_browse();
+	else if (!info)  draw_pattern();
+	else             draw_info();
 
 	// indicate current instrument
 	draw_icon(4,7,inst_icon[instrument]);
 
 	// draw scroll bars
-	int scroll_pos = (scroll * (236-191)) / (song.limit-4);
-	draw_icon(191+scroll_pos,159,ICON_SCROLL);
+	draw_icon(191+scroll_bar_pos(),159,ICON_SCROLL);
 
 	int tempo_pos = (song.tempo * (153-114)) / MAX_TEMPO;
 	draw_icon(114+tempo_pos,172,ICON_TEMPO);
@@ -1375,72 +1977,255 @@ void draw()
 		draw_icon(61,203,CS_ICON[channel_select]);
 	}
 
-	if (play) // bouncing mario to indicate position
+	// bouncing mario to indicate position
+	int mx, my;
+	int mario = mario_pose(&mx,&my);
+	if (mario >= 0) draw_icon(mx,my,mario);
+
+	// debug ms update
+	if (show_update)
 	{
-		bool jump = false;
-		if ((playback_beat+1) < song.length)
-		{
-			int ni = (playback_beat+1)*6;
-			jump =
-				(song.notes[ni+0] != 0xFF) |
-				(song.notes[ni+2] != 0xFF) |
-				(song.notes[ni+4] != 0xFF) ;
-		}
+		char cms[8];
+		sprintf(cms,"%03d",update_time);
+		draw_font(0,0,cms);
+	}
 
-		int px = 73;
-		if (playback_beat >= (song.length - 4))
-		{
-			px += 32 * (playback_beat - scroll);
-			if (playback_beat < song.length && playback_beat_pos > 0.0)
-				px += int(32.0 * playback_beat_pos / playback_beat_len);
-		}
+	// draw mouse
+	int cx, cy;
+	int cursor = cursor_pose(&cx,&cy);
+	draw_icon(cx,cy,cursor);
+}
 
-		px += int(32.0 * playback_end / playback_beat_len); // keep running past end
+// *--------------------------------------------------------------------------*
+// damage tracking
+//   draw() compares what is on screen against the last frame drawn,
+//   and redraws and presents only the parts that changed
 
-		int bob = 0;
-		int icon = ICON_MARIO0;
+// everything the pattern or info page is drawn from
+struct PatternView
+{
+	bool info;
+	bool browse;
+	int browse_top, browse_select, browse_revision;
+	int scroll, scroll_fine;
+	int length, metre;
+	bool loop;
+	int clip_left, clip_right;
+	bool show_channels;
+	int ledger; // column the mouse adds a ledger line to
+	int bounce_beat, bounce;
+	unsigned char notes[9 * COLUMN_SIZE];
+	int info_focus;
+	char title[32], author[32];
+};
 
-		if (playback_beat_pos < 0.0) // fall to first note
-		{
-			bob = int(playback_beat_pos * (-128.0 / LATENCY));
-			icon = (bob < 6) ? ICON_MARIO0 : ICON_MARIO1;
-		}
-		else if (jump) // jump to next note
+struct View
+{
+	PatternView pattern;
+	int instrument;
+	int scroll_pos, tempo_pos;
+	bool extended;
+	bool play, erase, changed;
+	int metre, channel_select;
+	int mario, mario_x, mario_y;
+	int cursor, cursor_x, cursor_y;
+	bool bob_down[BOBS];
+};
+
+const int SCREEN_W = 256;
+const int SCREEN_H = 224;
+const int DAMAGE_MAX = 16; // past this the whole screen is redrawn
+
+struct DamageRect { int x, y, w, h; };
+
+static View view_last;
+static bool view_valid = false; // false to redraw everything
+static DamageRect damage_list[DAMAGE_MAX];
+static int damage_count;
+
+void get_view(View* v)
+{
+	memset(v,0,sizeof(View)); // padding too, the pattern is compared with memcmp
+
+	PatternView* p = &v->pattern;
+	p->info = info;
+	p->browse = browse;
+	if (browse)
+	{
+		p->browse_top = browse_top;
+		p->browse_select = browse_select;
+		p->browse_revision = browse_seen;
+	}
+	else if (!info)
+	{
+		p->scroll = scroll;
+		p->scroll_fine = scroll_fine;
+		p->length = song.length;
+		p->metre = song.metre;
+		p->loop = song.loop;
+		p->clip_left = clip_left;
+		p->clip_right = clip_right;
+		p->show_channels = show_channels;
+
+		int mx,my;
+		pixel_to_edit_coord(mousex,mousey,&mx,&my);
+		p->ledger = (bob_pattern.bound(mousex,mousey) && my <= 2) ? mx : -3;
+
+		p->bounce_beat = play ? playback_beat : -3;
+		p->bounce = note_bounce();
+
+		for (int i=0; i<9; ++i)
 		{
-			bob = int(16.0 * sin((playback_beat_pos / playback_beat_len) * 3.14159));
-			icon = (bob < 6) ? ICON_MARIO0 : ICON_MARIO1;
+			int sx = scroll + i - 2;
+			if (sx >= 0 && sx < song.length)
+				memcpy(p->notes+(i*COLUMN_SIZE),song_column(&song,sx),COLUMN_SIZE);
 		}
-		else // run to next note
+	}
+	else
+	{
+		p->loop = song.loop; // shared with the loop button
+		p->info_focus = info_focus;
+		strncpy(p->title,song.title,sizeof(p->title));
+		strncpy(p->author,song.author,sizeof(p->author));
+	}
+
+	v->instrument = instrument;
+	v->scroll_pos = scroll_bar_pos();
+	v->tempo_pos = (song.tempo * (153-114)) / MAX_TEMPO;
+	v->extended = (song.limit != 96);
+	v->play = play;
+	v->erase = (instrument == 16);
+	v->changed = song.changed;
+	v->metre = song.metre;
+	v->channel_select = channel_select;
+	v->mario = mario_pose(&v->mario_x,&v->mario_y);
+	v->cursor = cursor_pose(&v->cursor_x,&v->cursor_y);
+	for (int i=0; i < BOBS; ++i)
+		v->bob_down[i] = bobs[i]->down;
+}
+
+// adds a screen rectangle to be redrawn
+void damage(int x, int y, int w, int h)
+{
+	if (x < 0) { w += x; x = 0; }
+	if (y < 0) { h += y; y = 0; }
+	if ((x+w) > SCREEN_W) w = SCREEN_W - x;
+	if ((y+h) > SCREEN_H) h = SCREEN_H - y;
+	if (w <= 0 || h <= 0) return;
+
+	// merge overlapping rectangles, unless their union would draw more
+	for (int i=0; i < damage_count; ++i)
+	{
+		DamageRect& d = damage_list[i];
+		if (x >= (d.x+d.w) || d.x >= (x+w) || y >= (d.y+d.h) || d.y >= (y+h))
+			continue;
+
+		int ux = (d.x < x) ? d.x : x;
+		int uy = (d.y < y) ? d.y : y;
+		int uw = (((x+w) > (d.x+d.w)) ? (x+w) : (d.x+d.w)) - ux;
+		int uh = (((y+h) > (d.y+d.h)) ? (y+h) : (d.y+d.h)) - uy;
+		if ((uw*uh) > ((w*h) + (d.w*d.h)))
+			continue;
+
+		x = ux; y = uy; w = uw; h = uh;
+		damage_list[i] = damage_list[--damage_count];
+		i = -1; // the union may overlap others
+	}
+
+	if (damage_count >= DAMAGE_MAX)
+	{
+		damage_count = 0;
+		x = 0; y = 0; w = SCREEN_W; h = SCREEN_H;
+	}
+
+	DamageRect& d = damage_list[damage_count++];
+	d.x = x; d.y = y; d.w = w; d.h = h;
+}
+
+void damage_icon(int x, int y, int icon)
+{
+	int w,h;
+	os::icon_size(icon,&w,&h);
+	damage(x,y,w,h);
+}
+
+// damages everything that differs between two views
+void damage_view(const View& v, const View& o)
+{
+	if (memcmp(&v.pattern,&o.pattern,sizeof(PatternView)))
+		damage(0,25,SCREEN_W,134); // notes bounce below the pattern
+
+	if (v.instrument != o.instrument)
+		damage_icon(4,7,inst_icon[v.instrument]);
+	if (v.scroll_pos != o.scroll_pos || v.extended != o.extended)
+		damage_icon(184,158,ICON_SCROLL_UNLIMITED);
+	if (v.tempo_pos != o.tempo_pos)
+		damage(114,172,44,8);
+
+	if (v.play != o.play)
+	{
+		damage_icon( 21,167,ICON_STOP);
+		damage_icon( 53,167,ICON_PLAY);
+	}
+	if (v.pattern.loop != o.pattern.loop) damage_icon( 85,167,ICON_LOOP);
+	if (v.erase != o.erase)               damage_icon( 40,202,ICON_ERASE);
+	if (v.metre != o.metre)
+	{
+		damage_icon( 81,203,ICON_METRE3);
+		damage_icon( 96,203,ICON_METRE4);
+	}
+	if (v.changed != o.changed)           damage_icon(129,202,ICON_CHANGED);
+	if (v.pattern.info != o.pattern.info) damage_icon(183,202,ICON_INFO);
+	if (v.channel_select != o.channel_select) damage_icon(61,203,ICON_CHANNELA);
+
+	if (v.mario != o.mario || v.mario_x != o.mario_x || v.mario_y != o.mario_y)
+	{
+		if (o.mario >= 0) damage_icon(o.mario_x,o.mario_y,o.mario);
+		if (v.mario >= 0) damage_icon(v.mario_x,v.mario_y,v.mario);
+	}
+
+	if (v.cursor != o.cursor || v.cursor_x != o.cursor_x || v.cursor_y != o.cursor_y)
+	{
+		damage_icon(o.cursor_x,o.cursor_y,o.cursor);
+		damage_icon(v.cursor_x,v.cursor_y,v.cursor);
+	}
+
+	// pressed buttons draw an icon around their area
+	for (int i=0; i < BOBS; ++i)
+	{
+		if (v.bob_down[i] != o.bob_down[i])
 		{
-			int segment = int(4.0 * playback_beat_pos / playback_beat_len);
-			icon = (segment & 1) ? ICON_MARIO2 : ICON_MARIO0;
+			const gui::Bob* b = bobs[i];
+			damage(b->x-4,b->y-4,b->w+8,b->h+8);
 		}
-
-		draw_icon(px,17-bob,icon);
 	}
+}
+
+void draw()
+{
+	redraw = false;
+	refresh_limit(); // follows song length
+
+	View v;
+	get_view(&v);
+
+	damage_count = 0;
+	if (!view_valid) damage(0,0,SCREEN_W,SCREEN_H);
+	else damage_view(v,view_last);
+	view_last = v;
+	view_valid = true;
 
-	// debug ms update
 	if (show_update)
 	{
-		char cms[8];
-		sprintf(cms,"%03d",update_time);
-		draw_font(0,0,cms);
+		damage(0,0,24,8);
 		redraw = true; // force update every frame
 	}
 
-	// draw mouse
-	if (!info && bob_pattern.bound(mousex,mousey))
-	{
-		if (mouse_listen || play)
-			draw_icon(mousex-8,mousey-8,ICON_LISTEN);
-		else if (erase_override || instrument == 16) // eraser is off centre
-			draw_icon(mousex-3,mousey-2,inst_icon[16]);
-		else
-			draw_icon(mousex-8,mousey-8,inst_icon[instrument]);
-	}
-	else
+	for (int i=0; i < damage_count; ++i)
 	{
-		draw_icon(mousex,mousey,ICON_MOUSE);
+		const DamageRect& d = damage_list[i];
+		os::set_region(d.x,d.y,d.w,d.h);
+		draw_screen();
 	}
 }
 
@@ -1449,6 +2234,14 @@ bool do_redraw()
 	return redraw;
 }
 
+bool animating()
+{
+	// playback scrolls, held buttons repeat, and the debug timer redraws every frame
+	// the browser waits on its background reading and the preview delay
+	if (browse && (browser::busy() || browse_select != preview_entry)) return true;
+	return play || gui::focus != NULL || redraw;
+}
+
 void mouse_button(int x, int y, bool button)
 {
 	redraw = true;
@@ -1470,12 +2263,11 @@ void mouse_button(int x, int y, bool button)
 				// all Bobs can get a mouse down
 				if(bobs[i]->bound(x,y))
 				{
-					// because bob_tempo manipulates song.tempo directly,
-					// manually pushing its undo state here
+					// bob_tempo manipulates song.tempo directly
 					if (bobs[i] == &bob_tempo)
 					{
-						push_undo(UNDO_TEMPO, song.tempo);
 						song.changed = true;
+						undo_dirty = true;
 					}
 
 					// clicking any button will recover keyboard focus from info
@@ -1496,6 +2288,9 @@ void mouse_button(int x, int y, bool button)
 	mousex = x;
 	mousey = y;
 	mouseb = button;
+
+	if (!mouseb) // a click or drag is one undo step
+		commit_undo();
 }
 
 void mouse_rbutton(int x, int y)
@@ -1507,9 +2302,17 @@ void mouse_rbutton(int x, int y)
 		return;
 	}
 
+	if (bob_load.bound(x,y)) // the browser is the load button's alternative
+	{
+		toggle_browse();
+		redraw = true;
+		return;
+	}
+
 	if (bob_pattern.bound(x,y))
 	{
 		pattern_panel_rclick(x,y);
+		if (!mouseb) commit_undo();
 		return;
 	}
 }
@@ -1521,12 +2324,18 @@ void mouse_move(int x, int y)
 
 	if (gui::focus != NULL) // focused Bobs get a mouse move
 		gui::focus->mouse_move(x,y);
+	else if (browse && bob_pattern.bound(x,y))
+	{
+		int row = browse_row(y);
+		if (row >= 0 && (browse_top + row) < browser::count())
+			set_browse_select(browse_top + row);
+	}
 
 	mousex = x;
 	mousey = y;
 }
 
-void key(SDLKey key, char ascii)
+void key_command(SDLKey key, char ascii)
 {
 	redraw = true;
 
@@ -1547,6 +2356,9 @@ void key(SDLKey key, char ascii)
 		return;
 	}
 
+	if (browse && browse_key(key))
+		return;
+
 	// info_focus steals backspace and all valid ascii text characters
 	if (info && info_focus != 0)
 	{
@@ -1557,9 +2369,9 @@ void key(SDLKey key, char ascii)
 		{
 			if (l > 0)
 			{
-				push_undo((info_focus==1)?UNDO_TITLE:UNDO_AUTHOR,l-1);
 				s[l-1] = 0;
 				song.changed = true;
+				undo_dirty = true;
 			}
 			return;
 		}
@@ -1567,9 +2379,9 @@ void key(SDLKey key, char ascii)
 		{
 			if (l < 31)
 			{
-				push_undo((info_focus==1)?UNDO_TITLE:UNDO_AUTHOR,l);
 				s[l] = ascii;
 				song.changed = true;
+				undo_dirty = true;
 			}
 			return;
 		}
@@ -1647,26 +2459,27 @@ void key(SDLKey key, char ascii)
 		case SDLK_F9: // enable
 			if (song.limit == 96)
 			{
-				song.limit = sizeof(song.notes) / 6;
+				song.limit = SONG_MAX;
 			}
 			else
 			{
 				song.limit = 96;
 				if (song.length > 96)
-				{
-					push_undo(UNDO_LENGTH,0);
 					song.length = 96;
-				}
 			}
+			undo_dirty = true;
 			refresh_limit();
 			break;
 		case SDLK_F10: multi_save();  break;
+		case SDLK_F11: os::set_scale((os::get_scale() % 6) + 1); break;
+		case SDLK_F12: files::set_normalize((files::get_normalize() + 1) % 3); break;
 
 		case SDLK_m: toggle_metre();  break;
 		case SDLK_s: quick_save();    break;
 		case SDLK_d: save();          break;
 		case SDLK_f: load();          break;
 		case SDLK_i: toggle_info();   break;
+		case SDLK_o: toggle_browse(); break;
 
 		case SDLK_TAB:
 		case SDLK_RETURN:
@@ -1676,7 +2489,7 @@ void key(SDLKey key, char ascii)
 
 		case SDLK_BACKSPACE:
 		case SDLK_z:
-			undo();
+			undo_or_redo();
 			break;
 
 		case SDLK_ESCAPE: os::try_quit(song.changed); break;
@@ -1692,7 +2505,6 @@ void key(SDLKey key, char ascii)
 		case SDLK_k:         select_insert(mousex,mousey); break;
 
 		// unused keys:
-		//case SDLK_o:
 		//case SDLK_a:
 		//case SDLK_d:
 		//case SDLK_v:
@@ -1701,6 +2513,13 @@ void key(SDLKey key, char ascii)
 	}
 }
 
+void key(SDLKey key, char ascii)
+{
+	key_command(key,ascii);
+	if (!mouseb) // each key is one undo step, unless pressed during a drag
+		commit_undo();
+}
+
 void ctrl_held(bool held)
 {
 	mouse_listen = held;
@@ -4,21 +4,7 @@
 //   public interface to mariopants editor
 
 #include "SDL_keysym.h" // for SDLKey
-
-const int EXTRA_SIZE = 30;
-
-typedef struct
-{
-	unsigned char notes[576*EXTRA_SIZE];
-	int tempo;
-	int metre;
-	int length;
-	int limit;
-	bool loop;
-	char title[32];
-	char author[32];
-	bool changed;
-} Song;
+#include "song.h" // for Song
 
 namespace editor
 {
@@ -26,9 +12,11 @@ namespace editor
 extern void setup(unsigned int samplerate, int argc, char** argv);
 extern int  get_icon(); // gets the index of a 32x32 program icon
 extern bool get_changed();
+extern const Song* get_song(); // for --replay reports
 extern void update(unsigned int ms);
 extern void draw();
 extern bool do_redraw(); // return true if redraw is needed
+extern bool animating(); // return true if update is needed every frame
 extern void mouse_button(int x, int y, bool button);
 extern void mouse_rbutton(int x, int y);
 extern void mouse_move(int x, int y);
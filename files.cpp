@@ -3,10 +3,14 @@
 
 #include <cstring>
 #include <cstdio>
+#include <cstdlib>
+#include <cmath>
 #include "files.h"
 #include "data.h"
 #include "os.h"
 #include "player.h"
+#include "flac.h"
+#include "loudness.h"
 
 #ifdef __unix__
 	#include "zlib.h"
@@ -80,8 +84,33 @@ void flip_short(uint16* buffer, unsigned int len)
 	}
 }
 
+// replaces all of the song's notes with columns of note/instrument pairs,
+// the song is marked changed only if some had to be corrected
+bool set_notes(Song* song, const unsigned char* notes, int columns)
+{
+	song_resize(song, 0);
+	if (!song_resize(song, columns))
+	{
+		fmsg = "Out of memory.";
+		return false;
+	}
+
+	bool clean = true;
+	for (int sx=0; sx < columns; ++sx)
+		if (!pack_columns(notes + (sx * PAIRS_SIZE), 1, song_edit(song, sx))) clean = false;
+	song->changed = !clean;
+	return true;
+}
+
+// copies n columns starting at sx to notes as note/instrument pairs
+void get_notes(const Song* song, int sx, int n, unsigned char* notes)
+{
+	for (int i=0; i < n; ++i)
+		unpack_columns(song_column(song, sx + i), 1, notes + (i * PAIRS_SIZE));
+}
+
 // clean after load
-void clean_song(Song* song)
+bool clean_song(Song* song)
 {
 	if (song->length < 1)
 	{
@@ -90,13 +119,18 @@ void clean_song(Song* song)
 	}
 	if (song->length > 96)
 	{
-		song->limit = 96 * EXTRA_SIZE;
+		song->limit = SONG_MAX;
 		if (song->length > song->limit)
 		{
 			song->length = song->limit;
 			song->changed = true;
 		}
 	}
+	if (song->size < song->length && !song_resize(song, song->length))
+	{
+		fmsg = "Out of memory.";
+		return false;
+	}
 
 	if (song->tempo > 0x9F)
 	{
@@ -109,31 +143,14 @@ void clean_song(Song* song)
 		song->metre = 4;
 		song->changed = true;
 	}
-
-	for (int i=0; i < (576 * EXTRA_SIZE); i+=2)
-	{
-		unsigned char note = song->notes[i+0];
-		unsigned char inst = song->notes[i+1];
-
-		if ((note < 1) ||
-		    (note > 13 && note != 0xFF) ||
-			(inst > 14 && inst != 0xDF))
-		{
-			song->notes[i+0] = 0xFF;
-			song->notes[i+1] = 0xDF;
-			song->changed = true;
-		}
-	}
+	return true;
 }
 
 // file helpers
 
-bool load_sho(const char* filename, Song* song)
+bool sho_song(const unsigned char* fbuf, unsigned int length, Song* song)
 {
-	unsigned int length = read_file(filename);
-	if (length < 1) { fmsg = "Empty file."; return false; }
-	if (length >= FBUF_SIZE) { fmsg = "File is unexpectedly large."; return false; }
-
+	if (length < 7) { fmsg = "Not a valid .sho file."; return false; }
 	if (read_long( fbuf+0) != read_long("shro"))
 	{
 		fmsg = "Not a valid .sho file.";
@@ -169,7 +186,7 @@ bool load_sho(const char* filename, Song* song)
 
 	if (version == 2)
 	{
-		memcpy(song->notes, fbuf+NOTE_POS, 576);
+		if (!set_notes(song, fbuf+NOTE_POS, 96)) return false;
 		song->tempo = fbuf[NOTE_POS+576];
 
 		song->limit = 96;
@@ -188,23 +205,17 @@ bool load_sho(const char* filename, Song* song)
 	}
 	else if (version == 3)
 	{
-		song->length = read_short(fbuf+NOTE_POS);
-		if (song->length > (96 * EXTRA_SIZE))
+		song->length = read_short(fbuf+NOTE_POS); // at most SONG_MAX
+		if (length < (NOTE_POS + 5 + (6 * song->length)))
 		{
-			fmsg = "Song is too long.";
+			fmsg = "Not enough data in file.";
 			return false;
 		}
 
 		song->loop = (fbuf[NOTE_POS+2] != 0);
 		song->metre = (fbuf[NOTE_POS+3] == 0) ? 3 : 4;
 		song->tempo = fbuf[NOTE_POS+4];
-		memcpy(song->notes,fbuf+NOTE_POS+5,6*song->length);
-
-		for (int i=(6*song->length); i < (576 * EXTRA_SIZE); i+=2)
-		{
-			song->notes[i+0] = 0xFF;
-			song->notes[i+1] = 0xDF;
-		}
+		if (!set_notes(song, fbuf+NOTE_POS+5, song->length)) return false;
 	}
 	else
 	{
@@ -212,12 +223,24 @@ bool load_sho(const char* filename, Song* song)
 		return false;
 	}
 
-	song->changed = false;
-	clean_song(song);
-	return true;
+	return clean_song(song);
+}
+
+bool load_sho(const char* filename, Song* song)
+{
+	unsigned int length = read_file(filename);
+	if (length < 1) { fmsg = "Empty file."; return false; }
+	if (length >= FBUF_SIZE) { fmsg = "File is unexpectedly large."; return false; }
+	return sho_song(fbuf, length, song);
 }
 
-void read_ram(const unsigned char* ram, Song* song)
+// savestate RAM block, relative to original zst savestate at 0x15F7
+const int RAM_SIZE = 0x1846 - 0x15F7;
+
+const int ZST_POS_DATA = 0x15F7;
+const int S9X_POS_DATA = 0x115BF;
+
+bool read_ram(const unsigned char* ram, Song* song)
 {
 	// positions relative to original zst savestate at 0x15F7
 	const int POS_NOTES  = 0x15F7 - 0x15F7;
@@ -228,49 +251,259 @@ void read_ram(const unsigned char* ram, Song* song)
 	const int POS_METRE  = 0x1845 - 0x15F7;
 
 	// extract data
-	memcpy(song->notes, ram+POS_NOTES, 576);
 	song->length = (read_short(ram+POS_LENGTH) >> 3) - 2;
 	song->tempo  =  ram[POS_TEMPO];
 	song->loop   = (ram[POS_LOOP ] == 1) ? 1 : 0;
 	song->metre  = (ram[POS_METRE] == 0) ? 3 : 4;
+	return set_notes(song, ram+POS_NOTES, 96);
+}
+
+// savestate scanning
+//   Other emulators, and other versions of these, keep the SNES RAM elsewhere in
+//   their savestates, so when the usual position doesn't hold a song the whole
+//   state is searched for the RAM block. Its 96 note columns are 288 pairs of a note
+//   1-13 or empty 0xFF, and an instrument 0-14 or empty 0xDF. One pass over the state
+//   for each byte alignment counts runs of such pairs, and each run of 288 is checked
+//   against the length, loop, tempo, speed and metre fields that follow it.
+//   Positions found are remembered by the state's size and leading bytes, as the
+//   states of one emulator version are laid out alike.
+
+const int STATE_HEADER = 64; // leading bytes that identify an emulator's state layout
+const int STATE_LAYOUTS = 16;
+
+struct StateLayout
+{
+	unsigned int size; // 0 if unused
+	unsigned int header; // hash of the leading bytes
+	int pos;
+};
+
+static StateLayout state_layouts[STATE_LAYOUTS]; // used by load_state
+static int state_layout_next = 0;
+
+// 0 if ram can't hold a song, otherwise higher for a more certain match
+int ram_score(const unsigned char* ram)
+{
+	const int POS_NOTES  = 0x15F7 - 0x15F7;
+	const int POS_LENGTH = 0x1837 - 0x15F7;
+	const int POS_LOOP   = 0x1839 - 0x15F7;
+	const int POS_TEMPO  = 0x183B - 0x15F7;
+	const int POS_SPEED  = 0x183D - 0x15F7;
+	const int POS_METRE  = 0x1845 - 0x15F7;
+
+	unsigned int length = read_short(ram+POS_LENGTH);
+	if ((length & 7) || (length >> 3) < 3 || (length >> 3) > (96 + 2)) return 0;
+	if (ram[POS_LOOP] > 1 || ram[POS_METRE] > 1 || ram[POS_TEMPO] > 0x9F) return 0;
+
+	int score = 1;
+	if (read_long(ram+POS_SPEED) == uint32((ram[POS_TEMPO] + 14) * 3291161)) score += 2;
+
+	// the game itself only writes notes, or 0xFF 0xDF when empty
+	bool exact = true;
+	for (int i=0; exact && i < (96 * 6); i+=2)
+	{
+		unsigned char note = ram[POS_NOTES+i+0];
+		unsigned char inst = ram[POS_NOTES+i+1];
+		if ((note == 0xFF) != (inst == 0xDF)) exact = false;
+	}
+	if (exact) score += 1;
+	return score;
+}
+
+inline bool note_pair(unsigned char note, unsigned char inst)
+{
+	return
+		((note >= 1 && note <= 13) || note == 0xFF) &&
+		(inst <= 14 || inst == 0xDF);
+}
+
+// best position of the RAM block in a state, or -1
+int scan_state(const unsigned char* state, unsigned int size)
+{
+	const unsigned int PAIRS = 96 * 3;
+
+	int best = -1;
+	int best_score = 0;
+	for (unsigned int align=0; align < 2; ++align)
+	{
+		unsigned int run = 0;
+		for (unsigned int p = align; (p + 1) < size; p += 2)
+		{
+			if (!note_pair(state[p], state[p+1])) { run = 0; continue; }
+			if (++run < PAIRS) continue;
+
+			unsigned int pos = (p + 2) - (PAIRS * 2);
+			if ((pos + RAM_SIZE) > size) break;
+			int score = ram_score(state + pos);
+			if (score > best_score || (score == best_score && best >= 0 && int(pos) < best))
+			{
+				best = int(pos);
+				best_score = score;
+			}
+		}
+	}
+	return best;
+}
+
+// FNV-1a
+unsigned int hash_header(const unsigned char* state, unsigned int size)
+{
+	unsigned int h = 2166136261u;
+	for (unsigned int i=0; i < size && i < STATE_HEADER; ++i)
+		h = (h ^ state[i]) * 16777619u;
+	return h;
+}
+
+// position of the RAM block in a state, trying known first, then the position found
+// before for states like it if remember is set, then searching; -1 if not found
+int find_ram(const unsigned char* state, unsigned int size, int known, bool remember)
+{
+	if (known >= 0 && (known + RAM_SIZE) <= int(size) && ram_score(state + known) > 0)
+		return known;
+
+	unsigned int header = hash_header(state, size);
+	if (remember)
+	{
+		for (int i=0; i < STATE_LAYOUTS; ++i)
+		{
+			const StateLayout& l = state_layouts[i];
+			if (l.size == size && l.header == header && ram_score(state + l.pos) > 0)
+				return l.pos;
+		}
+	}
+
+	int pos = scan_state(state, size);
+	if (remember && pos >= 0)
+	{
+		StateLayout& l = state_layouts[state_layout_next];
+		l.size = size;
+		l.header = header;
+		l.pos = pos;
+		state_layout_next = (state_layout_next + 1) % STATE_LAYOUTS;
+	}
+	return pos;
+}
+
+// inflates a gzip state, or the first file of a zip, into a new buffer of up to FBUF_SIZE,
+// returns NULL if it isn't compressed, or can't be inflated
+unsigned char* inflate_state(const unsigned char* data, unsigned int size, unsigned int* length)
+{
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	int window;
+	if (size >= 18 && data[0] == 0x1F && data[1] == 0x8B)
+	{
+		z.next_in = (Bytef*)data;
+		z.avail_in = size;
+		window = 16 + MAX_WBITS; // gzip
+	}
+	else if (size >= 30 && read_long(data) == read_long("PK\x03\x04"))
+	{
+		int method = read_short(data+8);
+		unsigned int start = 30 + read_short(data+26) + read_short(data+28);
+		if ((method != 0 && method != 8) || start >= size) return NULL;
+		z.next_in = (Bytef*)(data + start);
+		z.avail_in = size - start;
+		if (method == 0) // stored
+		{
+			unsigned int stored = read_long(data+18);
+			if (stored > z.avail_in || stored >= unsigned(FBUF_SIZE)) return NULL;
+			unsigned char* out = (unsigned char*)malloc(stored + 1);
+			if (out == NULL) return NULL;
+			memcpy(out, z.next_in, stored);
+			*length = stored;
+			return out;
+		}
+		window = -MAX_WBITS; // raw deflate
+	}
+	else return NULL;
+
+	unsigned char* out = (unsigned char*)malloc(FBUF_SIZE);
+	if (out == NULL) return NULL;
+	z.next_out = out;
+	z.avail_out = FBUF_SIZE;
+	if (inflateInit2(&z, window) != Z_OK) { free(out); return NULL; }
+	int result = inflate(&z, Z_FINISH);
+	*length = FBUF_SIZE - z.avail_out;
+	inflateEnd(&z);
+	if (result != Z_STREAM_END) { free(out); return NULL; }
+	return out;
+}
+
+// reads a savestate of any emulator into fbuf, inflated, returns its size or 0
+unsigned int read_state(const char* filename)
+{
+	unsigned int length = read_file(filename);
+	if (length < 1) { fmsg = "Empty file."; return 0; }
+	if (length >= unsigned(FBUF_SIZE)) { fmsg = "File is unexpectedly large."; return 0; }
+
+	unsigned int inflated;
+	unsigned char* state = inflate_state(fbuf, length, &inflated);
+	if (state != NULL)
+	{
+		length = inflated;
+		if (length < unsigned(FBUF_SIZE)) memcpy(fbuf, state, length);
+		free(state);
+		if (length >= unsigned(FBUF_SIZE)) { fmsg = "File is unexpectedly large."; return 0; }
+	}
+	return length;
+}
+
+// reads the song from a state in fbuf, at known unless it holds no song there
+bool load_state_ram(unsigned int length, int known, Song* song)
+{
+	int pos = find_ram(fbuf, length, known, true);
+	if (pos < 0)
+	{
+		if (known < 0 || (known + RAM_SIZE) > int(length))
+		{
+			fmsg = "No Mario Paint song found in savestate.";
+			return false;
+		}
+		pos = known; // as it was always read
+	}
+
+	if (!read_ram(fbuf+pos, song)) return false;
+
+	return clean_song(song);
 }
 
 bool load_zst(const char* filename, Song* song)
 {
 	unsigned int length = read_file(filename);
 	if (length < 1) { fmsg = "Empty file."; return false; }
-	if (length < 0x1846) { fmsg = "File too small."; return false; }
 	if (length >= FBUF_SIZE) { fmsg = "File is unexpectedly large."; return false; }
 
 	strcpy(song->title,   "ZST import");
 	strcpy(song->author, "Mario Paint");
 
-	read_ram(fbuf+0x15F7, song);
-
-	song->changed = false;
-	clean_song(song);
-	return true;
+	return load_state_ram(length, ZST_POS_DATA, song);
 }
 
 bool load_s9x(const char* filename, Song* song)
 {
-	const int POS_DATA = 0x115BF;
-
 	// read existing data
 	gzFile gf = gzopen(filename,"rb");
 	if (gf == NULL) { fmsg = "Unable to open gz compressed file."; return false; }
 
 	int length = gzread(gf,fbuf,FBUF_SIZE);
 	gzclose(gf);
-	if (length < POS_DATA + 1024) { fmsg = "File too small."; return false; }
+	if (length < 1) { fmsg = "Empty file."; return false; }
 	else if (length >= FBUF_SIZE) { fmsg = "File is unexpectedly large."; return false; }
 
-	// read data
-	read_ram(fbuf+POS_DATA, song);
+	return load_state_ram(length, S9X_POS_DATA, song);
+}
+
+// savestates of other emulators, found by searching
+bool load_state(const char* filename, Song* song)
+{
+	unsigned int length = read_state(filename);
+	if (length < 1) return false;
 
-	song->changed = false;
-	clean_song(song);
-	return true;
+	strcpy(song->title,  "Savestate import");
+	strcpy(song->author, "Mario Paint");
+
+	return load_state_ram(length, -1, song);
 }
 
 bool save_sho(const char* filename, const Song* song)
@@ -291,7 +524,7 @@ bool save_sho(const char* filename, const Song* song)
 
 	if (version == 2)
 	{
-		memcpy(fbuf+NOTE_POS,song->notes,576);
+		get_notes(song,0,96,fbuf+NOTE_POS);
 		fbuf[NOTE_POS+576] = song->tempo;
 
 		// extended data
@@ -306,7 +539,7 @@ bool save_sho(const char* filename, const Song* song)
 		fbuf[NOTE_POS+2] = song->loop ? 1 : 0;
 		fbuf[NOTE_POS+3] = (song->metre != 4) ? 0 : 1;
 		fbuf[NOTE_POS+4] = song->tempo;
-		memcpy(fbuf+NOTE_POS+5,song->notes,6*song->length);
+		get_notes(song,0,song->length,fbuf+NOTE_POS+5);
 		fsize = NOTE_POS + 5 + (6 * song->length);
 	}
 
@@ -319,7 +552,8 @@ bool save_sho(const char* filename, const Song* song)
 	return true;
 }
 
-void save_ram(unsigned char* ram, const Song* song)
+// writes a view of up to 96 beats of the song, starting at beat offset
+void save_ram(unsigned char* ram, const Song* song, int offset, int length)
 {
 	// positions relative to original zst savestate at 0x15F7
 	const int POS_NOTES  = 0x15F7 - 0x15F7;
@@ -334,45 +568,53 @@ void save_ram(unsigned char* ram, const Song* song)
 	uint32 play_tempo = (song->tempo + 14) * 3291161;
 
 	// insert data
-	memcpy(     ram+POS_NOTES,  song->notes, 576);
-	write_short(ram+POS_LENGTH, (song->length + 2) << 3);
+	get_notes(song, offset, 96, ram+POS_NOTES);
+	write_short(ram+POS_LENGTH, (length + 2) << 3);
 	write_long( ram+POS_SPEED,  play_tempo);
 	ram[POS_LOOP ] = (song->loop) ? 1 : 0;
 	ram[POS_TEMPO] = song->tempo;
 	ram[POS_METRE] = (song->metre == 3) ? 0 : 1;
 }
 
-bool save_zst(const char* filename, const Song* song)
-{
-	if (song->length > 96)
-	{
-		fmsg = "Song too long for savestate. Use F10 for multi-export.";
-		return false;
-	}
+// savestate templates are read into fbuf once, then patched per export
+// with a small copy of the RAM block, so fbuf itself is never modified
+// and several exports may share it at once
 
-	// reuse specified file if it exists
-	unsigned int length = read_file(filename);
-	if (length < 1)
+// reuse specified file if it exists, otherwise start from the default ZST
+bool load_zst_template(const char* filename, unsigned int* length)
+{
+	*length = read_file(filename);
+	if (*length < 1)
 	{
 		// just build a new ZST if the file doesn't exist
-		length = ZST_SIZE;
+		const void* zst_block = asset_block(ASSET_ZST);
+		if (zst_block == NULL) { fmsg = "Unable to unpack default ZSNES savestate."; return false; }
+		*length = ZST_SIZE;
 		memcpy(fbuf,zst_block,ZST_SIZE);
 	}
-	else if (length < 0x1846) { fmsg = "File too small."; return false; }
-	else if (length >= FBUF_SIZE) { fmsg = "File is unexpectedly large."; return false; }
+	else if (*length < 0x1846) { fmsg = "File too small."; return false; }
+	else if (*length >= FBUF_SIZE) { fmsg = "File is unexpectedly large."; return false; }
+	return true;
+}
 
-	save_ram(fbuf+0x15F7, song);
+bool write_zst(const char* filename, unsigned int length, const Song* song, int offset, int beats)
+{
+	unsigned char ram[RAM_SIZE];
+	memcpy(ram,fbuf+ZST_POS_DATA,RAM_SIZE);
+	save_ram(ram, song, offset, beats);
 
 	// save file
 	FILE* f = fopen(filename, "wb");
-	if (f == NULL) { fmsg = "Could not open file for write."; return false; }
+	if (f == NULL) return false;
 
-	fwrite(fbuf,1,length,f);
+	fwrite(fbuf,1,ZST_POS_DATA,f);
+	fwrite(ram,1,RAM_SIZE,f);
+	fwrite(fbuf+ZST_POS_DATA+RAM_SIZE,1,length-(ZST_POS_DATA+RAM_SIZE),f);
 	fclose(f);
 	return true;
 }
 
-bool save_s9x(const char* filename, const Song* song)
+bool save_zst(const char* filename, const Song* song)
 {
 	if (song->length > 96)
 	{
@@ -380,12 +622,29 @@ bool save_s9x(const char* filename, const Song* song)
 		return false;
 	}
 
-	const int POS_DATA = 0x115BF;
+	unsigned int length;
+	if (!load_zst_template(filename, &length)) return false;
+
+	if (!write_zst(filename, length, song, 0, song->length))
+	{
+		fmsg = "Could not open file for write.";
+		return false;
+	}
+	return true;
+}
 
+bool load_s9x_template(const char* filename, unsigned int* length)
+{
 	// if a ready savestate file does not exist, create it from the default file
 	FILE* f = fopen(filename,"rb");
 	if (f == NULL)
 	{
+		const void* s9x_block = asset_block(ASSET_S9X);
+		if (s9x_block == NULL)
+		{
+			fmsg = "Unable to unpack default SNES9X savestate.";
+			return false;
+		}
 		f = fopen(filename,"wb");
 		if (f == NULL)
 		{
@@ -402,191 +661,1191 @@ bool save_s9x(const char* filename, const Song* song)
 	gzFile gf = gzopen(filename,"rb");
 	if (gf == NULL) { fmsg = "Unable to open gz compressed file."; return false; }
 
-
-	int length = gzread(gf,fbuf,FBUF_SIZE);
+	int gl = gzread(gf,fbuf,FBUF_SIZE);
 	gzclose(gf);
-	if (length < POS_DATA + 1024) { fmsg = "File too small."; return false; }
-	else if (length >= FBUF_SIZE) { fmsg = "File is unexpectedly large."; return false; }
+	if (gl < S9X_POS_DATA + 1024) { fmsg = "File too small."; return false; }
+	else if (gl >= FBUF_SIZE) { fmsg = "File is unexpectedly large."; return false; }
 
-	// insert data
-	save_ram(fbuf+POS_DATA, song);
+	*length = gl;
+	return true;
+}
+
+bool write_s9x(const char* filename, unsigned int length, const Song* song, int offset, int beats)
+{
+	unsigned char ram[RAM_SIZE];
+	memcpy(ram,fbuf+S9X_POS_DATA,RAM_SIZE);
+	save_ram(ram, song, offset, beats);
 
 	// save data
-	gf = gzopen(filename, "wb");
-	if (gf == NULL) { fmsg = "Could not open file for write."; return false; }
-	gzwrite(gf,fbuf,length);
+	gzFile gf = gzopen(filename, "wb");
+	if (gf == NULL) return false;
+	gzwrite(gf,fbuf,S9X_POS_DATA);
+	gzwrite(gf,ram,RAM_SIZE);
+	gzwrite(gf,fbuf+S9X_POS_DATA+RAM_SIZE,length-(S9X_POS_DATA+RAM_SIZE));
 	gzclose(gf);
 	return true;
 }
 
-bool save_wav(const char* filename, const Song* song)
+bool save_s9x(const char* filename, const Song* song)
 {
-	const unsigned int SAMPLERATE = 32000;
+	if (song->length > 96)
+	{
+		fmsg = "Song too long for savestate. Use F10 for multi-export.";
+		return false;
+	}
 
-	FILE* f = fopen(filename, "wb");
-	if (f == NULL) { fmsg = "Could not open file for write."; return false; }
+	unsigned int length;
+	if (!load_s9x_template(filename, &length)) return false;
 
-	const unsigned int LEADER = SAMPLERATE / 4; // silent leader
-	const unsigned int TAIL   = SAMPLERATE * 3; // extra at end (if looped, fade it out)
+	if (!write_s9x(filename, length, song, 0, song->length))
+	{
+		fmsg = "Could not open file for write.";
+		return false;
+	}
+	return true;
+}
 
-	player::stop_song();
-	player::silence();
-	player::set_samplerate(SAMPLERATE);
+// multi-export writes each 96 beat chunk to its own slot,
+// all slots share the template read from the first slot's file
 
-	player::play_song();
-	unsigned int beat_length = player::get_beat_length();
-	unsigned int body_length = song->length * beat_length;
+const int MULTI_SLOTS = 100; // .zs0-.z99, .000-.099
 
-	unsigned int total_length =
-		LEADER +
-		body_length +
-		(song->loop ? body_length : 0) + // loop plays body 2x
-		TAIL;
+struct MultiJob
+{
+	const Song* song;
+	bool s9x;
+	unsigned int length; // of template in fbuf
+	char filename[MULTI_SLOTS][1024];
+	bool failed[MULTI_SLOTS];
+};
+
+void multi_job(int index, void* data)
+{
+	MultiJob* job = (MultiJob*)data;
+	int offset = index * 96;
+	int beats = job->song->length - offset;
+	if (beats > 96) beats = 96;
+
+	bool result = job->s9x ?
+		write_s9x(job->filename[index], job->length, job->song, offset, beats) :
+		write_zst(job->filename[index], job->length, job->song, offset, beats);
+	job->failed[index] = !result;
+}
 
-	unsigned int total_size =
-		36 + // WAV header size
-		(total_length * 2) + // WAV data size
-		(song->loop ? 68 : 0); // smpl chunk size
+// .wav rendering
+//   Renders are kept in chunks of up to CHUNK_BEATS beats, which restart at the
+//   start of each pass of a loop. The samples of a chunk depend only on the columns
+//   it plays and the columns just before it, whose notes may still be sounding, so
+//   a chunk whose columns were already rendered is copied instead of rendered.
+//   The second pass of a loop, and the tail after it, copy the first pass except for
+//   a few chunks at the seam, and save_wav keeps its last render so that the next
+//   renders only the chunks an edit has changed.
+//   Samples are kept before the mix is scaled down to 16 bits, and measured as each
+//   chunk is made, so a normalized export scales them on the way out without a
+//   second render.
+
+const int CHUNK_BEATS = 8;
+
+struct WavChunk
+{
+	unsigned int start; // samples after the leader
+	unsigned int length;
+	int beats;
+};
 
-	// WAV header
-	memcpy(     fbuf + 0x000, "RIFF", 4);
-	write_long( fbuf + 0x004, total_size);
-	memcpy(     fbuf + 0x008, "WAVE", 4);
-	memcpy(     fbuf + 0x00C, "fmt ", 4);
-	write_long( fbuf + 0x010, 16); // fmt chunk size
-	write_short(fbuf + 0x014, 1); // uncompressed
-	write_short(fbuf + 0x016, 1); // channels
-	write_long( fbuf + 0x018, SAMPLERATE);
-	write_long( fbuf + 0x01C, SAMPLERATE * 2);
-	write_short(fbuf + 0x020, 2); // bytes per sample
-	write_short(fbuf + 0x022, 16); // bits per sample
-	memcpy(     fbuf + 0x024, "data", 4);
-	write_long( fbuf + 0x028, (total_length * 2));
-	fwrite(fbuf,1,0x2C,f);
+struct WavCache
+{
+	unsigned int samplerate;
+	unsigned int beat_length;
+	unsigned int length; // samples after the leader
+	int window; // columns stored for each chunk, enough for CHUNK_BEATS beats
+	int chunks;
+	signed int* samples; // player::render_wide, before the tail fade
+	WavChunk* chunk;
+	unsigned char* columns; // columns each chunk depends on, blank past its beats
+	int* table; // chunk index by hash of its columns, -1 if empty
+	int table_size; // power of 2
+};
+
+static WavCache last_wav = { 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL, 0 }; // used by save_wav
+const unsigned int WAV_CACHE_MAX = 8 * 1024 * 1024; // samples last_wav keeps, about 4 minutes at 32 kHz
+static int normalize_mode = files::NORMALIZE_OFF; // used by save_wav and save_flac
+
+const double NORMALIZE_TARGET = -16.0; // LUFS
+const double NORMALIZE_CEILING = -1.0; // dB true peak
+const double WIDE_FULL_SCALE = double(32768 << player::WIDE_SHIFT);
+
+void free_wav_cache(WavCache* cache)
+{
+	free(cache->samples);
+	free(cache->chunk);
+	free(cache->columns);
+	free(cache->table);
+	cache->samples = NULL;
+	cache->chunk = NULL;
+	cache->columns = NULL;
+	cache->table = NULL;
+	cache->chunks = 0;
+}
 
-	// silent leader
-	memset(fbuf,0,LEADER*2);
-	fwrite(fbuf,1,LEADER*2,f);
+// after an export, drops a render too big to keep around for the next one
+void trim_wav_cache(WavCache* cache)
+{
+	if (cache->length > WAV_CACHE_MAX) free_wav_cache(cache);
+}
+
+// the column played at beat b of a render, counting on through loops
+const unsigned char* render_column(const Song* song, int b)
+{
+	int length = (song->length > 0) ? song->length : 1; // play_beat always plays beat 0
+	if (b < 0) return song_column(song, -1); // blank
+	if (song->loop) b %= length;
+	else if (b >= length) return song_column(song, -1);
+	return song_column(song, b);
+}
+
+// beats in the chunk starting at beat b of a render
+int render_chunk_beats(const Song* song, int b)
+{
+	int length = (song->length > 0) ? song->length : 1;
+	int beats = CHUNK_BEATS;
+	if (song->loop && (length - (b % length)) < beats) beats = length - (b % length);
+	return beats;
+}
+
+// FNV-1a
+unsigned int hash_columns(const unsigned char* columns, int n)
+{
+	unsigned int h = 2166136261u;
+	for (int i=0; i < (n * COLUMN_SIZE); ++i)
+		h = (h ^ columns[i]) * 16777619u;
+	return h;
+}
+
+// chunk of cache with the same columns and beats, and at least length samples, or -1
+int find_chunk(const WavCache* cache, const unsigned char* columns, unsigned int h,
+	int beats, unsigned int length)
+{
+	int mask = cache->table_size - 1;
+	for (int i = h & mask; cache->table[i] >= 0; i = (i + 1) & mask)
+	{
+		const WavChunk& chunk = cache->chunk[cache->table[i]];
+		if (chunk.beats != beats || chunk.length < length) continue;
+		if (memcmp(cache->columns + (cache->table[i] * cache->window * COLUMN_SIZE), columns, cache->window * COLUMN_SIZE)) continue;
+		return cache->table[i];
+	}
+	return -1;
+}
 
-	sint16* wbuf = (sint16*)fbuf;
+// starts p silent at beat b of a render
+void restart_player(player::Instance* p, const Song* song, int b)
+{
+	int length = (song->length > 0) ? song->length : 1;
+	player::play_song(p);
+	if (song->loop) player::set_beat(p, b % length);
+	else if (b < length) player::set_beat(p, b);
+	else player::stop_song(p);
+}
 
-	for (int l=0; l<=(song->loop?1:0); ++l)
+// renders length samples after the leader into a new cache, copying what it can
+// from itself and from the old one, which it replaces, and adds the first measured
+// samples to meter unless it is NULL; returns false if out of memory
+bool render_cached(const Song* song, player::Instance* p, unsigned int samplerate,
+	unsigned int length, WavCache* cache, loudness::Meter* meter, unsigned int measured)
+{
+	const unsigned int BLOCK_SIZE = 1024;
+	if (length > (size_t(-1) / sizeof(signed int))) // more than memory can address
 	{
-		const unsigned int BLOCK_SIZE = 1024 * 8;
-		unsigned int left = body_length;
-		while (left)
-		{
-			unsigned int block = (left > BLOCK_SIZE) ? BLOCK_SIZE : left;
-			player::render(wbuf,block);
-			flip_short((uint16*)wbuf,block);
-			fwrite(wbuf,1,block*2,f);
-			left -= block;
-		}
+		free_wav_cache(cache);
+		return false;
 	}
 
-	// render tail
-	player::render(wbuf,TAIL);
-	if (song->loop) // tail fades out if looped
+	WavCache next;
+	next.samplerate = samplerate;
+	next.beat_length = player::get_beat_length(p);
+	next.length = length;
+
+	int before = (player::get_ring_length(p) + next.beat_length - 1) / next.beat_length;
+	next.window = before + CHUNK_BEATS;
+	next.chunks = 0;
+	for (unsigned int b=0; (b * next.beat_length) < length; b += render_chunk_beats(song, b))
+		++next.chunks;
+	next.table_size = 16;
+	while (next.table_size < (next.chunks * 2)) next.table_size *= 2;
+
+	next.samples = (signed int*)malloc(length * sizeof(signed int));
+	next.chunk = (WavChunk*)malloc(next.chunks * sizeof(WavChunk));
+	next.columns = (unsigned char*)malloc(next.chunks * next.window * COLUMN_SIZE);
+	next.table = (int*)malloc(next.table_size * sizeof(int));
+	if (next.samples == NULL || next.chunk == NULL || next.columns == NULL || next.table == NULL)
 	{
-		for (int i=0; i<TAIL; ++i)
-		{
-			double fade = (double(TAIL-i) / double(TAIL));
-			wbuf[i] = sint32(fade * double(wbuf[i]));
-		}
+		free_wav_cache(&next);
+		free_wav_cache(cache);
+		return false;
 	}
-	flip_short((uint16*)wbuf, TAIL);
-	fwrite(wbuf,1,TAIL*2,f);
+	for (int i=0; i < next.table_size; ++i) next.table[i] = -1;
 
-	// if looped add sampler chunk
-	if (song->loop)
+	bool reuse =
+		cache->chunks > 0 &&
+		cache->samplerate == next.samplerate &&
+		cache->beat_length == next.beat_length &&
+		cache->window == next.window;
+
+	signed int discard[BLOCK_SIZE];
+	unsigned int rendered = 0; // p is ready to render from here
+	bool ready = false;
+
+	int b = 0;
+	for (int c=0; c < next.chunks; ++c)
 	{
-		memcpy(     fbuf + 0x000, "smpl", 4);
-		write_long( fbuf + 0x004, 60); // fmt chunk size
-		write_long( fbuf + 0x008, 0); // manufacturer
-		write_long( fbuf + 0x00C, 0); // product
-		write_long( fbuf + 0x010, int(1000000000.0 / double(SAMPLERATE))); // nanoseconds/sample
-		write_long( fbuf + 0x014, 60); // midi note
-		write_long( fbuf + 0x018, 0); // fine pitch
-		write_long( fbuf + 0x01C, 0); // SMPTE format
-		write_long( fbuf + 0x020, 0); // SMPTE offset
-		write_long( fbuf + 0x024, 1); // loops
-		write_long( fbuf + 0x028, 0); // extra data size
-		write_long( fbuf + 0x02C, 0); // loop identifier
-		write_long( fbuf + 0x030, 0); // loop direction
-		write_long( fbuf + 0x034, (LEADER+body_length)); // loop start
-		write_long( fbuf + 0x038, (LEADER+body_length+body_length-1)); // loop end
-		write_long( fbuf + 0x03C, 0); // loop fractional tuning
-		write_long( fbuf + 0x040, 0); // loop play count
-		fwrite(fbuf,1,0x044,f);
-	}
-
-	// finish file
-	fclose(f);
+		WavChunk& chunk = next.chunk[c];
+		chunk.beats = render_chunk_beats(song, b);
+		chunk.start = b * next.beat_length;
+		chunk.length = chunk.beats * next.beat_length;
+		if (chunk.length > (length - chunk.start)) chunk.length = length - chunk.start;
+
+		int first = b - before;
+		unsigned char* columns = next.columns + (c * next.window * COLUMN_SIZE);
+		for (int i=0; i < next.window; ++i)
+			memcpy(columns + (i * COLUMN_SIZE), render_column(song, (i < (before + chunk.beats)) ? (first + i) : -1), COLUMN_SIZE);
+		unsigned int h = hash_columns(columns, next.window);
+		b += chunk.beats;
+
+		signed int* out = next.samples + chunk.start;
+		int found = find_chunk(&next, columns, h, chunk.beats, chunk.length);
+		if (found >= 0)
+			memcpy(out, next.samples + next.chunk[found].start, chunk.length * sizeof(signed int));
+		else if (reuse && (found = find_chunk(cache, columns, h, chunk.beats, chunk.length)) >= 0)
+			memcpy(out, cache->samples + cache->chunk[found].start, chunk.length * sizeof(signed int));
+		else
+		{
+			if (!ready || rendered != chunk.start)
+			{
+				// earlier notes can no longer be heard, so start from silence
+				if (first < 0) first = 0;
+				restart_player(p, song, first);
+				for (unsigned int left = chunk.start - (first * next.beat_length); left; )
+				{
+					unsigned int block = (left > BLOCK_SIZE) ? BLOCK_SIZE : left;
+					player::render_wide(p, discard, block);
+					left -= block;
+				}
+				ready = true;
+			}
+			player::render_wide(p, out, chunk.length);
+			rendered = chunk.start + chunk.length;
+		}
+
+		if (meter != NULL && chunk.start < measured)
+		{
+			unsigned int count = measured - chunk.start;
+			if (count > chunk.length) count = chunk.length;
+			if (!loudness::add(meter, out, count))
+			{
+				free_wav_cache(&next);
+				free_wav_cache(cache);
+				return false;
+			}
+		}
+
+		int t = h & (next.table_size - 1);
+		while (next.table[t] >= 0) t = (t + 1) & (next.table_size - 1);
+		next.table[t] = c;
+	}
 
-	player::stop_song();
-	player::silence();
+	free_wav_cache(cache);
+	*cache = next;
 	return true;
 }
 
-// public interface
+// most 16-bit samples in a .wav, leaving room in its 32-bit RIFF size for the chunks around them
+const double WAV_SAMPLES_MAX = 2147483648.0 - 128.0;
 
-namespace files
+// samples in a render at beat_length, body_length the song once, and total_length
+// everything with the leader, the loop played twice and the tail,
+// false if they are too many for a .wav
+bool render_length(const Song* song, unsigned int samplerate, unsigned int beat_length,
+	unsigned int* body_length, unsigned int* total_length)
 {
+	double body = double(song->length) * double(beat_length);
+	double total = double(samplerate / 4) + (song->loop ? (body * 2.0) : body) + (double(samplerate) * 3.0);
+	if (total > WAV_SAMPLES_MAX) return false;
+	*body_length = (unsigned int)body;
+	*total_length = (unsigned int)total;
+	return true;
+}
 
-bool load_file(const char* filename, Song* song)
+// render_length for the song at samplerate, sets fmsg on failure
+bool check_render_length(const Song* song, unsigned int samplerate, unsigned int* body_length)
 {
-	const char* ext = strrchr(filename, '.');
-	if (ext == NULL) { fmsg = "Unknown extension."; return false; }
-	if      (!stricmp(ext, ".sho")) return load_sho(filename,song);
-	else if (!stricmp(ext, ".zst")) return load_zst(filename,song);
-	else if (!stricmp(ext, ".zs0")) return load_zst(filename,song);
-	else if (!stricmp(ext, ".zs1")) return load_zst(filename,song);
-	else if (!stricmp(ext, ".zs2")) return load_zst(filename,song);
-	else if (!stricmp(ext, ".zs3")) return load_zst(filename,song);
-	else if (!stricmp(ext, ".zs4")) return load_zst(filename,song);
-	else if (!stricmp(ext, ".zs5")) return load_zst(filename,song);
-	else if (!stricmp(ext, ".zs6")) return load_zst(filename,song);
-	else if (!stricmp(ext, ".zs7")) return load_zst(filename,song);
-	else if (!stricmp(ext, ".zs8")) return load_zst(filename,song);
-	else if (!stricmp(ext, ".zs9")) return load_zst(filename,song);
-	else if (!stricmp(ext, ".000")) return load_s9x(filename,song);
-	else if (!stricmp(ext, ".001")) return load_s9x(filename,song);
-	else if (!stricmp(ext, ".002")) return load_s9x(filename,song);
-	else if (!stricmp(ext, ".003")) return load_s9x(filename,song);
-	else if (!stricmp(ext, ".004")) return load_s9x(filename,song);
-	else if (!stricmp(ext, ".005")) return load_s9x(filename,song);
-	else if (!stricmp(ext, ".006")) return load_s9x(filename,song);
-	else if (!stricmp(ext, ".007")) return load_s9x(filename,song);
-	else if (!stricmp(ext, ".008")) return load_s9x(filename,song);
-	else if (strlen(ext) == 4 &&
-		ext[0] == '.' &&
-		(ext[1] == 'z' || ext[1] == 'Z') &&
-		(ext[2] >= '0' && ext[2] <= '9') &&
-		(ext[3] >= '0' && ext[3] <= '9'))
+	player::Instance* p = player::create(song, samplerate);
+	if (p == NULL) { fmsg = "Out of memory."; return false; }
+	player::play_song(p);
+	unsigned int beat_length = player::get_beat_length(p);
+	player::destroy(p);
+
+	unsigned int total_length;
+	if (!render_length(song, samplerate, beat_length, body_length, &total_length))
 	{
-		return load_zst(filename,song);
+		fmsg = "Song too long to render.";
+		return false;
 	}
-	else if (strlen(ext) == 4 &&
-		ext[0] == '.' &&
-		(ext[1] == '0' && ext[1] <= '9') &&
-		(ext[2] >= '0' && ext[2] <= '9') &&
-		(ext[3] >= '0' && ext[3] <= '9'))
+	return true;
+}
+
+// renders with its own player, so it is safe on any thread with its own cache,
+// or without one it renders as it writes
+// user[0] receives the mix, and user[1+i] the stem of voice i for the first stems voices
+// normalize needs a cache, and applies to the mix only
+// on failure error is set to why, fmsg is left alone for other threads
+bool render_song(const Song* song, unsigned int samplerate, bool header,
+	bool (*write)(const void* data, unsigned int size, void* user), void* const* user,
+	int stems, WavCache* cache, int normalize, const char** error)
+{
+	*error = "Out of memory.";
+
+	const unsigned int LEADER = samplerate / 4; // silent leader
+	const unsigned int TAIL   = samplerate * 3; // extra at end (if looped, fade it out)
+	const unsigned int BLOCK_SIZE = 1024 * 8;
+
+	sint16* stem[player::VOICES] = { NULL, NULL, NULL, NULL };
+	sint16* sbuf = NULL;
+	if (stems > 0)
 	{
-		return load_s9x(filename,song);
+		sbuf = (sint16*)malloc(stems * BLOCK_SIZE * 2);
+		if (sbuf == NULL) return false;
+		for (int i=0; i < stems; ++i) stem[i] = sbuf + (i * BLOCK_SIZE);
 	}
 
-	fmsg = "Unknown extension.";
-	return false;
-}
+	player::Instance* p = player::create(song, samplerate);
+	if (p == NULL) { free(sbuf); return false; }
 
-bool save_file(const char* filename, const Song* song)
-{
-	const char* ext = strrchr(filename, '.');
-	if (ext == NULL) { fmsg = "Unknown extension."; return false; }
-	if      (!stricmp(ext, ".sho")) return save_sho(filename,song);
-	else if (!stricmp(ext, ".zst")) return save_zst(filename,song);
-	else if (!stricmp(ext, ".zs0")) return save_zst(filename,song);
-	else if (!stricmp(ext, ".zs1")) return save_zst(filename,song);
+	player::play_song(p);
+	unsigned int body_length, total_length;
+	if (!render_length(song, samplerate, player::get_beat_length(p), &body_length, &total_length))
+	{
+		player::destroy(p);
+		free(sbuf);
+		*error = "Song too long to render.";
+		return false;
+	}
+	unsigned int tail_start = total_length - LEADER - TAIL; // loop plays body 2x
+
+	// without a cache, or the memory for one, it renders as it writes
+	const signed int* cached = NULL;
+	loudness::Meter* meter = NULL;
+	if (stems < 1 && cache != NULL && normalize != files::NORMALIZE_OFF)
+	{
+		meter = loudness::create(samplerate, WIDE_FULL_SCALE);
+		if (meter == NULL) { player::destroy(p); return false; }
+	}
+	// a loop is measured as it plays, without the tail that fades it out
+	unsigned int measured = song->loop ? tail_start : (total_length - LEADER);
+	if (stems < 1 && cache != NULL && render_cached(song, p, samplerate, total_length - LEADER, cache, meter, measured))
+		cached = cache->samples;
+
+	// gain to the target loudness, held under the ceiling by the true peak or the limiter
+	double gain = 1.0;
+	loudness::Limiter* limiter = NULL;
+	if (meter != NULL)
+	{
+		double lufs = loudness::integrated(meter);
+		loudness::destroy(meter);
+		if (cached == NULL) { player::destroy(p); return false; }
+
+		double db = (lufs > loudness::SILENT) ? (NORMALIZE_TARGET - lufs) : 0.0;
+		if (normalize == files::NORMALIZE_LIMIT)
+		{
+			gain = loudness::limited_gain(cached, measured, samplerate, WIDE_FULL_SCALE,
+				pow(10.0, db / 20.0), NORMALIZE_TARGET, NORMALIZE_CEILING);
+			if (gain > 0) limiter = loudness::create_limiter(cached, total_length - LEADER,
+				samplerate, WIDE_FULL_SCALE, gain, NORMALIZE_CEILING);
+			if (limiter == NULL) { player::destroy(p); return false; }
+		}
+		else
+		{
+			double peak = loudness::true_peak(cached, total_length - LEADER, WIDE_FULL_SCALE);
+			if (peak > loudness::SILENT && db > (NORMALIZE_CEILING - peak)) db = NORMALIZE_CEILING - peak;
+			gain = pow(10.0, db / 20.0);
+		}
+	}
+
+	unsigned int total_size =
+		36 + // WAV header size
+		(total_length * 2) + // WAV data size
+		(song->loop ? 68 : 0); // smpl chunk size
+
+	unsigned char chunk[0x44];
+	bool result = true;
+
+	// WAV header
+	if (header)
+	{
+		memcpy(     chunk + 0x000, "RIFF", 4);
+		write_long( chunk + 0x004, total_size);
+		memcpy(     chunk + 0x008, "WAVE", 4);
+		memcpy(     chunk + 0x00C, "fmt ", 4);
+		write_long( chunk + 0x010, 16); // fmt chunk size
+		write_short(chunk + 0x014, 1); // uncompressed
+		write_short(chunk + 0x016, 1); // channels
+		write_long( chunk + 0x018, samplerate);
+		write_long( chunk + 0x01C, samplerate * 2);
+		write_short(chunk + 0x020, 2); // bytes per sample
+		write_short(chunk + 0x022, 16); // bits per sample
+		memcpy(     chunk + 0x024, "data", 4);
+		write_long( chunk + 0x028, (total_length * 2));
+		for (int o=0; result && o <= stems; ++o)
+			result = write(chunk,0x2C,user[o]);
+	}
+
+	sint16 wbuf[BLOCK_SIZE];
+
+	// silent leader
+	memset(wbuf,0,sizeof(wbuf));
+	for (unsigned int left = LEADER; result && left; )
+	{
+		unsigned int block = (left > BLOCK_SIZE) ? BLOCK_SIZE : left;
+		for (int o=0; result && o <= stems; ++o)
+			result = write(wbuf,block*2,user[o]);
+		left -= block;
+	}
+
+	// body, then the tail
+	unsigned int pos = 0;
+	while (result && pos < total_length - LEADER)
+	{
+		unsigned int left = total_length - LEADER - pos;
+		unsigned int block = (left > BLOCK_SIZE) ? BLOCK_SIZE : left;
+		if (limiter != NULL) loudness::process(limiter,wbuf,block);
+		else if (gain != 1.0) loudness::apply_gain(cached+pos,wbuf,block,WIDE_FULL_SCALE,gain);
+		else if (cached != NULL)
+		{
+			for (unsigned int i=0; i<block; ++i)
+				wbuf[i] = sint16(cached[pos+i] >> player::WIDE_SHIFT);
+		}
+		else player::render(p,wbuf,(stems > 0) ? stem : NULL,block);
+		for (int o=0; result && o <= stems; ++o)
+		{
+			sint16* obuf = (o == 0) ? wbuf : stem[o-1];
+			if (song->loop) // tail fades out if looped
+			{
+				for (unsigned int i = (pos < tail_start) ? (tail_start-pos) : 0; i<block; ++i)
+				{
+					double fade = (double(TAIL-((pos+i)-tail_start)) / double(TAIL));
+					obuf[i] = sint32(fade * double(obuf[i]));
+				}
+			}
+			flip_short((uint16*)obuf,block);
+			result = write(obuf,block*2,user[o]);
+		}
+		pos += block;
+	}
+
+	// if looped add sampler chunk
+	if (result && header && song->loop)
+	{
+		memcpy(     chunk + 0x000, "smpl", 4);
+		write_long( chunk + 0x004, 60); // fmt chunk size
+		write_long( chunk + 0x008, 0); // manufacturer
+		write_long( chunk + 0x00C, 0); // product
+		write_long( chunk + 0x010, int(1000000000.0 / double(samplerate))); // nanoseconds/sample
+		write_long( chunk + 0x014, 60); // midi note
+		write_long( chunk + 0x018, 0); // fine pitch
+		write_long( chunk + 0x01C, 0); // SMPTE format
+		write_long( chunk + 0x020, 0); // SMPTE offset
+		write_long( chunk + 0x024, 1); // loops
+		write_long( chunk + 0x028, 0); // extra data size
+		write_long( chunk + 0x02C, 0); // loop identifier
+		write_long( chunk + 0x030, 0); // loop direction
+		write_long( chunk + 0x034, (LEADER+body_length)); // loop start
+		write_long( chunk + 0x038, (LEADER+body_length+body_length-1)); // loop end
+		write_long( chunk + 0x03C, 0); // loop fractional tuning
+		write_long( chunk + 0x040, 0); // loop play count
+		for (int o=0; result && o <= stems; ++o)
+			result = write(chunk,0x044,user[o]);
+	}
+
+	loudness::destroy(limiter);
+	player::destroy(p);
+	free(sbuf);
+	if (!result) *error = "Unable to write file.";
+	return result;
+}
+
+bool write_wav(const void* data, unsigned int size, void* user)
+{
+	return fwrite(data,1,size,(FILE*)user) == size;
+}
+
+bool save_wav(const char* filename, const Song* song)
+{
+	unsigned int body_length;
+	if (!check_render_length(song, 32000, &body_length)) return false;
+
+	FILE* f = fopen(filename, "wb");
+	if (f == NULL) { fmsg = "Could not open file for write."; return false; }
+
+	void* user = f;
+	const char* error;
+	bool result = render_song(song, 32000, true, write_wav, &user, 0, &last_wav, normalize_mode, &error);
+	trim_wav_cache(&last_wav);
+	fclose(f);
+	if (!result) fmsg = error;
+	return result;
+}
+
+// render_song passes little endian samples
+bool write_flac(const void* data, unsigned int size, void* user)
+{
+	const unsigned char* d = (const unsigned char*)data;
+	sint16 samples[1024];
+	for (unsigned int count = size / 2; count; )
+	{
+		unsigned int n = (count > 1024) ? 1024 : count;
+		for (unsigned int i=0; i < n; ++i)
+			samples[i] = sint16(read_short(d + (i * 2)));
+		if (!flac::write((flac::Writer*)user, samples, n)) return false;
+		d += n * 2;
+		count -= n;
+	}
+	return true;
+}
+
+// same render as save_wav, with the loop given as LOOPSTART and LOOPLENGTH tags
+bool save_flac(const char* filename, const Song* song)
+{
+	const unsigned int SAMPLERATE = 32000;
+
+	char tag[4][64];
+	const char* tags[4];
+	int tag_count = 0;
+	if (song->title[0])
+		sprintf(tag[tag_count++], "TITLE=%.31s", song->title);
+	if (song->author[0])
+		sprintf(tag[tag_count++], "ARTIST=%.31s", song->author);
+	unsigned int body_length;
+	if (!check_render_length(song, SAMPLERATE, &body_length)) return false;
+	if (song->loop)
+	{
+		sprintf(tag[tag_count++], "LOOPSTART=%u", (SAMPLERATE / 4) + body_length); // after leader
+		sprintf(tag[tag_count++], "LOOPLENGTH=%u", body_length);
+	}
+	for (int i=0; i < tag_count; ++i) tags[i] = tag[i];
+
+	FILE* f = fopen(filename, "wb");
+	if (f == NULL) { fmsg = "Could not open file for write."; return false; }
+
+	flac::Writer* w = flac::create(f, SAMPLERATE, tags, tag_count);
+	if (w == NULL) { fclose(f); fmsg = "Out of memory."; return false; }
+
+	void* user = w;
+	const char* error = "Unable to write file."; // if only finishing fails
+	bool result = render_song(song, SAMPLERATE, false, write_flac, &user, 0, &last_wav, normalize_mode, &error);
+	trim_wav_cache(&last_wav);
+	result = flac::finish(w) && result;
+	fclose(f);
+	if (!result) fmsg = error;
+	return result;
+}
+
+// writes the mix to filename, and channels A, B, C each to filename_a.wav etc.
+// (the preview voice is never played by a song, so it has no stem)
+bool save_stems(const char* filename, const Song* song)
+{
+	const int STEMS = 3;
+	char stem_filename[STEMS][1024];
+
+	const char* ext = strrchr(filename, '.');
+	if (strlen(filename) >= (1024 - 2))
+	{
+		fmsg = "Filename too long.";
+		return false;
+	}
+	for (int i=0; i < STEMS; ++i)
+	{
+		int base = int(ext - filename);
+		memcpy(stem_filename[i], filename, base);
+		sprintf(stem_filename[i] + base, "_%c%s", 'a' + i, ext);
+	}
+
+	unsigned int body_length;
+	if (!check_render_length(song, 32000, &body_length)) return false;
+
+	FILE* f[1+STEMS];
+	void* user[1+STEMS];
+	bool result = true;
+	for (int o=0; o <= STEMS; ++o)
+	{
+		f[o] = result ? fopen((o == 0) ? filename : stem_filename[o-1], "wb") : NULL;
+		if (f[o] == NULL) result = false;
+		user[o] = f[o];
+	}
+	if (!result)
+	{
+		for (int o=0; o <= STEMS; ++o) if (f[o] != NULL) fclose(f[o]);
+		fmsg = "Could not open file for write.";
+		return false;
+	}
+
+	const char* error;
+	result = render_song(song, 32000, true, write_wav, user, STEMS, NULL, files::NORMALIZE_OFF, &error);
+	for (int o=0; o <= STEMS; ++o) fclose(f[o]);
+	if (!result) fmsg = error;
+	return result;
+}
+
+// .shp song archive
+//   many songs in one file, laid out so that it can be used directly
+//   from a memory mapped view: every field is little endian at a fixed
+//   position, and song i is found at a known table position without parsing
+//
+//   header, 16 bytes
+//     0  "shpk"
+//     4  uint16 version (1)
+//     6  uint16 table entry size (144)
+//     8  uint32 song count
+//    12  uint32 reserved
+//   table, song count entries of 144 bytes, entry i at 16 + (144 * i)
+//     0  uint32 offset of notes from start of file
+//     4  uint32 size of notes (6 * length)
+//     8  uint16 length
+//    10  uint8  tempo
+//    11  uint8  metre (3 or 4)
+//    12  uint8  loop
+//    13  3 bytes reserved
+//    16  char[32] title
+//    48  char[32] author
+//    80  char[64] name of the .sho file it was packed from
+//   notes, each song's 6 byte note columns, 4 byte aligned
+
+const int SHP_HEADER = 16;
+const int SHP_ENTRY = 144;
+const int SHP_VERSION = 1;
+
+static char fmsg_buf[1024]; // for error messages that name a file
+
+// returns number of songs, or -1 if not a valid archive
+int archive_count(const unsigned char* archive, unsigned int size)
+{
+	if (size < SHP_HEADER) return -1;
+	if (read_long(archive+0) != read_long("shpk")) return -1;
+	if (read_short(archive+4) != SHP_VERSION) return -1;
+	if (read_short(archive+6) != SHP_ENTRY) return -1;
+	uint32 count = read_long(archive+8);
+	if (count > ((size - SHP_HEADER) / SHP_ENTRY)) return -1;
+	return int(count);
+}
+
+bool archive_song(const unsigned char* archive, unsigned int size, int index, Song* song)
+{
+	int count = archive_count(archive, size);
+	if (count < 0) { fmsg = "Not a valid .shp archive."; return false; }
+	if (index < 0 || index >= count) { fmsg = "Song not found in archive."; return false; }
+
+	const unsigned char* entry = archive + SHP_HEADER + (SHP_ENTRY * index);
+	uint32 offset = read_long(entry+0);
+	uint32 bytes  = read_long(entry+4);
+	int length    = read_short(entry+8);
+
+	if (length < 1 || bytes != uint32(6 * length))
+	{
+		fmsg = "Not a valid .shp archive.";
+		return false;
+	}
+	if (offset > size || bytes > (size - offset))
+	{
+		fmsg = "Not enough data in file.";
+		return false;
+	}
+
+	if (!set_notes(song, archive + offset, length)) return false;
+
+	song->length = length;
+	song->limit  = 96;
+	song->tempo  = entry[10];
+	song->metre  = (entry[11] == 3) ? 3 : 4;
+	song->loop   = (entry[12] != 0);
+	memcpy(song->title,  entry+16, 32);
+	memcpy(song->author, entry+48, 32);
+	song->title[ 31] = 0;
+	song->author[31] = 0;
+
+	return clean_song(song);
+}
+
+bool load_shp(const char* filename, int index, Song* song)
+{
+	unsigned int size;
+	const unsigned char* archive = os::map_file(filename, &size);
+	if (archive == NULL) { fmsg = "Empty file."; return false; }
+
+	bool result = archive_song(archive, size, index, song);
+	os::unmap_file(archive, size);
+	return result;
+}
+
+// list of .sho files and savestates found by os::list_dir
+
+struct NameList
+{
+	char** names;
+	int count;
+	int capacity;
+};
+
+void name_list_add(const char* name, bool folder, void* data)
+{
+	if (folder || !files::can_load(name) || files::match_extension(name, ".shp")) return;
+
+	NameList* list = (NameList*)data;
+	if (list->count >= list->capacity)
+	{
+		int capacity = (list->capacity < 64) ? 64 : (list->capacity * 2);
+		char** names = (char**)realloc(list->names, capacity * sizeof(char*));
+		if (names == NULL) return;
+		list->names = names;
+		list->capacity = capacity;
+	}
+
+	char* copy = (char*)malloc(strlen(name)+1);
+	if (copy == NULL) return;
+	strcpy(copy, name);
+	list->names[list->count++] = copy;
+}
+
+int name_compare(const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+void name_list_free(NameList* list)
+{
+	for (int i=0; i < list->count; ++i)
+		free(list->names[i]);
+	free(list->names);
+}
+
+bool pack_shp(const char* directory, const char* filename)
+{
+	NameList list = { NULL, 0, 0 };
+	if (!os::list_dir(directory, name_list_add, &list))
+	{
+		fmsg = "Unable to read directory.";
+		return false;
+	}
+	qsort(list.names, list.count, sizeof(char*), name_compare);
+
+	unsigned char* table = (unsigned char*)calloc(list.count + 1, SHP_ENTRY);
+	FILE* f = fopen(filename, "wb");
+	if (table == NULL || f == NULL)
+	{
+		fmsg = (f == NULL) ? "Could not open file for write." : "Out of memory.";
+		if (f) fclose(f);
+		free(table);
+		name_list_free(&list);
+		return false;
+	}
+
+	// header and a blank table, the table is filled in after the notes are written
+	unsigned char header[SHP_HEADER];
+	memset(header, 0, sizeof(header));
+	memcpy(     header+0, "shpk", 4);
+	write_short(header+4, SHP_VERSION);
+	write_short(header+6, SHP_ENTRY);
+	write_long( header+8, list.count);
+	bool result =
+		fwrite(header, 1, SHP_HEADER, f) == SHP_HEADER &&
+		fwrite(table, SHP_ENTRY, list.count, f) == size_t(list.count);
+	if (!result) fmsg = "Unable to write file.";
+
+	static Song song;
+	uint32 offset = SHP_HEADER + (SHP_ENTRY * list.count);
+	for (int i=0; result && i < list.count; ++i)
+	{
+		static char path[1024];
+		if (snprintf(path, sizeof(path), "%s/%s", directory, list.names[i]) >= int(sizeof(path)))
+		{
+			fmsg = "Filename too long.";
+			result = false;
+			break;
+		}
+
+		song.title[0] = 0;
+		song.author[0] = 0;
+		if (!files::load_file(path, &song))
+		{
+			sprintf(fmsg_buf, "%.900s\n%s", path, fmsg);
+			fmsg = fmsg_buf;
+			result = false;
+			break;
+		}
+
+		unsigned int bytes = PAIRS_SIZE * song.length;
+		unsigned char* entry = table + (SHP_ENTRY * i);
+		write_long( entry+0, offset);
+		write_long( entry+4, bytes);
+		write_short(entry+8, song.length);
+		entry[10] = song.tempo;
+		entry[11] = song.metre;
+		entry[12] = song.loop ? 1 : 0;
+		memcpy(entry+16, song.title,  32);
+		memcpy(entry+48, song.author, 32);
+		strncpy((char*)entry+80, list.names[i], 63);
+
+		// 4 byte alignment padding
+		const unsigned char pad[4] = { 0, 0, 0, 0 };
+		unsigned int padding = (4 - (bytes & 3)) & 3;
+		get_notes(&song, 0, song.length, fbuf); // free again once the song is loaded
+		if (fwrite(fbuf, 1, bytes, f) != bytes || fwrite(pad, 1, padding, f) != padding)
+		{
+			fmsg = "Unable to write file.";
+			result = false;
+			break;
+		}
+		offset += bytes + padding;
+	}
+
+	if (result &&
+	    (fseek(f, SHP_HEADER, SEEK_SET) != 0 ||
+	     fwrite(table, SHP_ENTRY, list.count, f) != size_t(list.count)))
+	{
+		fmsg = "Unable to write file.";
+		result = false;
+	}
+
+	if (fclose(f) != 0 && result)
+	{
+		fmsg = "Unable to write file.";
+		result = false;
+	}
+	if (!result) remove(filename); // a partial archive would still look valid
+	free(table);
+	name_list_free(&list);
+	return result;
+}
+
+bool unpack_shp(const char* filename, const char* directory)
+{
+	unsigned int size;
+	const unsigned char* archive = os::map_file(filename, &size);
+	if (archive == NULL) { fmsg = "Empty file."; return false; }
+
+	int count = archive_count(archive, size);
+	if (count < 0)
+	{
+		fmsg = "Not a valid .shp archive.";
+		os::unmap_file(archive, size);
+		return false;
+	}
+
+	static Song song;
+	bool result = true;
+	for (int i=0; i < count && result; ++i)
+	{
+		if (!archive_song(archive, size, i, &song))
+		{
+			result = false;
+			break;
+		}
+
+		// use the packed name unless it could escape the directory
+		char name[68];
+		const unsigned char* entry = archive + SHP_HEADER + (SHP_ENTRY * i);
+		memcpy(name, entry+80, 64);
+		name[64] = 0;
+		if (name[0] == 0 || name[0] == '.' || strchr(name,'/') || strchr(name,'\\') ||
+		    !files::match_extension(name, ".sho"))
+		{
+			sprintf(name, "%04d.sho", i);
+		}
+
+		static char path[1024];
+		if (snprintf(path, sizeof(path), "%s/%s", directory, name) >= int(sizeof(path)))
+		{
+			fmsg = "Filename too long.";
+			result = false;
+			break;
+		}
+		result = save_sho(path, &song);
+	}
+
+	os::unmap_file(archive, size);
+	return result;
+}
+
+// file types that can be loaded, resolved by extension
+
+enum LoadType
+{
+	LOAD_NONE,
+	LOAD_SHO,
+	LOAD_SHP,
+	LOAD_ZST,
+	LOAD_S9X,
+	LOAD_STATE // other emulators
+};
+
+LoadType load_type(const char* filename)
+{
+	const char* ext = strrchr(filename, '.');
+	if (ext == NULL) return LOAD_NONE;
+	if      (!stricmp(ext, ".sho")) return LOAD_SHO;
+	else if (!stricmp(ext, ".shp")) return LOAD_SHP;
+	else if (!stricmp(ext, ".zst")) return LOAD_ZST;
+	else if (!stricmp(ext, ".zs0")) return LOAD_ZST;
+	else if (!stricmp(ext, ".zs1")) return LOAD_ZST;
+	else if (!stricmp(ext, ".zs2")) return LOAD_ZST;
+	else if (!stricmp(ext, ".zs3")) return LOAD_ZST;
+	else if (!stricmp(ext, ".zs4")) return LOAD_ZST;
+	else if (!stricmp(ext, ".zs5")) return LOAD_ZST;
+	else if (!stricmp(ext, ".zs6")) return LOAD_ZST;
+	else if (!stricmp(ext, ".zs7")) return LOAD_ZST;
+	else if (!stricmp(ext, ".zs8")) return LOAD_ZST;
+	else if (!stricmp(ext, ".zs9")) return LOAD_ZST;
+	else if (!stricmp(ext, ".000")) return LOAD_S9X;
+	else if (!stricmp(ext, ".001")) return LOAD_S9X;
+	else if (!stricmp(ext, ".002")) return LOAD_S9X;
+	else if (!stricmp(ext, ".003")) return LOAD_S9X;
+	else if (!stricmp(ext, ".004")) return LOAD_S9X;
+	else if (!stricmp(ext, ".005")) return LOAD_S9X;
+	else if (!stricmp(ext, ".006")) return LOAD_S9X;
+	else if (!stricmp(ext, ".007")) return LOAD_S9X;
+	else if (!stricmp(ext, ".008")) return LOAD_S9X;
+	else if (strlen(ext) == 4 &&
+		ext[0] == '.' &&
+		(ext[1] == 'z' || ext[1] == 'Z') &&
+		(ext[2] >= '0' && ext[2] <= '9') &&
+		(ext[3] >= '0' && ext[3] <= '9'))
+	{
+		return LOAD_ZST;
+	}
+	else if (strlen(ext) == 4 &&
+		ext[0] == '.' &&
+		(ext[1] == '0' && ext[1] <= '9') &&
+		(ext[2] >= '0' && ext[2] <= '9') &&
+		(ext[3] >= '0' && ext[3] <= '9'))
+	{
+		return LOAD_S9X;
+	}
+	else if (!stricmp(ext, ".frz")) return LOAD_STATE; // SNES9X
+	else if (!stricmp(ext, ".bst")) return LOAD_STATE; // bsnes
+	else if (!stricmp(ext, ".zip")) return LOAD_STATE;
+	else if (!stricmp(ext, ".state")) return LOAD_STATE; // RetroArch
+	else if (strlen(ext) == 7 &&
+		(ext[6] >= '0' && ext[6] <= '9'))
+	{
+		char base[7];
+		memcpy(base, ext, 6);
+		base[6] = 0;
+		if (!stricmp(base, ".state")) return LOAD_STATE; // .state1-.state9
+	}
+	return LOAD_NONE;
+}
+
+// song details for browsing
+//   these read only the part of a file that describes the song, into their
+//   own buffers rather than fbuf, and never set fmsg, so a background thread
+//   can use them while the editor loads and saves
+
+// columns past the song are blank
+void info_notes(files::SongInfo* info, const unsigned char* notes, int columns)
+{
+	memset(info->notes, VOICE_EMPTY, sizeof(info->notes));
+	if (columns > files::INFO_COLUMNS) columns = files::INFO_COLUMNS;
+	if (columns > 0) pack_columns(notes, columns, info->notes);
+}
+
+// the same corrections clean_song makes
+void clean_info(files::SongInfo* info)
+{
+	if (info->length < 1) info->length = 1;
+	if (info->tempo > 0x9F) info->tempo = 0x9F;
+	if (info->metre < 3 || info->metre > 4) info->metre = 4;
+}
+
+bool info_sho(const unsigned char* data, unsigned int size, files::SongInfo* info)
+{
+	const unsigned int NOTE_POS = 7+32+32+32;
+	if (size < (NOTE_POS + 5)) return false;
+	if (read_long(data+0) != read_long("shro") || data[6] != 0) return false;
+
+	memcpy(info->title,  data+7   , 32);
+	memcpy(info->author, data+7+32, 32);
+	info->title[ 31] = 0;
+	info->author[31] = 0;
+
+	int version = read_short(data+4);
+	if (version == 2)
+	{
+		if (size < 680) return false;
+		info->tempo = data[NOTE_POS+576];
+		if (size >= 683)
+		{
+			info->length = data[680];
+			info->loop = (data[681] != 0);
+			info->metre = (data[682] == 0) ? 3 : 4;
+		}
+		else
+		{
+			info->length = 96;
+			info->loop = true;
+			info->metre = 4;
+		}
+		info_notes(info, data+NOTE_POS, 96);
+	}
+	else if (version == 3)
+	{
+		info->length = read_short(data+NOTE_POS);
+		if (size < (NOTE_POS + 5 + (6 * info->length))) return false;
+		info->loop = (data[NOTE_POS+2] != 0);
+		info->metre = (data[NOTE_POS+3] == 0) ? 3 : 4;
+		info->tempo = data[NOTE_POS+4];
+		info_notes(info, data+NOTE_POS+5, info->length);
+	}
+	else return false;
+	return true;
+}
+
+bool info_shp(const unsigned char* archive, unsigned int size, files::SongInfo* info)
+{
+	if (archive_count(archive, size) < 1) return false;
+
+	const unsigned char* entry = archive + SHP_HEADER;
+	uint32 offset = read_long(entry+0);
+	uint32 bytes  = read_long(entry+4);
+	int length    = read_short(entry+8);
+	if (length < 1 || bytes != uint32(6 * length)) return false;
+	if (offset > size || bytes > (size - offset)) return false;
+
+	info->length = length;
+	info->tempo  = entry[10];
+	info->metre  = (entry[11] == 3) ? 3 : 4;
+	info->loop   = (entry[12] != 0);
+	memcpy(info->title,  entry+16, 32);
+	memcpy(info->author, entry+48, 32);
+	info->title[ 31] = 0;
+	info->author[31] = 0;
+	info_notes(info, archive + offset, length);
+	return true;
+}
+
+// savestates don't hold a title or author
+bool info_ram(const unsigned char* ram, files::SongInfo* info)
+{
+	const int POS_NOTES  = 0x15F7 - 0x15F7;
+	const int POS_LENGTH = 0x1837 - 0x15F7;
+	const int POS_LOOP   = 0x1839 - 0x15F7;
+	const int POS_TEMPO  = 0x183B - 0x15F7;
+	const int POS_METRE  = 0x1845 - 0x15F7;
+
+	info->length = (read_short(ram+POS_LENGTH) >> 3) - 2;
+	info->tempo  =  ram[POS_TEMPO];
+	info->loop   = (ram[POS_LOOP ] == 1);
+	info->metre  = (ram[POS_METRE] == 0) ? 3 : 4;
+	info_notes(info, ram+POS_NOTES, 96);
+	return true;
+}
+
+bool info_s9x(const char* filename, files::SongInfo* info)
+{
+	// only the start of the state is decompressed, unless the song is elsewhere
+	const int READ_SIZE = S9X_POS_DATA + 1024;
+	unsigned char* state = (unsigned char*)malloc(FBUF_SIZE);
+	if (state == NULL) return false;
+
+	bool result = false;
+	gzFile gf = gzopen(filename,"rb");
+	if (gf != NULL)
+	{
+		int length = gzread(gf,state,READ_SIZE);
+		if (length == READ_SIZE && ram_score(state+S9X_POS_DATA) > 0)
+			result = info_ram(state+S9X_POS_DATA, info);
+		else
+		{
+			if (length == READ_SIZE)
+			{
+				int rest = gzread(gf,state+READ_SIZE,FBUF_SIZE-READ_SIZE);
+				if (rest > 0) length += rest;
+			}
+			int pos = (length > 0) ? find_ram(state, length, -1, false) : -1;
+			if (pos < 0 && length >= READ_SIZE) pos = S9X_POS_DATA;
+			result = (pos >= 0) && info_ram(state+pos, info);
+		}
+		gzclose(gf);
+	}
+	free(state);
+	return result;
+}
+
+bool info_state(const unsigned char* data, unsigned int size, files::SongInfo* info)
+{
+	unsigned int length;
+	unsigned char* state = inflate_state(data, size, &length);
+	if (state != NULL) data = state;
+	else length = size;
+
+	int pos = find_ram(data, length, -1, false);
+	bool result = (pos >= 0) && info_ram(data+pos, info);
+	free(state);
+	return result;
+}
+
+bool read_song_info(const char* filename, files::SongInfo* info)
+{
+	memset(info, 0, sizeof(files::SongInfo));
+
+	LoadType type = load_type(filename);
+	if (type == LOAD_NONE) return false;
+	if (type == LOAD_S9X) return info_s9x(filename, info);
+
+	unsigned int size;
+	const unsigned char* data = os::map_file(filename, &size);
+	if (data == NULL) return false;
+
+	bool result = false;
+	if      (type == LOAD_SHO) result = info_sho(data, size, info);
+	else if (type == LOAD_SHP) result = info_shp(data, size, info);
+	else if (type == LOAD_STATE) result = info_state(data, size, info);
+	else if (type == LOAD_ZST)
+	{
+		int pos = find_ram(data, size, ZST_POS_DATA, false);
+		if (pos < 0 && size >= 0x1846) pos = ZST_POS_DATA;
+		result = (pos >= 0) && info_ram(data+pos, info);
+	}
+
+	os::unmap_file(data, size);
+	return result;
+}
+
+// public interface
+
+namespace files
+{
+
+bool load_file(const char* filename, Song* song)
+{
+	switch (load_type(filename))
+	{
+		case LOAD_SHO: return load_sho(filename,song);
+		case LOAD_SHP: return load_shp(filename,0,song);
+		case LOAD_ZST: return load_zst(filename,song);
+		case LOAD_S9X: return load_s9x(filename,song);
+		case LOAD_STATE: return load_state(filename,song);
+		default: break;
+	}
+
+	fmsg = "Unknown extension.";
+	return false;
+}
+
+bool save_file(const char* filename, const Song* song)
+{
+	const char* ext = strrchr(filename, '.');
+	if (ext == NULL) { fmsg = "Unknown extension."; return false; }
+	if      (!stricmp(ext, ".sho")) return save_sho(filename,song);
+	else if (!stricmp(ext, ".zst")) return save_zst(filename,song);
+	else if (!stricmp(ext, ".zs0")) return save_zst(filename,song);
+	else if (!stricmp(ext, ".zs1")) return save_zst(filename,song);
 	else if (!stricmp(ext, ".zs2")) return save_zst(filename,song);
 	else if (!stricmp(ext, ".zs3")) return save_zst(filename,song);
 	else if (!stricmp(ext, ".zs4")) return save_zst(filename,song);
@@ -605,6 +1864,7 @@ bool save_file(const char* filename, const Song* song)
 	else if (!stricmp(ext, ".007")) return save_s9x(filename,song);
 	else if (!stricmp(ext, ".008")) return save_s9x(filename,song);
 	else if (!stricmp(ext, ".wav")) return save_wav(filename,song);
+	else if (!stricmp(ext, ".flac")) return save_flac(filename,song);
 	else if (strlen(ext) == 4 &&
 		ext[0] == '.' &&
 		(ext[1] == 'z' || ext[1] == 'Z') &&
@@ -628,50 +1888,122 @@ bool save_file(const char* filename, const Song* song)
 
 bool save_multi_file(const char* filename, const Song* song)
 {
-	static char file_temp[1024];
+	static MultiJob job;
 	if (strlen(filename) >= 1023)
 	{
 		fmsg = "Filename too long.";
 		return false;
 	}
-	strcpy(file_temp,filename);
-
-	static Song song_temp;
-	memcpy(&song_temp,song,sizeof(Song));
 
-	char* ext = strrchr(file_temp, '.');
+	const char* ext = strrchr(filename, '.');
 	if (ext == NULL) { fmsg = "Unknown extension."; return false; }
-	else if (!stricmp(ext, ".zs0") || !stricmp(ext, ".000"))
+	else if (!stricmp(ext, ".zs0")) job.s9x = false;
+	else if (!stricmp(ext, ".000")) job.s9x = true;
+	else if (!stricmp(ext, ".wav")) return save_stems(filename, song);
+	else
 	{
-		int count = 0;
-		int slen = song_temp.length;
-		while (slen > 0)
-		{
-			ext[3] = (count % 10) + '0';
-			if (count >= 10)
-				ext[2] = (count / 10) + '0';
+		fmsg = "Unknown extension.";
+		return false;
+	}
 
-			int rem = (slen > 96) ? 96 : slen;
-			song_temp.length = rem;
+	int count = (song->length + 95) / 96;
+	if (count > MULTI_SLOTS)
+	{
+		fmsg = "Song too long for multi-export.";
+		return false;
+	}
 
-			if (!save_file(file_temp, &song_temp))
-				return false;
+	for (int i=0; i < count; ++i)
+	{
+		strcpy(job.filename[i],filename);
+		char* slot_ext = job.filename[i] + (ext - filename);
+		slot_ext[3] = (i % 10) + '0';
+		if (i >= 10)
+			slot_ext[2] = (i / 10) + '0';
+		job.failed[i] = false;
+	}
 
-			for (int i=96; i<(song_temp.limit); ++i)
-				memcpy(song_temp.notes+((i-96)*6),song_temp.notes+(i*6),6);
+	// template is read once, from the first slot
+	bool loaded = job.s9x ?
+		load_s9x_template(job.filename[0], &job.length) :
+		load_zst_template(job.filename[0], &job.length);
+	if (!loaded) return false;
 
-			slen -= rem;
-			++count;
-		}
-	}
-	else
+	job.song = song;
+	os::parallel_for(count, multi_job, &job);
+
+	for (int i=0; i < count; ++i)
 	{
-		fmsg = "Unknown extension.";
-		return false;
+		if (job.failed[i])
+		{
+			fmsg = "Could not open file for write.";
+			return false;
+		}
 	}
 	return true;
 }
 
+bool load_archive(const char* filename, int index, Song* song)
+{
+	return load_shp(filename,index,song);
+}
+
+bool pack_archive(const char* directory, const char* filename)
+{
+	return pack_shp(directory,filename);
+}
+
+bool unpack_archive(const char* filename, const char* directory)
+{
+	return unpack_shp(filename,directory);
+}
+
+bool read_sho(const unsigned char* data, unsigned int size, Song* song)
+{
+	return sho_song(data,size,song);
+}
+
+bool read_archive(const unsigned char* archive, unsigned int size, int index, Song* song)
+{
+	return archive_song(archive,size,index,song);
+}
+
+bool render_wav(const Song* song, unsigned int samplerate, bool header, int normalize,
+	bool (*write)(const void* data, unsigned int size, void* user), void* user, const char** error)
+{
+	WavCache cache = { 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL, 0 };
+	bool result = render_song(song,samplerate,header,write,&user,0,&cache,normalize,error);
+	free_wav_cache(&cache);
+	return result;
+}
+
+void set_normalize(int mode)
+{
+	normalize_mode = mode;
+}
+
+int get_normalize()
+{
+	return normalize_mode;
+}
+
+void free_export_cache()
+{
+	free_wav_cache(&last_wav);
+}
+
+bool read_info(const char* filename, SongInfo* info)
+{
+	if (!read_song_info(filename, info)) return false;
+	clean_info(info);
+	return true;
+}
+
+bool can_load(const char* filename)
+{
+	return load_type(filename) != LOAD_NONE;
+}
+
 const char* get_file_error()
 {
 	return fmsg;
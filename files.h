@@ -3,7 +3,7 @@
 // files.h
 //   for loading and saving files
 
-#include "editor.h" // for SongData
+#include "song.h" // for Song
 
 namespace files
 {
@@ -11,7 +11,50 @@ namespace files
 // returns true if loaded correctly
 bool load_file(const char* filename, Song* song);
 bool save_file(const char* filename, const Song* song);
-bool save_multi_file(const char* filename, const Song* song);
+bool save_multi_file(const char* filename, const Song* song); // .zs0/.000 slots, or .wav stems
+
+// .shp archives hold many songs, each reachable directly by index
+bool load_archive(const char* filename, int index, Song* song);
+bool pack_archive(const char* directory, const char* filename); // all .sho and savestates in directory
+bool unpack_archive(const char* filename, const char* directory); // to .sho files
+
+// songs already in memory, as the contents of a .sho file or a .shp archive
+bool read_sho(const unsigned char* data, unsigned int size, Song* song);
+bool read_archive(const unsigned char* archive, unsigned int size, int index, Song* song);
+
+// loudness normalization of .wav and .flac exports, measured as they render
+const int NORMALIZE_OFF = 0;
+const int NORMALIZE_PEAK = 1; // gain to -16 LUFS, or less if the true peak would pass -1 dB
+const int NORMALIZE_LIMIT = 2; // gain to -16 LUFS, limiting true peaks to -1 dB
+void set_normalize(int mode); // used by save_file
+int get_normalize();
+void free_export_cache(); // frees the render a .wav or .flac export keeps for the next one
+
+// renders a song as save_file would write it to .wav, or only its 16-bit little endian
+// samples without a header, passing the data to write() in pieces until it returns false
+// safe to call from any thread, leaves get_file_error() alone and sets error to
+// why it failed instead, "Unable to write file." if write() returned false
+bool render_wav(const Song* song, unsigned int samplerate, bool header, int normalize,
+	bool (*write)(const void* data, unsigned int size, void* user), void* user, const char** error);
+
+// details of a song file, read without loading the whole song
+const int INFO_COLUMNS = 32; // leading beats kept for a preview
+
+struct SongInfo
+{
+	char title[32];
+	char author[32];
+	int length;
+	int tempo;
+	int metre;
+	bool loop;
+	unsigned char notes[COLUMN_SIZE * INFO_COLUMNS]; // packed like Song columns, blank past length
+};
+
+// safe to call from any thread, leaves get_file_error() alone
+bool read_info(const char* filename, SongInfo* info);
+// true if load_file accepts the file's extension
+bool can_load(const char* filename);
 
 // returns description of last error
 const char* get_file_error();
@@ -22,11 +65,15 @@ bool match_extension(const char* filename, const char* extension);
 // file type is resolved by extension
 // loading allows:
 //   .sho
+//   .shp (first song in archive)
 //   .zst
+//   .000
+//   .frz .bst .state .zip (any emulator's savestate, searched for the song)
 // saving allows:
 //   .sho
 //   .zst (if file exists, will insert data, otherwise will create from scratch)
 //   .wav
+//   .flac
 
 } // namespace files
 
@@ -0,0 +1,452 @@
+// flac.cpp
+//   lossless FLAC encoder, for exporting renders
+//
+//   Each frame of BLOCK_SIZE samples is stored as the smallest of:
+//     CONSTANT, for silence
+//     FIXED, a polynomial predictor of order 0-4, with a partitioned Rice coded residual
+//     VERBATIM
+//   Samples are collected in batches of BATCH frames, which are encoded in parallel
+//   and then written in order. The MD5 of STREAMINFO is left unset.
+
+#include <cstdlib> // NULL, malloc, free
+#include <cstring> // memcpy, strlen
+#include "flac.h"
+
+const int BLOCK_SIZE = 4096; // samples per frame
+const int BATCH = 64; // frames encoded in parallel
+const int FRAME_MAX = 16 + 1 + (BLOCK_SIZE * 2) + 2; // header, verbatim subframe, CRC
+const int RICE_MAX = 14; // largest parameter of the 4-bit Rice method
+const int PARTITION_MAX = 8; // largest partition order tried
+
+// CRC
+
+static unsigned char crc8_table[256];
+static uint16 crc16_table[256];
+
+void make_crc_tables()
+{
+	for (int i=0; i < 256; ++i)
+	{
+		unsigned int c8 = i;
+		unsigned int c16 = i << 8;
+		for (int b=0; b < 8; ++b)
+		{
+			c8  = (c8  & 0x80  ) ? ((c8  << 1) ^ 0x07  ) : (c8  << 1);
+			c16 = (c16 & 0x8000) ? ((c16 << 1) ^ 0x8005) : (c16 << 1);
+		}
+		crc8_table[i] = (unsigned char)c8;
+		crc16_table[i] = (uint16)c16;
+	}
+}
+
+// bit writer, most significant bit first
+
+struct Bits
+{
+	unsigned char* out;
+	unsigned int size; // bytes written
+	uint32 acc; // bits not yet written
+	int count; // bits in acc, less than 8 between calls
+
+	void put(uint32 value, int bits) // bits <= 24
+	{
+		acc = (acc << bits) | (value & ((uint32(1) << bits) - 1));
+		count += bits;
+		while (count >= 8)
+		{
+			count -= 8;
+			out[size++] = (unsigned char)(acc >> count);
+		}
+		acc &= (uint32(1) << count) - 1;
+	}
+
+	void zeros(uint32 bits)
+	{
+		for (; bits > 24; bits -= 24) put(0, 24);
+		put(0, bits);
+	}
+
+	void align()
+	{
+		if (count) put(0, 8 - count);
+	}
+};
+
+// frame number as "UTF-8", up to 31 bits
+void put_utf8(Bits& b, uint32 v)
+{
+	if (v < 0x80) { b.put(v, 8); return; }
+
+	int bytes = 2;
+	while (bytes < 6 && v >= (uint32(1) << ((5 * bytes) + 1))) ++bytes;
+	b.put(((0xFF00 >> bytes) & 0xFF) | (v >> (6 * (bytes - 1))), 8);
+	for (int i = bytes - 2; i >= 0; --i)
+		b.put(0x80 | ((v >> (6 * i)) & 0x3F), 8);
+}
+
+// subframe
+
+inline int fixed_residual(const sint16* x, int i, int order)
+{
+	switch (order)
+	{
+		default:
+		case 0: return x[i];
+		case 1: return x[i] - x[i-1];
+		case 2: return x[i] - (2 * x[i-1]) + x[i-2];
+		case 3: return x[i] - (3 * x[i-1]) + (3 * x[i-2]) - x[i-3];
+		case 4: return x[i] - (4 * x[i-1]) + (6 * x[i-2]) - (4 * x[i-3]) + x[i-4];
+	}
+}
+
+// Rice parameter near the best for count values averaging sum / count
+int rice_guess(double sum, int count)
+{
+	int k = 0;
+	while (k < RICE_MAX && (double(2 << k) * double(count)) <= sum) ++k;
+	return k;
+}
+
+// plans a FIXED subframe, with the zig-zag coded residual in u,
+// returns its size in bits, or 0 if the frame is too short for it
+double plan_fixed(const sint16* x, int n, unsigned int* u, int* order_, int* porder_, int* rice)
+{
+	if (n <= 4) return 0;
+
+	// the order whose residual is smallest
+	double sum[5] = { 0, 0, 0, 0, 0 };
+	for (int i=4; i < n; ++i)
+	{
+		int e0 = x[i];
+		int e1 = e0 - x[i-1];
+		int e2 = e1 - (x[i-1] - x[i-2]);
+		int e3 = e2 - (x[i-1] - (2 * x[i-2]) + x[i-3]);
+		int e4 = e3 - (x[i-1] - (3 * x[i-2]) + (3 * x[i-3]) - x[i-4]);
+		sum[0] += (e0 < 0) ? -e0 : e0;
+		sum[1] += (e1 < 0) ? -e1 : e1;
+		sum[2] += (e2 < 0) ? -e2 : e2;
+		sum[3] += (e3 < 0) ? -e3 : e3;
+		sum[4] += (e4 < 0) ? -e4 : e4;
+	}
+	int order = 0;
+	for (int o=1; o < 5; ++o)
+		if (sum[o] < sum[order]) order = o;
+
+	for (int i=order; i < n; ++i)
+	{
+		int e = fixed_residual(x, i, order);
+		u[i] = (e >= 0) ? (unsigned int)(e << 1) : (unsigned int)(((-e) << 1) - 1);
+	}
+
+	// partition order, by estimated size
+	int pmax = 0;
+	while (pmax < PARTITION_MAX &&
+	       (n & ((2 << pmax) - 1)) == 0 &&
+	       (n >> (pmax + 1)) > order)
+		++pmax;
+
+	double psum[1 << PARTITION_MAX];
+	int size = n >> pmax;
+	for (int j=0; j < (1 << pmax); ++j)
+	{
+		psum[j] = 0;
+		for (int i = (j == 0) ? order : (j * size); i < ((j + 1) * size); ++i)
+			psum[j] += u[i];
+	}
+
+	double best = -1;
+	int porder = 0;
+	for (int p = pmax; p >= 0; --p)
+	{
+		size = n >> p;
+		double bits = 0;
+		for (int j=0; j < (1 << p); ++j)
+		{
+			int count = size - ((j == 0) ? order : 0);
+			int k = rice_guess(psum[j], count);
+			bits += 4 + (count * (k + 1)) + (psum[j] / double(1 << k));
+		}
+		if (best < 0 || bits <= best)
+		{
+			best = bits;
+			porder = p;
+		}
+		for (int j=0; j < (1 << p) / 2; ++j)
+			psum[j] = psum[j*2] + psum[(j*2)+1];
+	}
+
+	// exact size, trying the parameters either side of the guess
+	double bits = 8 + (order * 16) + 2 + 4;
+	size = n >> porder;
+	for (int j=0; j < (1 << porder); ++j)
+	{
+		int start = (j == 0) ? order : (j * size);
+		int end = (j + 1) * size;
+		double s = 0;
+		for (int i=start; i < end; ++i) s += u[i];
+
+		int guess = rice_guess(s, end - start);
+		double least = -1;
+		for (int k = guess - 1; k <= guess + 1; ++k)
+		{
+			if (k < 0 || k > RICE_MAX) continue;
+			double cost = double(end - start) * (k + 1);
+			for (int i=start; i < end; ++i) cost += u[i] >> k;
+			if (least < 0 || cost < least)
+			{
+				least = cost;
+				rice[j] = k;
+			}
+		}
+		bits += 4 + least;
+	}
+
+	*order_ = order;
+	*porder_ = porder;
+	return bits;
+}
+
+void encode_subframe(Bits& b, const sint16* x, int n)
+{
+	bool constant = true;
+	for (int i=1; i < n && constant; ++i)
+		constant = (x[i] == x[0]);
+	if (constant)
+	{
+		b.put(0x00, 8); // CONSTANT
+		b.put(uint16(x[0]), 16);
+		return;
+	}
+
+	unsigned int u[BLOCK_SIZE];
+	int rice[1 << PARTITION_MAX];
+	int order, porder;
+	double bits = plan_fixed(x, n, u, &order, &porder, rice);
+	if (bits <= 0 || bits >= (8 + (16 * double(n))))
+	{
+		b.put(0x02, 8); // VERBATIM
+		for (int i=0; i < n; ++i)
+			b.put(uint16(x[i]), 16);
+		return;
+	}
+
+	b.put(0x10 | (order << 1), 8); // FIXED
+	for (int i=0; i < order; ++i)
+		b.put(uint16(x[i]), 16);
+	b.put(0, 2); // Rice, 4-bit parameters
+	b.put(porder, 4);
+	int size = n >> porder;
+	for (int j=0; j < (1 << porder); ++j)
+	{
+		int k = rice[j];
+		b.put(k, 4);
+		for (int i = (j == 0) ? order : (j * size); i < ((j + 1) * size); ++i)
+		{
+			b.zeros(u[i] >> k);
+			b.put((1 << k) | (u[i] & ((1 << k) - 1)), k + 1);
+		}
+	}
+}
+
+// returns the size of the frame written to out
+unsigned int encode_frame(const sint16* x, int n, uint32 number, unsigned int samplerate, unsigned char* out)
+{
+	Bits b;
+	b.out = out;
+	b.size = 0;
+	b.acc = 0;
+	b.count = 0;
+
+	int size_code = (n == BLOCK_SIZE) ? 12 : 7; // 256 << (12-8), or 16 bits at end of header
+	b.put(0xFFF8, 16); // sync code, fixed block size
+	b.put(size_code, 4);
+	b.put((samplerate == 32000) ? 8 : 0, 4); // 32kHz, or as in STREAMINFO
+	b.put(0, 4); // mono
+	b.put(4, 3); // 16-bit
+	b.put(0, 1);
+	put_utf8(b, number);
+	if (size_code == 7) b.put(n - 1, 16);
+
+	unsigned char crc8 = 0;
+	for (unsigned int i=0; i < b.size; ++i)
+		crc8 = crc8_table[crc8 ^ out[i]];
+	b.put(crc8, 8);
+
+	encode_subframe(b, x, n);
+	b.align();
+
+	unsigned int crc16 = 0;
+	for (unsigned int i=0; i < b.size; ++i)
+		crc16 = ((crc16 << 8) ^ crc16_table[((crc16 >> 8) ^ out[i]) & 0xFF]) & 0xFFFF;
+	b.put(crc16, 16);
+
+	return b.size;
+}
+
+// writer
+
+struct flac::Writer
+{
+	FILE* f;
+	unsigned int samplerate;
+	long streaminfo; // file position, completed by finish()
+	bool last; // STREAMINFO is the last metadata block
+	bool failed;
+	uint32 frames; // frames written
+	uint32 total; // samples written
+	unsigned int frame_min; // bytes
+	unsigned int frame_max;
+	int fill; // samples in batch
+	sint16 batch[BATCH * BLOCK_SIZE];
+	unsigned char frame[BATCH][FRAME_MAX];
+	unsigned int frame_size[BATCH];
+};
+
+void write_streaminfo(flac::Writer* w)
+{
+	unsigned int sr = w->samplerate;
+	unsigned char s[4+34];
+	s[ 0] = w->last ? 0x80 : 0x00; // STREAMINFO
+	s[ 1] = 0; s[2] = 0; s[3] = 34;
+	s[ 4] = BLOCK_SIZE >> 8; s[ 5] = BLOCK_SIZE & 0xFF; // smallest block
+	s[ 6] = BLOCK_SIZE >> 8; s[ 7] = BLOCK_SIZE & 0xFF; // largest block
+	s[ 8] = (w->frame_min >> 16) & 0xFF; s[ 9] = (w->frame_min >> 8) & 0xFF; s[10] = w->frame_min & 0xFF;
+	s[11] = (w->frame_max >> 16) & 0xFF; s[12] = (w->frame_max >> 8) & 0xFF; s[13] = w->frame_max & 0xFF;
+	s[14] = (sr >> 12) & 0xFF;
+	s[15] = (sr >> 4) & 0xFF;
+	s[16] = (sr & 0x0F) << 4; // then 3 bits channels-1 (0) and 1 of bits-1 (0)
+	s[17] = 0xF0; // 4 more of bits-1 (15), then the top 4 of 36 bits of total samples
+	s[18] = (w->total >> 24) & 0xFF;
+	s[19] = (w->total >> 16) & 0xFF;
+	s[20] = (w->total >> 8) & 0xFF;
+	s[21] = w->total & 0xFF;
+	memset(s + 22, 0, 16); // MD5 unset
+	if (fwrite(s, 1, sizeof(s), w->f) != sizeof(s)) w->failed = true;
+}
+
+void write_le32(unsigned char* d, uint32 x)
+{
+	d[0] = x & 0xFF;
+	d[1] = (x >> 8) & 0xFF;
+	d[2] = (x >> 16) & 0xFF;
+	d[3] = (x >> 24) & 0xFF;
+}
+
+void write_comments(flac::Writer* w, const char* const* tags, int tag_count)
+{
+	const char* VENDOR = "mariopants " VERSION_STRING;
+
+	uint32 length = 4 + strlen(VENDOR) + 4;
+	for (int i=0; i < tag_count; ++i) length += 4 + strlen(tags[i]);
+
+	unsigned char d[4];
+	d[0] = 0x80 | 4; // last, VORBIS_COMMENT
+	d[1] = (length >> 16) & 0xFF;
+	d[2] = (length >> 8) & 0xFF;
+	d[3] = length & 0xFF;
+	fwrite(d, 1, 4, w->f);
+
+	// lengths are little endian here
+	write_le32(d, strlen(VENDOR));
+	fwrite(d, 1, 4, w->f);
+	fwrite(VENDOR, 1, strlen(VENDOR), w->f);
+	write_le32(d, tag_count);
+	fwrite(d, 1, 4, w->f);
+	for (int i=0; i < tag_count; ++i)
+	{
+		write_le32(d, strlen(tags[i]));
+		fwrite(d, 1, 4, w->f);
+		fwrite(tags[i], 1, strlen(tags[i]), w->f);
+	}
+	if (ferror(w->f)) w->failed = true;
+}
+
+void encode_job(int index, void* data)
+{
+	flac::Writer* w = (flac::Writer*)data;
+	int n = w->fill - (index * BLOCK_SIZE);
+	if (n > BLOCK_SIZE) n = BLOCK_SIZE;
+	w->frame_size[index] = encode_frame(
+		w->batch + (index * BLOCK_SIZE), n, w->frames + index, w->samplerate, w->frame[index]);
+}
+
+// encodes and writes the batch
+void flush(flac::Writer* w)
+{
+	int count = (w->fill + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (count < 1 || w->failed) return;
+
+	os::parallel_for(count, encode_job, w);
+
+	for (int i=0; i < count; ++i)
+	{
+		unsigned int size = w->frame_size[i];
+		if (w->frame_min == 0 || size < w->frame_min) w->frame_min = size;
+		if (size > w->frame_max) w->frame_max = size;
+		if (fwrite(w->frame[i], 1, size, w->f) != size) w->failed = true;
+	}
+	w->frames += count;
+	w->total += w->fill;
+	w->fill = 0;
+}
+
+// public interface
+
+namespace flac
+{
+
+Writer* create(FILE* f, unsigned int samplerate, const char* const* tags, int tag_count)
+{
+	Writer* w = (Writer*)malloc(sizeof(Writer));
+	if (w == NULL) return NULL;
+
+	if (crc16_table[1] == 0) make_crc_tables(); // before any worker uses them
+
+	w->f = f;
+	w->samplerate = samplerate;
+	w->last = (tag_count < 1);
+	w->failed = false;
+	w->frames = 0;
+	w->total = 0;
+	w->frame_min = 0;
+	w->frame_max = 0;
+	w->fill = 0;
+
+	if (fwrite("fLaC", 1, 4, f) != 4) w->failed = true;
+	w->streaminfo = ftell(f);
+	write_streaminfo(w);
+	if (tag_count > 0) write_comments(w, tags, tag_count);
+	return w;
+}
+
+bool write(Writer* w, const sint16* samples, unsigned int count)
+{
+	while (count > 0 && !w->failed)
+	{
+		unsigned int n = (BATCH * BLOCK_SIZE) - w->fill;
+		if (n > count) n = count;
+		memcpy(w->batch + w->fill, samples, n * 2);
+		w->fill += n;
+		samples += n;
+		count -= n;
+		if (w->fill >= (BATCH * BLOCK_SIZE)) flush(w);
+	}
+	return !w->failed;
+}
+
+bool finish(Writer* w)
+{
+	flush(w);
+	if (!w->failed)
+	{
+		if (fseek(w->f, w->streaminfo, SEEK_SET) == 0) write_streaminfo(w);
+		else w->failed = true;
+	}
+	bool result = !w->failed;
+	free(w);
+	return result;
+}
+
+} // namespace flac
+
+// end of file
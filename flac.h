@@ -0,0 +1,25 @@
+#pragma once
+
+// flac.h
+//   lossless FLAC encoder, for exporting renders
+
+#include <cstdio> // FILE
+#include "os.h" // sint16
+
+namespace flac
+{
+
+// a FLAC stream of 16-bit mono samples, written to f as they are given,
+// frames are encoded in batches across worker threads
+struct Writer;
+
+// writes the stream header, with tags as "NAME=value" comments, NULL if out of memory
+extern Writer* create(FILE* f, unsigned int samplerate, const char* const* tags, int tag_count);
+// returns false if the file could not be written
+extern bool write(Writer* w, const sint16* samples, unsigned int count);
+// writes the last frames and completes the header, frees w, returns false on error
+extern bool finish(Writer* w);
+
+} // namespace flac
+
+// end of file
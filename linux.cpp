@@ -4,6 +4,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include "tcl.h"
 #include "tk.h"
 #include "os.h"
@@ -15,62 +23,125 @@ void tcl_do(Tcl_Interp *interp, const char* cmd) {
     }
 }
 
-namespace os
+// Tk -filetypes list for masks like "*.sho", "*.*" matches all files
+static const char* tk_filetypes(int mask_count, const char** masks)
 {
+    static char types[1024];
+    types[0] = 0;
+    for (int i=0; i < mask_count; ++i)
+    {
+        const char* ext = strncmp(masks[i], "*.", 2) ? masks[i] : (masks[i] + 1);
+        if (!strcmp(ext, ".*")) ext = "*";
+        size_t used = strlen(types);
+        snprintf(types + used, sizeof(types) - used, "{{%s} {%s}} ", masks[i], ext);
+    }
+    return types;
+}
 
-void alert(const char* message)
+// Tk startup is slow, so one interpreter is kept for every dialog.
+// A Tcl interpreter can only be used by the thread that created it,
+// so it lives on a dialog thread, which runs each command for the caller.
+
+static pthread_mutex_t dialog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dialog_cond = PTHREAD_COND_INITIALIZER;
+static bool dialog_started = false;
+static const char* dialog_cmd = NULL; // waiting to run
+static bool dialog_done = false;
+static char dialog_result[1024]; // value of the "result" variable after the command
+
+static void* dialog_thread(void*)
 {
     Tcl_Interp *interp = Tcl_CreateInterp();
     Tcl_Init(interp);
-    Tk_Init(interp);
+    bool tk = (Tk_Init(interp) == TCL_OK);
+    if (tk)
+        tcl_do(interp, "wm withdraw .");
 
-    tcl_do(interp, "wm withdraw .");
-    char cmd[1024];
-    sprintf(cmd, "tk_messageBox -icon warning -message \"%s\" "
-                 "-title \"Alert!\" -type ok", message);
-    tcl_do(interp, cmd);
+    while (true)
+    {
+        pthread_mutex_lock(&dialog_mutex);
+        while (dialog_cmd == NULL)
+            pthread_cond_wait(&dialog_cond, &dialog_mutex);
+        const char* cmd = dialog_cmd;
+        pthread_mutex_unlock(&dialog_mutex);
+
+        // without a display, fail only once a dialog is actually needed
+        if (!tk)
+            tcl_do(interp, "wm withdraw .");
+
+        tcl_do(interp, cmd);
+        const char* result = Tcl_GetVar(interp, "result", 0);
 
-    Tcl_DeleteInterp(interp);
+        pthread_mutex_lock(&dialog_mutex);
+        strncpy(dialog_result, result ? result : "", sizeof(dialog_result));
+        dialog_result[sizeof(dialog_result)-1] = 0;
+        dialog_cmd = NULL;
+        dialog_done = true;
+        pthread_cond_broadcast(&dialog_cond);
+        pthread_mutex_unlock(&dialog_mutex);
+    }
+    return NULL;
 }
 
-bool yesno(const char* message)
+// runs cmd on the dialog thread, returns its result
+static const char* dialog(const char* cmd)
 {
-    Tcl_Interp *interp = Tcl_CreateInterp();
-    Tcl_Init(interp);
-    Tk_Init(interp);
+    os::start_dialogs();
 
-    tcl_do(interp, "wm withdraw .");
-    char cmd[1024];
-    sprintf(cmd, "set answer [tk_messageBox -icon question -message \"%s\" "
-                 "-title \"Question!\" -type okcancel]", message);
-    tcl_do(interp, cmd);
-    const char *answer = Tcl_GetVar(interp, "answer", 0);
+    pthread_mutex_lock(&dialog_mutex);
+    dialog_cmd = cmd;
+    dialog_done = false;
+    pthread_cond_broadcast(&dialog_cond);
+    while (!dialog_done)
+        pthread_cond_wait(&dialog_cond, &dialog_mutex);
+    pthread_mutex_unlock(&dialog_mutex);
+
+    return dialog_result;
+}
 
-    Tcl_DeleteInterp(interp);
+namespace os
+{
 
-    return strcmp(answer, "cancel");
+void start_dialogs()
+{
+    pthread_mutex_lock(&dialog_mutex);
+    if (!dialog_started)
+    {
+        pthread_t thread;
+        if (0 != pthread_create(&thread, NULL, dialog_thread, NULL))
+        {
+            fprintf(stderr, "Unable to start dialog thread.\n");
+            exit(1);
+        }
+        pthread_detach(thread);
+        dialog_started = true;
+    }
+    pthread_mutex_unlock(&dialog_mutex);
 }
 
-const char* file_load(const char* default_name, int mask_count, const char** masks)
+void alert(const char* message)
 {
-    Tcl_Interp *interp = Tcl_CreateInterp();
-    Tcl_Init(interp);
-    Tk_Init(interp);
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "set result [tk_messageBox -icon warning -message \"%s\" "
+                 "-title \"Alert!\" -type ok]", message);
+    dialog(cmd);
+}
 
-    tcl_do(interp, "wm withdraw .");
+bool yesno(const char* message)
+{
     char cmd[1024];
-    sprintf(cmd, "set filename [tk_getOpenFile -initialfile \"%s\" "
-                 "-filetypes {"
-                 "{{Shroom Player file} {.sho}} "
-                 "{{ZSNES savestate} {.zst}} "
-                 "{{SNES9x savestate} {.000}} "
-                 "{{All files} *} "
-                 "}]",
-                 default_name);
-    tcl_do(interp, cmd);
-    const char *filename = Tcl_GetVar(interp, "filename", 0);
-
-    Tcl_DeleteInterp(interp);
+    snprintf(cmd, sizeof(cmd), "set result [tk_messageBox -icon question -message \"%s\" "
+                 "-title \"Question!\" -type okcancel]", message);
+    return strcmp(dialog(cmd), "cancel");
+}
+
+const char* file_load(const char* default_name, int mask_count, const char** masks)
+{
+    char cmd[2048];
+    snprintf(cmd, sizeof(cmd), "set result [tk_getOpenFile -initialfile \"%s\" "
+                 "-filetypes {%s}]",
+                 default_name, tk_filetypes(mask_count, masks));
+    const char* filename = dialog(cmd);
 
     if (!strlen(filename))
         return NULL;
@@ -79,31 +150,108 @@ const char* file_load(const char* default_name, int mask_count, const char** mas
 
 const char* file_save(const char* default_name, int mask_count, const char** masks)
 {
-    Tcl_Interp *interp = Tcl_CreateInterp();
-    Tcl_Init(interp);
-    Tk_Init(interp);
-
-    tcl_do(interp, "wm withdraw .");
-    char cmd[1024];
-    sprintf(cmd, "set filename [tk_getSaveFile -initialfile \"%s\" "
-                 "-filetypes {"
-                 "{{Shroom Player file} {.sho}} "
-                 "{{ZSNES savestate} {.zst}} "
-                 "{{SNES9x savestate} {.000}} "
-                 "{{WAV render} {.wav}} "
-                 "{{All files} *} "
-                 "}]",
-                 default_name);
-    tcl_do(interp, cmd);
-    const char *filename = Tcl_GetVar(interp, "filename", 0);
-
-    Tcl_DeleteInterp(interp);
+    char cmd[2048];
+    snprintf(cmd, sizeof(cmd), "set result [tk_getSaveFile -initialfile \"%s\" "
+                 "-filetypes {%s}]",
+                 default_name, tk_filetypes(mask_count, masks));
+    const char* filename = dialog(cmd);
 
     if (!strlen(filename))
         return NULL;
     return filename;
 }
 
+bool list_dir(const char* path, void (*entry)(const char* name, bool folder, void* data), void* data)
+{
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+        return false;
+
+    char full[1024];
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL)
+    {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+
+        bool folder = (de->d_type == DT_DIR);
+        if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK)
+        {
+            struct stat st;
+            snprintf(full, sizeof(full), "%s/%s", path, de->d_name);
+            folder = (stat(full, &st) == 0) && S_ISDIR(st.st_mode);
+        }
+        entry(de->d_name, folder, data);
+    }
+
+    closedir(dir);
+    return true;
+}
+
+const unsigned char* map_file(const char* filename, unsigned int* size)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 1)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void* view = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // mapping stays valid
+    if (view == MAP_FAILED)
+        return NULL;
+
+    *size = st.st_size;
+    return (const unsigned char*)view;
+}
+
+void unmap_file(const unsigned char* view, unsigned int size)
+{
+    if (view)
+        munmap((void*)view, size);
+}
+
+bool lock_memory(const void* data, unsigned int size)
+{
+    // pages are faulted in even if they can't be locked
+    long page = sysconf(_SC_PAGESIZE);
+    const volatile unsigned char* bytes = (const volatile unsigned char*)data;
+    for (unsigned int i = 0; i < size; i += page)
+        (void)bytes[i];
+    if (size > 0)
+        (void)bytes[size - 1];
+
+    return mlock(data, size) == 0;
+}
+
+bool raise_priority()
+{
+    // without root, RLIMIT_RTPRIO is the highest priority allowed, often 0
+    int limit = -1;
+    struct rlimit rl;
+    if (geteuid() != 0 && getrlimit(RLIMIT_RTPRIO, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+        limit = int(rl.rlim_cur);
+
+    const int policies[2] = { SCHED_FIFO, SCHED_RR };
+    for (int i = 0; i < 2; ++i)
+    {
+        struct sched_param param;
+        param.sched_priority = sched_get_priority_max(policies[i]) / 2;
+        if (limit >= 0 && param.sched_priority > limit)
+            param.sched_priority = limit;
+        if (param.sched_priority < sched_get_priority_min(policies[i]))
+            continue;
+        if (pthread_setschedparam(pthread_self(), policies[i], &param) == 0)
+            return true;
+    }
+    return false;
+}
+
 } // namespace os
 
 // end of file
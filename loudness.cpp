@@ -0,0 +1,411 @@
+// loudness.cpp
+//   loudness and true peak measurement (ITU-R BS.1770), and a true peak limiter
+
+#include <cstdlib> // NULL, malloc, realloc, free
+#include <cmath> // pow, log10, tan, sin, cos, fabs, floor, exp
+#include "loudness.h"
+
+const double PI = 3.14159265358979323846;
+
+// 4x oversampling, to find peaks between samples
+
+const unsigned int PEAK_BLOCK = 64; // samples whose peaks are skipped together if too small
+
+struct Interp
+{
+	double h[3][12]; // phases 1/4, 2/4, 3/4 past sample t, from samples t-5 to t+6
+	double gain; // largest sum of |h| of a phase, so no value passes gain * nearby samples
+};
+
+void make_interp(Interp* in)
+{
+	// Hann windowed sinc
+	in->gain = 1.0;
+	for (int k=0; k < 3; ++k)
+	{
+		double sum = 0;
+		for (int j=0; j < 12; ++j)
+		{
+			double d = (5.0 + (double(k + 1) / 4.0)) - double(j); // never 0
+			double h = 0.5 * (1.0 + cos(PI * d / 6.0)) * sin(PI * d) / (PI * d);
+			in->h[k][j] = h;
+			sum += fabs(h);
+		}
+		if (sum > in->gain) in->gain = sum;
+	}
+}
+
+// largest magnitude at sample t or between it and the next
+double peak_at(const Interp* in, const signed int* x, unsigned int length, unsigned int t)
+{
+	double peak = fabs(double(x[t]));
+	for (int k=0; k < 3; ++k)
+	{
+		double v = 0;
+		if (t >= 5 && (t + 6) < length)
+		{
+			const signed int* s = x + (t - 5);
+			for (int j=0; j < 12; ++j)
+				v += double(s[j]) * in->h[k][j];
+		}
+		else
+		{
+			for (int j=0; j < 12; ++j)
+				if ((t + j) >= 5 && (t + j - 5) < length)
+					v += double(x[t + j - 5]) * in->h[k][j];
+		}
+		if (fabs(v) > peak) peak = fabs(v);
+	}
+	return peak;
+}
+
+// largest magnitude of the samples that peak_at uses for block b
+double block_max(const signed int* x, unsigned int length, unsigned int b)
+{
+	unsigned int start = b * PEAK_BLOCK;
+	unsigned int end = start + PEAK_BLOCK + 6;
+	start = (start > 5) ? (start - 5) : 0;
+	if (end > length) end = length;
+
+	double peak = 0;
+	for (unsigned int t=start; t < end; ++t)
+		if (fabs(double(x[t])) > peak) peak = fabs(double(x[t]));
+	return peak;
+}
+
+inline sint16 clip16(double v)
+{
+	v = floor(v + 0.5);
+	if (v >  32767.0) return  32767;
+	if (v < -32768.0) return -32768;
+	return sint16(v);
+}
+
+// meter
+
+struct loudness::Meter
+{
+	double full_scale;
+	double b[2][3]; // K-weighting, a high shelf then a high pass
+	double a[2][3];
+	double z[2][4]; // x[n-1], x[n-2], y[n-1], y[n-2] of each stage
+	unsigned int segment_length; // samples in 100ms
+	unsigned int fill; // samples in the current segment
+	double sum; // squares in the current segment
+	double* segments; // sums of squares, 4 make a 400ms gating block
+	unsigned int count;
+	unsigned int capacity;
+};
+
+namespace loudness
+{
+
+Meter* create(unsigned int samplerate, double full_scale)
+{
+	Meter* m = (Meter*)malloc(sizeof(Meter));
+	if (m == NULL) return NULL;
+
+	// BS.1770 filters, for any samplerate
+	double K = tan(PI * 1681.974450955533 / double(samplerate));
+	double Q = 0.7071752369554196;
+	double Vh = pow(10.0, 3.999843853973347 / 20.0);
+	double Vb = pow(Vh, 0.4996667741545416);
+	double a0 = 1.0 + (K / Q) + (K * K);
+	m->b[0][0] = (Vh + (Vb * K / Q) + (K * K)) / a0;
+	m->b[0][1] = 2.0 * ((K * K) - Vh) / a0;
+	m->b[0][2] = (Vh - (Vb * K / Q) + (K * K)) / a0;
+	m->a[0][0] = 1.0;
+	m->a[0][1] = 2.0 * ((K * K) - 1.0) / a0;
+	m->a[0][2] = (1.0 - (K / Q) + (K * K)) / a0;
+
+	K = tan(PI * 38.13547087602444 / double(samplerate));
+	Q = 0.5003270373238773;
+	a0 = 1.0 + (K / Q) + (K * K);
+	m->b[1][0] = 1.0;
+	m->b[1][1] = -2.0;
+	m->b[1][2] = 1.0;
+	m->a[1][0] = 1.0;
+	m->a[1][1] = 2.0 * ((K * K) - 1.0) / a0;
+	m->a[1][2] = (1.0 - (K / Q) + (K * K)) / a0;
+
+	for (int s=0; s < 2; ++s)
+		for (int i=0; i < 4; ++i)
+			m->z[s][i] = 0;
+
+	m->full_scale = full_scale;
+	m->segment_length = (samplerate + 5) / 10;
+	m->fill = 0;
+	m->sum = 0;
+	m->segments = NULL;
+	m->count = 0;
+	m->capacity = 0;
+	return m;
+}
+
+void destroy(Meter* m)
+{
+	if (m == NULL) return;
+	free(m->segments);
+	free(m);
+}
+
+bool add(Meter* m, const signed int* samples, unsigned int count)
+{
+	for (unsigned int i=0; i < count; ++i)
+	{
+		double v = double(samples[i]) / m->full_scale;
+		for (int s=0; s < 2; ++s)
+		{
+			double* z = m->z[s];
+			double y =
+				(m->b[s][0] * v) + (m->b[s][1] * z[0]) + (m->b[s][2] * z[1]) -
+				(m->a[s][1] * z[2]) - (m->a[s][2] * z[3]);
+			if (fabs(y) < 1e-20) y = 0; // silence would otherwise decay into slow denormals
+			z[1] = z[0]; z[0] = v;
+			z[3] = z[2]; z[2] = y;
+			v = y;
+		}
+		m->sum += v * v;
+
+		if (++m->fill < m->segment_length) continue;
+		if (m->count >= m->capacity)
+		{
+			unsigned int capacity = (m->capacity < 256) ? 256 : (m->capacity * 2);
+			double* segments = (double*)realloc(m->segments, capacity * sizeof(double));
+			if (segments == NULL) return false;
+			m->segments = segments;
+			m->capacity = capacity;
+		}
+		m->segments[m->count++] = m->sum;
+		m->sum = 0;
+		m->fill = 0;
+	}
+	return true;
+}
+
+double integrated(const Meter* m)
+{
+	if (m->count < 4) return SILENT;
+
+	// 400ms blocks overlapping by 75%, gated at -70 LUFS, then 10 LU below their mean
+	const double ABSOLUTE_GATE = pow(10.0, (-70.0 + 0.691) / 10.0);
+	double scale = 1.0 / (4.0 * double(m->segment_length));
+	double gate = ABSOLUTE_GATE;
+	double mean = 0;
+	for (int pass=0; pass < 2; ++pass)
+	{
+		double total = 0;
+		unsigned int n = 0;
+		for (unsigned int j=0; (j + 3) < m->count; ++j)
+		{
+			const double* s = m->segments + j;
+			double z = (s[0] + s[1] + s[2] + s[3]) * scale;
+			if (z <= gate) continue;
+			total += z;
+			++n;
+		}
+		if (n == 0) return SILENT;
+		mean = total / double(n);
+		gate = mean * 0.1; // -10 LU
+		if (gate < ABSOLUTE_GATE) gate = ABSOLUTE_GATE;
+	}
+	return -0.691 + (10.0 * log10(mean));
+}
+
+double true_peak(const signed int* samples, unsigned int length, double full_scale)
+{
+	Interp in;
+	make_interp(&in);
+
+	double peak = 0;
+	for (unsigned int t=0; t < length; ++t)
+		if (fabs(double(samples[t])) > peak) peak = fabs(double(samples[t]));
+
+	for (unsigned int b=0; (b * PEAK_BLOCK) < length; ++b)
+	{
+		if ((block_max(samples, length, b) * in.gain) <= peak) continue; // can't be higher
+		unsigned int end = (b + 1) * PEAK_BLOCK;
+		if (end > length) end = length;
+		for (unsigned int t = b * PEAK_BLOCK; t < end; ++t)
+		{
+			double p = peak_at(&in, samples, length, t);
+			if (p > peak) peak = p;
+		}
+	}
+	return (peak > 0) ? (20.0 * log10(peak / full_scale)) : SILENT;
+}
+
+void apply_gain(const signed int* samples, sint16* out, unsigned int count,
+	double full_scale, double gain)
+{
+	double scale = gain * 32768.0 / full_scale;
+	for (unsigned int i=0; i < count; ++i)
+		out[i] = clip16(double(samples[i]) * scale);
+}
+
+} // namespace loudness
+
+// limiter
+//   r(t) is the reduction that keeps the true peak at t under the ceiling,
+//   m(j) the least r(t) from j to j+LOOKAHEAD, and the gain at i is the mean
+//   of m(j) for the LOOKAHEAD samples up to i. Every m(j) in that mean covers i,
+//   so the gain is never more than r(i), and it ramps down smoothly ahead of a peak.
+//   It recovers after at a RELEASE time constant.
+
+const int LOOKAHEAD_MAX = 1024;
+const double LOOKAHEAD = 0.002; // seconds
+const double RELEASE = 0.05; // seconds
+
+struct loudness::Limiter
+{
+	const signed int* x;
+	unsigned int length;
+	Interp in;
+	double level; // x * level is 1.0 at full scale
+	double scale; // x * scale is the 16-bit output
+	double ceiling;
+	double release;
+	int lookahead;
+	unsigned int next; // next sample to find r(t) for
+	unsigned int block; // block last tested by block_max
+	bool quiet; // block can't reach the ceiling
+	unsigned int least_t[LOOKAHEAD_MAX]; // r(t) in increasing order, to find m(j)
+	double least_r[LOOKAHEAD_MAX];
+	int least_head;
+	int least_count;
+	double mean[LOOKAHEAD_MAX]; // the last lookahead m(j)
+	int mean_pos;
+	double mean_sum;
+	double gain; // after release
+	unsigned int pos; // next sample of output
+};
+
+// finds r(t) for the next t, and m(t-lookahead)
+void detect(loudness::Limiter* l)
+{
+	unsigned int t = l->next++;
+	double r = 1.0;
+	if (t < l->length)
+	{
+		unsigned int b = t / PEAK_BLOCK;
+		if (b != l->block)
+		{
+			l->block = b;
+			l->quiet = (block_max(l->x, l->length, b) * l->in.gain * l->level) <= l->ceiling;
+		}
+		if (!l->quiet)
+		{
+			double peak = peak_at(&l->in, l->x, l->length, t) * l->level;
+			if (peak > l->ceiling) r = l->ceiling / peak;
+		}
+	}
+
+	const int MASK = LOOKAHEAD_MAX - 1;
+	while (l->least_count > 0 && l->least_r[(l->least_head + l->least_count - 1) & MASK] >= r)
+		--l->least_count;
+	int back = (l->least_head + l->least_count) & MASK;
+	l->least_t[back] = t;
+	l->least_r[back] = r;
+	++l->least_count;
+	while (t >= unsigned(l->lookahead) && l->least_t[l->least_head] < (t - l->lookahead))
+	{
+		l->least_head = (l->least_head + 1) & MASK;
+		--l->least_count;
+	}
+
+	double m = l->least_r[l->least_head];
+	l->mean_sum += m - l->mean[l->mean_pos];
+	l->mean[l->mean_pos] = m;
+	l->mean_pos = (l->mean_pos + 1) % l->lookahead;
+}
+
+namespace loudness
+{
+
+Limiter* create_limiter(const signed int* samples, unsigned int length,
+	unsigned int samplerate, double full_scale, double gain, double ceiling)
+{
+	Limiter* l = (Limiter*)malloc(sizeof(Limiter));
+	if (l == NULL) return NULL;
+
+	make_interp(&l->in);
+	l->x = samples;
+	l->length = length;
+	l->level = gain / full_scale;
+	l->scale = gain * 32768.0 / full_scale;
+	l->ceiling = pow(10.0, ceiling / 20.0);
+	l->release = exp(-1.0 / (RELEASE * double(samplerate)));
+	l->lookahead = int(LOOKAHEAD * double(samplerate));
+	if (l->lookahead < 1) l->lookahead = 1;
+	if (l->lookahead > (LOOKAHEAD_MAX - 2)) l->lookahead = LOOKAHEAD_MAX - 2;
+	l->next = 0;
+	l->block = ~0u;
+	l->quiet = false;
+	l->least_head = 0;
+	l->least_count = 0;
+	for (int i=0; i < l->lookahead; ++i) l->mean[i] = 1.0;
+	l->mean_pos = 0;
+	l->mean_sum = l->lookahead;
+	l->gain = 1.0;
+	l->pos = 0;
+	return l;
+}
+
+void destroy(Limiter* l)
+{
+	free(l);
+}
+
+void process(Limiter* l, sint16* out, unsigned int count)
+{
+	for (unsigned int n=0; n < count; ++n)
+	{
+		unsigned int i = l->pos++;
+		while (l->next <= (i + l->lookahead)) detect(l);
+
+		double ramp = l->mean_sum / double(l->lookahead);
+		double released = 1.0 - ((1.0 - l->gain) * l->release);
+		l->gain = (ramp < released) ? ramp : released;
+		out[n] = (i < l->length) ? clip16(double(l->x[i]) * l->scale * l->gain) : 0;
+	}
+}
+
+double limited_gain(const signed int* samples, unsigned int measured,
+	unsigned int samplerate, double full_scale, double gain, double target, double ceiling)
+{
+	const int PASSES = 4;
+	const double TOLERANCE = 0.1; // LU
+
+	// limiting takes away some loudness, which is made up by more gain
+	for (int pass=0; pass < PASSES; ++pass)
+	{
+		Limiter* l = create_limiter(samples, measured, samplerate, full_scale, gain, ceiling);
+		Meter* m = create(samplerate, 32768.0);
+		if (l == NULL || m == NULL) { destroy(l); destroy(m); return 0; }
+
+		sint16 block[1024];
+		signed int wide[1024];
+		bool ok = true;
+		for (unsigned int pos=0; ok && pos < measured; )
+		{
+			unsigned int count = measured - pos;
+			if (count > 1024) count = 1024;
+			process(l, block, count);
+			for (unsigned int i=0; i < count; ++i) wide[i] = block[i];
+			ok = add(m, wide, count);
+			pos += count;
+		}
+		double lufs = integrated(m);
+		destroy(l);
+		destroy(m);
+		if (!ok) return 0;
+
+		if (lufs <= SILENT || fabs(target - lufs) < TOLERANCE) break;
+		gain *= pow(10.0, (target - lufs) / 20.0);
+	}
+	return gain;
+}
+
+} // namespace loudness
+
+// end of file
@@ -0,0 +1,44 @@
+#pragma once
+
+// loudness.h
+//   loudness and true peak measurement (ITU-R BS.1770), and a true peak limiter
+
+#include "os.h" // sint16
+
+namespace loudness
+{
+
+const double SILENT = -200.0; // measurement of silence, in LUFS or dB
+
+// integrated loudness of a mono signal, given in pieces as it is made,
+// a sample of full_scale is 0 dB
+struct Meter;
+extern Meter* create(unsigned int samplerate, double full_scale); // NULL if out of memory
+extern void destroy(Meter* m);
+extern bool add(Meter* m, const signed int* samples, unsigned int count); // false if out of memory
+extern double integrated(const Meter* m); // LUFS
+
+// true peak in dB of a signal in memory, with 4x oversampling
+extern double true_peak(const signed int* samples, unsigned int length, double full_scale);
+
+// samples scaled by gain to 16-bit output, rounded and clipped
+extern void apply_gain(const signed int* samples, sint16* out, unsigned int count,
+	double full_scale, double gain);
+
+// scales a signal in memory by gain to 16-bit output, smoothly reducing the gain
+// wherever its true peak would pass ceiling (dB), output must be taken in order
+struct Limiter;
+extern Limiter* create_limiter(const signed int* samples, unsigned int length,
+	unsigned int samplerate, double full_scale, double gain, double ceiling); // NULL if out of memory
+extern void destroy(Limiter* l);
+extern void process(Limiter* l, sint16* out, unsigned int count); // the next count samples
+
+// gain for a limiter with ceiling (dB) that brings the loudness of a signal in memory
+// to target (LUFS), found by limiting and measuring it a few times from the gain that
+// would without the limiter, 0 if out of memory
+extern double limited_gain(const signed int* samples, unsigned int measured,
+	unsigned int samplerate, double full_scale, double gain, double target, double ceiling);
+
+} // namespace loudness
+
+// end of file
@@ -4,6 +4,13 @@
 #include <cstdlib>
 #include <cstring>
 #include <cstdio>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "os.h"
 
 // defined in mac_cocoa.m
@@ -38,6 +45,11 @@ static const char* win32_masks(int mask_count, const char** masks)
 namespace os
 {
 
+void start_dialogs()
+{
+	// native dialogs are ready immediately
+}
+
 void alert(const char* message)
 {
 	return cocoa_alert(message);
@@ -58,6 +70,79 @@ const char* file_save(const char* default_name, int mask_count, const char** mas
 	return cocoa_file_save(default_name,mask_count,masks);
 }
 
+bool list_dir(const char* path, void (*entry)(const char* name, bool folder, void* data), void* data)
+{
+	DIR* dir = opendir(path);
+	if (dir == NULL) return false;
+
+	char full[1024];
+	struct dirent* de;
+	while ((de = readdir(dir)) != NULL)
+	{
+		if (!strcmp(de->d_name,".") || !strcmp(de->d_name,"..")) continue;
+
+		bool folder = (de->d_type == DT_DIR);
+		if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK)
+		{
+			struct stat st;
+			snprintf(full,sizeof(full),"%s/%s",path,de->d_name);
+			folder = (stat(full,&st) == 0) && S_ISDIR(st.st_mode);
+		}
+		entry(de->d_name,folder,data);
+	}
+
+	closedir(dir);
+	return true;
+}
+
+const unsigned char* map_file(const char* filename, unsigned int* size)
+{
+	int fd = open(filename,O_RDONLY);
+	if (fd < 0) return NULL;
+
+	struct stat st;
+	if (fstat(fd,&st) != 0 || st.st_size < 1)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	void* view = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd); // mapping stays valid
+	if (view == MAP_FAILED) return NULL;
+
+	*size = st.st_size;
+	return (const unsigned char*)view;
+}
+
+void unmap_file(const unsigned char* view, unsigned int size)
+{
+	if (view) munmap((void*)view,size);
+}
+
+bool lock_memory(const void* data, unsigned int size)
+{
+	// pages are faulted in even if they can't be locked
+	long page = sysconf(_SC_PAGESIZE);
+	const volatile unsigned char* bytes = (const volatile unsigned char*)data;
+	for (unsigned int i=0; i < size; i += page) (void)bytes[i];
+	if (size > 0) (void)bytes[size-1];
+
+	return mlock(data,size) == 0;
+}
+
+bool raise_priority()
+{
+	const int policies[2] = { SCHED_FIFO, SCHED_RR };
+	for (int i=0; i < 2; ++i)
+	{
+		struct sched_param param;
+		param.sched_priority = sched_get_priority_max(policies[i]);
+		if (pthread_setschedparam(pthread_self(),policies[i],&param) == 0) return true;
+	}
+	return false;
+}
+
 } // namespace os
 
 // end of file
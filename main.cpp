@@ -1,42 +1,351 @@
 // main.cpp
 //   main entry point
 
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
 #include "SDL.h"
 #include "os.h"
 #include "editor.h"
+#include "files.h"
+#include "serve.h"
+#include "player.h"
 
 // global state of main
 
 const unsigned int SAMPLERATE = 32000;
-const unsigned int WIN_W = 256 * 2;
-const unsigned int WIN_H = 224 * 2;
+const int SCREEN_W = 256;
+const int SCREEN_H = 224;
+const int MAX_SCALE = 6;
 
 const int MAX_ICONS = 128;
-static SDL_Surface* icon_bank[MAX_ICONS];
-static SDL_Surface* screen;
+static SDL_Surface* atlas; // every icon, packed by data.py
+static SDL_Rect icon_bank[MAX_ICONS]; // icon rectangles in atlas
+static const unsigned int* atlas_data; // 0x00RRGGBB pixels from data.py
+static int atlas_w;
+static SDL_Surface* window;
+static SDL_Surface* screen; // native resolution back buffer
+static SDL_Surface* target; // screen, or a tile being drawn
+static int scale = 2; // window pixels per screen pixel
+
+const int MAX_TILES = 64;
+static SDL_Surface* tile_bank[MAX_TILES];
+static int tile_count = 0;
+static Uint32 tile_key; // transparent colour of tiles
+
+const int MAX_REGIONS = 32;
+static SDL_Rect regions[MAX_REGIONS]; // drawn since the last present
+static int region_count = 0;
 
 static unsigned char ascii_map[256];
-static SDL_Surface* ascii_tile[256];
+static SDL_Surface* font_atlas; // surface holding the font sheet
+static SDL_Rect ascii_glyph[256]; // glyph rectangles in font_atlas, 0 is the unused glyph
 static int ascii_w, ascii_h;
 
+// recently drawn strings, composed into one surface each
+const int MAX_TEXTS = 16;
+const int MAX_TEXT_LEN = 128;
+struct TextCache
+{
+	char text[MAX_TEXT_LEN];
+	SDL_Surface* surface;
+	unsigned int used; // for eviction
+};
+static TextCache text_cache[MAX_TEXTS];
+static unsigned int text_frame = 0;
+
 static bool do_quit = false;
 
+// input log for --record and --replay
+static FILE* input_log = NULL;
+static bool replaying = false; // headless, reading input_log
+static unsigned int blit_count = 0; // blits since the last frame, for --replay
+
 
 // audio callback wrapper
 
 static void (*audio_callback)(sint16* buffer, int len);
+static bool realtime = false; // --realtime
+static bool raise_audio = false; // raise the audio thread's priority on its first callback
 
 void sdl_audio_callback(void* userdata, Uint8* stream, int len)
 {
+	if (raise_audio)
+	{
+		// SDL starts the audio thread, so only it can raise itself
+		raise_audio = false;
+		os::raise_priority(); // otherwise it plays at normal priority
+	}
+
 	if (audio_callback)
 		audio_callback((sint16*)stream,len/2);
 	else
 		memset(stream,0,len);
 }
 
+// every blit to the screen or a tile, counted for --replay
+static void blit(SDL_Surface* src, SDL_Rect* src_rect, SDL_Surface* dst, SDL_Rect* dst_rect)
+{
+	SDL_BlitSurface(src, src_rect, dst, dst_rect);
+	++blit_count;
+}
+
+// shows the regions drawn this frame, scaling them up to the window
+static void present()
+{
+	SDL_SetClipRect(screen, NULL);
+	if (region_count < 1) return;
+
+	if (SDL_MUSTLOCK(window) && SDL_LockSurface(window) < 0)
+		return;
+
+	for (int i=0; i < region_count; ++i)
+	{
+		SDL_Rect& r = regions[i];
+		for (int y = r.y; y < (r.y + r.h); ++y)
+		{
+			const Uint32* src = (const Uint32*)((const Uint8*)screen->pixels + (y * screen->pitch)) + r.x;
+			Uint8* dst_row = (Uint8*)window->pixels + (y * scale * window->pitch) + (r.x * scale * 4);
+
+			// nearest neighbour, one row widened then repeated
+			Uint32* dst = (Uint32*)dst_row;
+			for (int x=0; x < r.w; ++x)
+			{
+				Uint32 pixel = src[x];
+				for (int s=0; s < scale; ++s)
+					*dst++ = pixel;
+			}
+			for (int s=1; s < scale; ++s)
+				memcpy(dst_row + (s * window->pitch), dst_row, r.w * scale * 4);
+		}
+
+		r.x *= scale;
+		r.y *= scale;
+		r.w *= scale;
+		r.h *= scale;
+	}
+
+	if (SDL_MUSTLOCK(window))
+		SDL_UnlockSurface(window);
+
+	SDL_UpdateRects(window, region_count, regions);
+	region_count = 0;
+}
+
+// opens the window at the current scale, returns false on failure
+static bool open_window()
+{
+	// the window is written only by present, so it keeps the last frame
+	window = SDL_SetVideoMode(SCREEN_W * scale, SCREEN_H * scale, 32, SDL_SWSURFACE);
+	if (window == NULL) return false;
+
+	// the whole back buffer is shown next
+	SDL_Rect all = { 0, 0, SCREEN_W, SCREEN_H };
+	regions[0] = all;
+	region_count = 1;
+	return true;
+}
+
+// a surface using the atlas pixels in place, magenta is transparent
+static SDL_Surface* atlas_view(int x, int y, int w, int h)
+{
+	SDL_Surface* view = SDL_CreateRGBSurfaceFrom(
+		(void*)(atlas_data + ((y*atlas_w)+x)), // only read
+		w, h,
+		32,  // bpp
+		4*atlas_w, // pitch
+		0xFF0000, 0x00FF00, 0x0000FF, 0);
+	if (view != NULL)
+		SDL_SetColorKey(view, SDL_SRCCOLORKEY, 0xFF00FF);
+	return view;
+}
+
+// editor input
+//   everything main gives the editor goes through send_input, so --record can
+//   log it and --replay can give it again, one line per call:
+//     u ms        update, which ends a frame
+//     m x y       mouse move
+//     b x y down  left button
+//     r x y       right click
+//     k key ascii key press
+//     c held      ctrl
+//     s held      shift
+//   dialogs are not logged, so recordings that open them won't replay
+
+static const char* INPUT_LOG_HEADER = "mariopants input 1\n";
+
+static void send_input(char type, int a, int b, int c)
+{
+	if (input_log != NULL && !replaying)
+		fprintf(input_log, "%c %d %d %d\n", type, a, b, c);
+
+	switch (type)
+	{
+		case 'u': editor::update(a);                  break;
+		case 'm': editor::mouse_move(a,b);            break;
+		case 'b': editor::mouse_button(a,b,(c != 0)); break;
+		case 'r': editor::mouse_rbutton(a,b);         break;
+		case 'k': editor::key(SDLKey(a),char(b));     break;
+		case 'c': editor::ctrl_held(a != 0);          break;
+		case 's': editor::shift_held(a != 0);         break;
+		default: break;
+	}
+}
+
+static double clock_ms(clock_t start, clock_t end)
+{
+	return double(end - start) * 1000.0 / double(CLOCKS_PER_SEC);
+}
+
+// gives the editor the logged input as fast as it can, printing a line per frame
+static void replay()
+{
+	int frames = 0;
+	double update_total = 0.0;
+	double draw_total = 0.0;
+	double draw_max = 0.0;
+	unsigned int blit_total = 0;
+
+	printf("frame,ms,update_ms,draw_ms,blits\n");
+	char line[64];
+	while (!do_quit && fgets(line, sizeof(line), input_log))
+	{
+		char type = 0;
+		int a = 0, b = 0, c = 0;
+		if (sscanf(line, "%c %d %d %d", &type, &a, &b, &c) < 1) continue;
+		if (type != 'u')
+		{
+			send_input(type, a, b, c);
+			continue;
+		}
+
+		blit_count = 0;
+		clock_t start = clock();
+		send_input(type, a, b, c);
+		clock_t updated = clock();
+		if (editor::do_redraw())
+		{
+			editor::draw();
+			present();
+		}
+		clock_t drawn = clock();
+
+		double update_ms = clock_ms(start, updated);
+		double draw_ms = clock_ms(updated, drawn);
+		printf("%d,%d,%.3f,%.3f,%u\n", frames, a, update_ms, draw_ms, blit_count);
+
+		++frames;
+		update_total += update_ms;
+		draw_total += draw_ms;
+		if (draw_ms > draw_max) draw_max = draw_ms;
+		blit_total += blit_count;
+	}
+
+	printf("# %d frames, update %.1f ms, draw %.1f ms (%.3f max), %u blits\n",
+		frames, update_total, draw_total, draw_max, blit_total);
+	printf("# song %08X\n", song_hash(editor::get_song()));
+}
+
+// --record and --replay run the editor, with the rest of the command line its own
+// returns -1 if argv is not one of these, 1 on failure
+static int input_command(int& argc, char**& argv)
+{
+	if (argc < 3) return -1;
+	if      (!strcmp(argv[1],"--record")) replaying = false;
+	else if (!strcmp(argv[1],"--replay")) replaying = true;
+	else return -1;
+
+	input_log = fopen(argv[2], replaying ? "r" : "w");
+	if (input_log == NULL)
+	{
+		fprintf(stderr, "Unable to open input log: %s\n", argv[2]);
+		return 1;
+	}
+
+	if (replaying)
+	{
+		char header[64];
+		if (!fgets(header, sizeof(header), input_log) || strcmp(header, INPUT_LOG_HEADER))
+		{
+			fprintf(stderr, "Not a mariopants input log: %s\n", argv[2]);
+			return 1;
+		}
+	}
+	else
+		fputs(INPUT_LOG_HEADER, input_log);
+
+	// argv[0] becomes the log, leaving any file to load in argv[1]
+	argc -= 2;
+	argv += 2;
+	return 0;
+}
+
+// command line tools that run without opening a window
+// returns -1 if argv is not a command
+static int command_line(int argc, char** argv)
+{
+	if (argc < 2 || strncmp(argv[1],"--",2)) return -1;
+
+	if ((argc == 3 || argc == 4) && !strcmp(argv[1],"--serve"))
+		return serve::run(argv[2], (argc == 4) ? argv[3] : NULL);
+
+	bool result;
+	if      (argc == 4 && !strcmp(argv[1],"--pack"))
+		result = files::pack_archive(argv[2],argv[3]);
+	else if (argc == 4 && !strcmp(argv[1],"--unpack"))
+		result = files::unpack_archive(argv[2],argv[3]);
+	else
+	{
+		fprintf(stderr,
+			"usage: mariopants [--realtime] [FILE]\n"
+			"       mariopants --pack DIRECTORY ARCHIVE.shp\n"
+			"       mariopants --unpack ARCHIVE.shp DIRECTORY\n"
+			"       mariopants --serve SOCKET [LIBRARY.shp]\n"
+			"       mariopants --record LOG [FILE]\n"
+			"       mariopants --replay LOG [FILE]\n");
+		return 1;
+	}
+
+	if (!result)
+	{
+		fprintf(stderr, "%s\n", files::get_file_error());
+		return 1;
+	}
+	return 0;
+}
+
 // entry point
 int main(int argc, char** argv)
 {
+	// argv[0] becomes the option, leaving any other command or file after it
+	if (argc > 1 && !strcmp(argv[1],"--realtime"))
+	{
+		realtime = true;
+		--argc;
+		++argv;
+	}
+
+	int command = input_command(argc,argv);
+	if (command > 0) return command;
+	if (command < 0)
+	{
+		command = command_line(argc,argv);
+		if (command >= 0) return command;
+	}
+
+	if (replaying)
+	{
+		// no window or sound, so replays run anywhere and as fast as they can
+		// putenv keeps the strings, and may want them writable
+		static char video_driver[] = "SDL_VIDEODRIVER=dummy";
+		static char audio_driver[] = "SDL_AUDIODRIVER=dummy";
+		SDL_putenv(video_driver);
+		SDL_putenv(audio_driver);
+	}
+	else
+		os::start_dialogs(); // ready by the time one is needed
+
 	if (0 != SDL_Init(
 		SDL_INIT_TIMER |
 		SDL_INIT_AUDIO |
@@ -46,14 +355,27 @@ int main(int argc, char** argv)
 		return 1;
 	}
 
-	screen = SDL_SetVideoMode(WIN_W, WIN_H, 32, SDL_DOUBLEBUF);
-	if (screen == NULL)
+	// the back buffer keeps the last frame, so only changed regions need to be drawn
+	if (open_window())
+	{
+		screen = SDL_CreateRGBSurface(
+			SDL_SWSURFACE,
+			SCREEN_W, SCREEN_H,
+			window->format->BitsPerPixel,
+			window->format->Rmask,
+			window->format->Gmask,
+			window->format->Bmask,
+			0);
+	}
+	if (window == NULL || screen == NULL)
 	{
 		os::alert("Unable to create SDL video surface!");
 		return 2;
 	}
+	target = screen;
 
 	audio_callback = NULL;
+	raise_audio = realtime && !replaying;
 
 	SDL_AudioSpec audio_spec;
 	memset(&audio_spec,0,sizeof(audio_spec));
@@ -74,16 +396,24 @@ int main(int argc, char** argv)
 
 	for (int i=0; i < MAX_ICONS; ++i)
 	{
-		icon_bank[i] = NULL;
+		SDL_Rect none = { 0, 0, 0, 0 };
+		icon_bank[i] = none;
 	}
 
 	editor::setup(SAMPLERATE,argc,argv);
 
+	// the sample bank is unpacked by setup, and is locked before playback can page it in
+	if (realtime && !replaying && !player::lock_memory())
+		fprintf(stderr, "Unable to lock audio memory, it may be paged out during playback.\n");
+
 	SDL_WM_SetCaption("mariopants", "mariopants");
 	int icon = editor::get_icon();
 	if (icon >= 0)
 	{
-		SDL_WM_SetIcon(icon_bank[icon], NULL);
+		const SDL_Rect& r = icon_bank[icon];
+		SDL_Surface* wm_icon = atlas_view(r.x, r.y, r.w, r.h);
+		if (wm_icon != NULL)
+			SDL_WM_SetIcon(wm_icon, NULL);
 	}
 	SDL_ShowCursor(0); // hide the system mouse cursor
 	SDL_EnableKeyRepeat(650,100);
@@ -91,11 +421,26 @@ int main(int argc, char** argv)
 
 	// draw the screen for the first time
 	editor::draw();
-	SDL_Flip(screen);
+	present();
+
+	if (replaying)
+	{
+		replay();
+		fclose(input_log);
+		SDL_Quit();
+		return 0;
+	}
 
 	Uint32 last_time = SDL_GetTicks();
 	while(true)
 	{
+		// with nothing to animate, sleep until there is input
+		if (!editor::animating())
+		{
+			SDL_WaitEvent(NULL);
+			last_time = SDL_GetTicks(); // time spent waiting is not a frame
+		}
+
 		// calculate time since last frame
 		Uint32 time = SDL_GetTicks();
 		Uint32 delta = time - last_time;
@@ -113,37 +458,40 @@ int main(int argc, char** argv)
 						if (event.button.button == SDL_BUTTON_RIGHT)
 						{
 							if (event.button.state==SDL_PRESSED)
-								editor::mouse_rbutton(event.button.x>>1, event.button.y>>1);
+								send_input('r', event.button.x/scale, event.button.y/scale, 0);
 						}
 						else if (event.button.button == SDL_BUTTON_LEFT)
 						{
-							editor::mouse_button(event.button.x>>1, event.button.y>>1, (event.button.state==SDL_PRESSED));
+							send_input('b', event.button.x/scale, event.button.y/scale, (event.button.state==SDL_PRESSED));
 						}
 						break;
 					}
 				case SDL_MOUSEMOTION:
-					editor::mouse_move(event.button.x>>1, event.button.y>>1);
+					send_input('m', event.motion.x/scale, event.motion.y/scale, 0);
 					break;
 				case SDL_KEYDOWN:
 					{
 						if (     event.key.keysym.sym == SDLK_LCTRL ||
 						         event.key.keysym.sym == SDLK_RCTRL)
-							editor::ctrl_held(true);
+							send_input('c', 1, 0, 0);
 						else if (event.key.keysym.sym == SDLK_LSHIFT ||
 						         event.key.keysym.sym == SDLK_RSHIFT)
-							editor::shift_held(true);
+							send_input('s', 1, 0, 0);
 
 						char ascii = (event.key.keysym.unicode < 128) ? event.key.keysym.unicode : 0;
-						editor::key(event.key.keysym.sym, ascii);
+						send_input('k', event.key.keysym.sym, ascii, 0);
 					}
 					break;
 				case SDL_KEYUP:
 					if (     event.key.keysym.sym == SDLK_LCTRL ||
 						        event.key.keysym.sym == SDLK_RCTRL)
-						editor::ctrl_held(false);
+						send_input('c', 0, 0, 0);
 					else if (event.key.keysym.sym == SDLK_LSHIFT ||
 						        event.key.keysym.sym == SDLK_RSHIFT)
-						editor::shift_held(false);
+						send_input('s', 0, 0, 0);
+					break;
+				case SDL_VIDEOEXPOSE:
+					SDL_UpdateRect(window, 0, 0, 0, 0); // the window surface still holds the last frame
 					break;
 				case SDL_QUIT:
 					os::try_quit(editor::get_changed());
@@ -154,11 +502,11 @@ int main(int argc, char** argv)
 			if (do_quit) goto quit;
 		}
 
-		editor::update(delta);
+		send_input('u', delta, 0, 0);
 		if (editor::do_redraw())
 		{
 			editor::draw();
-			SDL_Flip(screen);
+			present();
 		}
 
 		// figure out how much time this frame really used
@@ -172,6 +520,8 @@ int main(int argc, char** argv)
 	}
 
 quit:
+	if (input_log != NULL)
+		fclose(input_log);
 	SDL_Quit();
 	return 0;
 }
@@ -181,95 +531,140 @@ quit:
 namespace os
 {
 
-// convenient function for creating a new icon in icon_bank
-void add_icon(int index, int w, int h, const void* data)
+// builds the atlas surface all icons are drawn from
+// * data - RGBA pixels, transparent pixels are magenta with 0 alpha
+void set_atlas(int w, int h, const void* data)
 {
-	if (index >= MAX_ICONS || icon_bank[index] != NULL)
-	{
-		os::alert("Invalid icon index!");
-		exit(3);
-	}
-
-	// double size the image (enough to fit the largest icon I have)
-	const unsigned char* source = (const unsigned char*)data;
-	static unsigned char resized[256 * 288 * 4 * 4];
-	for (int y=0; y<h; ++y)
-	for (int x=0; x<w; ++x)
+	atlas_data = (const unsigned int*)data;
+	atlas_w = w;
+	atlas = (data != NULL) ? atlas_view(0, 0, w, h) : NULL;
+	if (atlas != NULL)
 	{
-		int spos = (((y*w)+x)*4);
-		uint32 pixel;
-		memcpy(&pixel,source+spos,4);
-
-		for (int dy=0; dy<2; ++dy)
-		for (int dx=0; dx<2; ++dx)
-		{
-			int ry = (y * 2) + dy;
-			int rx = (x * 2) + dx;
-			int rpos = (((ry*w*2)+rx)*4);
-			memcpy(resized+rpos,&pixel,4);
-		}
-	}
-	w <<= 1;
-	h <<= 1;
-
-	// NOTE the rgba masks presume little endian
-	icon_bank[index] =
-		SDL_CreateRGBSurfaceFrom(
-			resized, w, h,
-			32,  // bpp
-			4*w, // pitch
-			#if SDL_BYTEORDER == SDL_BIG_ENDIAN
-				0xFF000000,
-				0x00FF0000,
-				0x0000FF00,
-				0x000000FF
-			#else
-				0x000000FF,
-				0x0000FF00,
-				0x00FF0000,
-				0xFF000000
-			#endif
-			);
-	
-	// optimize for this display
-	if (icon_bank[index] != NULL)
-	{
-		bool has_alpha = false;
-		for (int i=0; i < (w*h); ++i)
+		SDL_SetColorKey(atlas, SDL_SRCCOLORKEY | SDL_RLEACCEL, 0xFF00FF);
+
+		// the pixels are already laid out for a 32-bit display, only an unusual one needs a copy
+		const SDL_PixelFormat* f = screen->format;
+		if (f->BitsPerPixel != 32 ||
+			f->Rmask != 0xFF0000 ||
+			f->Gmask != 0x00FF00 ||
+			f->Bmask != 0x0000FF)
 		{
-			const unsigned char* p = (const unsigned char*)data;
-			if (p[(i*4)+3] != 0xFF)
-			{
-				has_alpha = true;
-				break;
-			}
+			SDL_Surface* old = atlas;
+			atlas = SDL_DisplayFormat(old);
+			SDL_FreeSurface(old);
 		}
-
-		SDL_Surface* old = icon_bank[index];
-		if (has_alpha)
-			icon_bank[index] = SDL_DisplayFormatAlpha(old);
-		else
-			icon_bank[index] = SDL_DisplayFormat(old);
-		SDL_FreeSurface(old);
 	}
 
-	if (icon_bank[index] == NULL)
+	if (atlas == NULL)
 	{
 		os::alert("Unable to create SDL icon surface!");
 		exit(5);
 	}
 }
 
+// names a rectangle of the atlas as an icon
+void add_icon(int index, int x, int y, int w, int h)
+{
+	if (index >= MAX_ICONS || icon_bank[index].w != 0)
+	{
+		os::alert("Invalid icon index!");
+		exit(3);
+	}
+
+	SDL_Rect rect = { x, y, w, h };
+	icon_bank[index] = rect;
+}
+
 // convenient function for drawing icons from icon_bank
 void draw_icon(int x, int y, int icon)
 {
-	SDL_Surface* img = icon_bank[icon];
-	SDL_Rect dst = { x<<1, y<<1, 0, 0 }; // note all pixels are scaled 2x2
-	SDL_BlitSurface(img, NULL, screen, &dst);
+	SDL_Rect src = icon_bank[icon];
+	SDL_Rect dst = { x, y, 0, 0 };
+	blit(atlas, &src, target, &dst);
+}
+
+void icon_size(int icon, int* w, int* h)
+{
+	*w = icon_bank[icon].w;
+	*h = icon_bank[icon].h;
+}
+
+int add_tile(int w, int h)
+{
+	if (tile_count >= MAX_TILES)
+	{
+		os::alert("Too many tiles!");
+		exit(9);
+	}
+
+	SDL_Surface* tile = SDL_CreateRGBSurface(
+		SDL_SWSURFACE,
+		w, h,
+		screen->format->BitsPerPixel,
+		screen->format->Rmask,
+		screen->format->Gmask,
+		screen->format->Bmask,
+		0);
+	if (tile == NULL)
+	{
+		os::alert("Unable to create SDL tile surface!");
+		exit(6);
+	}
+
+	// icons have 1-bit alpha, so anything left magenta was not drawn on
+	tile_key = SDL_MapRGB(tile->format, 0xFF, 0x00, 0xFF);
+	SDL_SetColorKey(tile, SDL_SRCCOLORKEY, tile_key);
+	SDL_FillRect(tile, NULL, tile_key);
+
+	tile_bank[tile_count] = tile;
+	return tile_count++;
+}
+
+void begin_tile(int tile)
+{
+	target = tile_bank[tile];
+	SDL_FillRect(target, NULL, tile_key);
+}
+
+void end_tile()
+{
+	target = screen;
+}
+
+void draw_tile(int x, int y, int tile)
+{
+	SDL_Rect dst = { x, y, 0, 0 };
+	blit(tile_bank[tile], NULL, screen, &dst);
+}
+
+void set_region(int x, int y, int w, int h)
+{
+	SDL_Rect rect = { x, y, w, h };
+	SDL_SetClipRect(screen, &rect);
+
+	if (region_count >= MAX_REGIONS) // present everything instead
+	{
+		SDL_Rect all = { 0, 0, SCREEN_W, SCREEN_H };
+		regions[0] = all;
+		region_count = 1;
+		return;
+	}
+	SDL_GetClipRect(screen, &regions[region_count]); // clipped to the screen
+	if (regions[region_count].w > 0 && regions[region_count].h > 0)
+		++region_count;
 }
 
 // font state
 
+static void clear_text_cache()
+{
+	for (int i=0; i < MAX_TEXTS; ++i)
+	{
+		if (text_cache[i].surface) SDL_FreeSurface(text_cache[i].surface);
+		text_cache[i].surface = NULL;
+	}
+}
+
 // builds an ASCII font
 // * icon - use add_icon to create font sheet first
 // * w/h - size of font tile
@@ -284,25 +679,21 @@ void draw_icon(int x, int y, int icon)
 //         0 terminates the string (0 does not get a tile)
 void add_font(int icon, int w, int h, int tx, int ty, int xs, int ys, int r, const char* map)
 {
-	// note all pixels are scaled 2x2
-	w  <<= 1;
-	h  <<= 1;
-	tx <<= 1;
-	ty <<= 1;
-	xs <<= 1;
-	ys <<= 1;
-
-	SDL_Surface* font_sheet = icon_bank[icon];
+	// the font sheet is part of the atlas
+	font_atlas = atlas;
+	tx += icon_bank[icon].x;
+	ty += icon_bank[icon].y;
 
 	ascii_w = w;
 	ascii_h = h;
 	for (int i=0; i<256; ++i)
 	{
 		ascii_map[i] = 0;
-		ascii_tile[i] = NULL;
+		SDL_Rect none = { 0, 0, 0, 0 };
+		ascii_glyph[i] = none;
 	}
 
-	unsigned char count = 1; // the blank tile will be placed at 0
+	unsigned char count = 1; // the blank glyph will be placed at 0
 	int rx = tx;
 	int rc = 0;
 	while(*map)
@@ -313,48 +704,15 @@ void add_font(int icon, int w, int h, int tx, int ty, int xs, int ys, int r, con
 			if      (c == 128) c = ' '; // assign space
 			else if (c == 129) c = 0;   // assign unused
 
-			// create tile
-			SDL_Surface* tile = SDL_CreateRGBSurface(
-				font_sheet->flags,
-				w, h,
-				font_sheet->format->BitsPerPixel,
-				font_sheet->format->Rmask,
-				font_sheet->format->Gmask,
-				font_sheet->format->Bmask,
-				font_sheet->format->Amask);
-			if (tile == NULL)
-			{
-				os::alert("Unable to create SDL tile surface!");
-				exit(6);
-			}
-
-			// build tile from font sheet
 			SDL_Rect rect = { rx, ty, w, h };
-			if (0 != SDL_BlitSurface(font_sheet, &rect, tile, NULL))
-			{
-				os::alert("Unable to copy SDL font tiles!");
-				exit(7);
-			}
-
-			// optimize
-			SDL_Surface* old = tile;
-			tile = SDL_DisplayFormat(old);
-			SDL_FreeSurface(old);
-			if (tile == NULL)
-			{
-				os::alert("Unable to rebuild SDL font tile!");
-				exit(8);
-			}
-
-			// store tile
 			if (c != 0)
 			{
-				ascii_tile[count] = tile;
+				ascii_glyph[count] = rect;
 				ascii_map[c] = count;
 				++count;
 			}
-			else // "unused" default tile
-				ascii_tile[0] = tile;
+			else // "unused" default glyph
+				ascii_glyph[0] = rect;
 		}
 
 		// advance to next tile
@@ -368,6 +726,8 @@ void add_font(int icon, int w, int h, int tx, int ty, int xs, int ys, int r, con
 			rc = 0;
 		}
 	}
+
+	clear_text_cache(); // glyph mapping has changed
 }
 
 // replaces "duplicate" character with "original"
@@ -375,15 +735,13 @@ void add_font(int icon, int w, int h, int tx, int ty, int xs, int ys, int r, con
 // to the same tile.
 void dupe_font(char duplicate, char original)
 {
-	ascii_map[duplicate] = ascii_map[original];
+	ascii_map[(unsigned char)duplicate] = ascii_map[(unsigned char)original];
+	clear_text_cache();
 }
 
-void draw_font(int x, int y, const char* msg)
+// blits each glyph of msg from the atlas
+static void draw_glyphs(SDL_Surface* dst, int x, int y, const char* msg)
 {
-	// note all pixels are scaled 2x2
-	x <<= 1;
-	y <<= 1;
-
 	int rx = x;
 	int ry = y;
 	while (*msg)
@@ -397,8 +755,10 @@ void draw_font(int x, int y, const char* msg)
 		}
 		else
 		{
+			SDL_Rect glyph = ascii_glyph[ascii_map[c]];
 			SDL_Rect rect = { rx, ry, 0, 0 };
-			SDL_BlitSurface(ascii_tile[ascii_map[c]],NULL,screen,&rect);
+			if (glyph.w > 0)
+				blit(font_atlas,&glyph,dst,&rect);
 			rx += ascii_w;
 		}
 
@@ -406,10 +766,102 @@ void draw_font(int x, int y, const char* msg)
 	}
 }
 
+// finds or composes the surface for a string, NULL if it can't be cached
+static SDL_Surface* text_surface(const char* msg, int len)
+{
+	++text_frame;
+
+	TextCache* oldest = text_cache;
+	for (int i=0; i < MAX_TEXTS; ++i)
+	{
+		TextCache* t = text_cache + i;
+		if (t->surface && !strcmp(t->text,msg))
+		{
+			t->used = text_frame;
+			return t->surface;
+		}
+		if (!t->surface || (oldest->surface && t->used < oldest->used))
+			oldest = t;
+	}
+
+	// measure
+	int w = 0, h = 1, lw = 0;
+	for (int i=0; i < len; ++i)
+	{
+		if (msg[i] == '\n') { ++h; lw = 0; }
+		else if (++lw > w) w = lw;
+	}
+	if (w < 1) return NULL;
+
+	SDL_Surface* surface = SDL_CreateRGBSurface(
+		SDL_SWSURFACE,
+		w * ascii_w, h * ascii_h,
+		screen->format->BitsPerPixel,
+		screen->format->Rmask,
+		screen->format->Gmask,
+		screen->format->Bmask,
+		0);
+	if (surface == NULL) return NULL;
+
+	// short lines leave the rest of the surface transparent
+	Uint32 key = SDL_MapRGB(surface->format, 0xFF, 0x00, 0xFF);
+	SDL_SetColorKey(surface, SDL_SRCCOLORKEY, key);
+	SDL_FillRect(surface, NULL, key);
+	draw_glyphs(surface, 0, 0, msg);
+
+	if (oldest->surface) SDL_FreeSurface(oldest->surface);
+	strcpy(oldest->text, msg);
+	oldest->surface = surface;
+	oldest->used = text_frame;
+	return surface;
+}
+
+void draw_font(int x, int y, const char* msg)
+{
+	// a single glyph is already one blit
+	int len = strlen(msg);
+	SDL_Surface* text = NULL;
+	if (len > 1 && len < MAX_TEXT_LEN)
+		text = text_surface(msg, len);
+
+	if (text)
+	{
+		SDL_Rect rect = { x, y, 0, 0 };
+		blit(text,NULL,target,&rect);
+	}
+	else
+		draw_glyphs(target, x, y, msg);
+}
+
+// window scale
+
+void set_scale(int scale_)
+{
+	if (scale_ < 1) scale_ = 1;
+	if (scale_ > MAX_SCALE) scale_ = MAX_SCALE;
+
+	int old = scale;
+	scale = scale_;
+	if (!open_window())
+	{
+		scale = old; // keep the size that worked
+		if (!open_window())
+		{
+			os::alert("Unable to create SDL video surface!");
+			exit(2);
+		}
+	}
+}
+
+int get_scale()
+{
+	return scale;
+}
+
 // quit with confirm
 bool try_quit(bool confirm)
 {
-	if (confirm)
+	if (confirm && !replaying) // a replay has nobody to ask
 	{
 		// wait for escape to be released if it was pressed
 		Uint8* keystate = SDL_GetKeyState(NULL);
@@ -457,6 +909,113 @@ void lock_audio(bool lock)
 	else      SDL_UnlockAudio();
 }
 
+// worker threads
+
+const int MAX_WORKERS = 8;
+
+struct ParallelJob
+{
+	void (*job)(int, void*);
+	void* data;
+	int count;
+	int next;
+	SDL_mutex* mutex;
+};
+
+static int parallel_worker(void* data)
+{
+	ParallelJob* p = (ParallelJob*)data;
+	while (true)
+	{
+		SDL_mutexP(p->mutex);
+		int index = p->next++;
+		SDL_mutexV(p->mutex);
+
+		if (index >= p->count) break;
+		p->job(index, p->data);
+	}
+	return 0;
+}
+
+void parallel_for(int count, void (*job)(int index, void* data), void* data)
+{
+	ParallelJob p;
+	p.job = job;
+	p.data = data;
+	p.count = count;
+	p.next = 0;
+	p.mutex = SDL_CreateMutex();
+
+	SDL_Thread* workers[MAX_WORKERS];
+	int worker_count = (count < MAX_WORKERS) ? count : MAX_WORKERS;
+	if (p.mutex == NULL) worker_count = 0;
+	for (int i=0; i < worker_count; ++i)
+	{
+		workers[i] = SDL_CreateThread(parallel_worker, &p);
+		if (workers[i] == NULL)
+		{
+			worker_count = i;
+			break;
+		}
+	}
+
+	// this thread helps too, and finishes the work alone if threads are unavailable
+	if (p.mutex != NULL)
+	{
+		parallel_worker(&p);
+	}
+	else
+	{
+		for (int i=0; i < count; ++i)
+			job(i, data);
+	}
+
+	for (int i=0; i < worker_count; ++i)
+		SDL_WaitThread(workers[i], NULL);
+	if (p.mutex != NULL)
+		SDL_DestroyMutex(p.mutex);
+}
+
+// background thread
+
+static SDL_Thread* background_thread = NULL;
+static SDL_mutex* background_mutex = NULL;
+static void (*background_job)(void*) = NULL;
+static void* background_data = NULL;
+
+static int background_worker(void* data)
+{
+	background_job(background_data);
+	return 0;
+}
+
+bool start_background(void (*job)(void* data), void* data)
+{
+	wait_background();
+	if (background_mutex == NULL)
+		background_mutex = SDL_CreateMutex();
+	if (background_mutex == NULL) return false;
+
+	background_job = job;
+	background_data = data;
+	background_thread = SDL_CreateThread(background_worker, NULL);
+	return background_thread != NULL;
+}
+
+void wait_background()
+{
+	if (background_thread == NULL) return;
+	SDL_WaitThread(background_thread, NULL);
+	background_thread = NULL;
+}
+
+void lock_background(bool lock)
+{
+	if (background_mutex == NULL) return;
+	if (lock) SDL_mutexP(background_mutex);
+	else      SDL_mutexV(background_mutex);
+}
+
 } // namespace os
 
 // end of file
@@ -25,20 +25,46 @@ namespace os
 {
 
 // in platform implementation
+extern void start_dialogs(); // prepares dialogs in the background, if that is slow
 extern void alert(const char* message);
 extern bool yesno(const char* message);
 extern const char* file_load(const char* default_name, int mask_count, const char** masks);
 extern const char* file_save(const char* default_name, int mask_count, const char** masks);
 
+// calls entry() for each file or folder in a directory, returns false if it can't be read
+extern bool list_dir(const char* path, void (*entry)(const char* name, bool folder, void* data), void* data);
+
+// read-only view of a whole file, returns NULL on failure, release with unmap_file
+extern const unsigned char* map_file(const char* filename, unsigned int* size);
+extern void unmap_file(const unsigned char* view, unsigned int size);
+
+// for a realtime audio thread, each returns false if the system does not permit it
+extern bool lock_memory(const void* data, unsigned int size); // touches and keeps its pages in RAM
+extern bool raise_priority(); // realtime scheduling for the calling thread
+
 // in main.cpp
 
-extern void add_icon(int index, int w, int h, const void* data);
+extern void set_atlas(int w, int h, const void* data); // 0x00RRGGBB image holding every icon, used in place
+extern void add_icon(int index, int x, int y, int w, int h); // a rectangle of the atlas
 extern void draw_icon(int x, int y, int icon);
+extern void icon_size(int icon, int* w, int* h);
+
+// offscreen tiles, transparent where nothing is drawn
+extern int  add_tile(int w, int h); // returns the new tile's index
+extern void begin_tile(int tile); // clears the tile, drawing goes to it until end_tile
+extern void end_tile();
+extern void draw_tile(int x, int y, int tile);
+
+// limits drawing to a screen rectangle, which is shown when the frame is presented
+extern void set_region(int x, int y, int w, int h);
 
 extern void add_font(int icon, int w, int h, int tx, int ty, int xs, int ys, int r, const char* map);
 extern void dupe_font(char duplicate, char original);
 extern void draw_font(int x, int y, const char* msg);
 
+extern void set_scale(int scale); // window size as a multiple of 256x224, 1 to 6
+extern int  get_scale();
+
 extern bool try_quit(bool confirm);
 extern void set_caption(const char* caption);
 
@@ -46,6 +72,15 @@ extern void set_audio_callback(void (*callback)(sint16*,int));
 extern void pause_audio(bool);
 void lock_audio(bool lock); // mutex for audio thread
 
+// runs job(0..count-1) across worker threads, returns when all are finished
+extern void parallel_for(int count, void (*job)(int index, void* data), void* data);
+
+// runs job on a background thread, waiting for the previous one to finish first
+// returns false if no thread could be started
+extern bool start_background(void (*job)(void* data), void* data);
+extern void wait_background(); // returns when the background job is finished
+extern void lock_background(bool lock); // mutex shared with the background job
+
 }
 
 // end of file
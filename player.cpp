@@ -1,20 +1,13 @@
 // player.cpp
 //   audio generator for Song
 
-#include <cstdlib> // NULL
+#include <cstdlib> // NULL, malloc, free
 #include <cmath> // pow
 #include "player.h"
 #include "data.h"
 #include "os.h"
 
-static unsigned int samplerate;
-static bool playing;
-static int beat;      // current beat
-static int next_beat; // samples to next beat
-static int beat_length; // samples per beat
-static const Song* song;
-
-uint32 tuning; // tuning adjustment for samplerate
+static const sint16* samples; // ASSET_SAMPLES, NULL if it could not be unpacked
 
 // mutex
 
@@ -56,7 +49,7 @@ struct Sampler
 
 		int si = (inst * 13) + (note - 1);
 		pos0 = 0;
-		sample0 = sampledata[si].d;
+		sample0 = (samples != NULL) ? (samples + sampledata[si].offset) : NULL;
 		sample_len0 = sampledata[si].len;
 	}
 
@@ -66,7 +59,7 @@ struct Sampler
 		sample1 = NULL;
 	}
 
-	inline signed int render()
+	inline signed int render(uint32 tuning)
 	{
 		if (sample0 == NULL) return 0; // sampler disabled
 
@@ -99,53 +92,169 @@ struct Sampler
 };
 
 const unsigned int CHANNEL_POWER = 2;
-const unsigned int CHANNELS = 1 << CHANNEL_POWER;
-Sampler sampler[CHANNELS];
+const unsigned int CHANNELS = 1 << CHANNEL_POWER; // player::VOICES
 
-void start_sample(unsigned int channel, unsigned char note, unsigned char inst)
+// the whole state of a player, the audio thread has its own
+struct player::Instance
 {
-	sampler[channel].play(note,inst);
-}
+	unsigned int samplerate;
+	bool playing;
+	int beat;      // current beat
+	int next_beat; // samples to next beat
+	int beat_length; // samples per beat
+	const Song* song;
+	uint32 tuning; // tuning adjustment for samplerate
+	Sampler sampler[CHANNELS];
+};
+
+static player::Instance audio; // used by the audio callback, under AudioLock
+static bool lock_notes = false; // lock_memory() was called, the notes of each song played are locked too
 
-inline signed int mix()
+inline signed int mix(player::Instance* p)
 {
 	signed int output = 0;
 	for (int i=0; i < CHANNELS; ++i)
-		output += sampler[i].render();
+		output += p->sampler[i].render(p->tuning);
 	return output >> CHANNEL_POWER;
 }
 
+// mixes len samples at buffer+at, unless it is NULL, the sum of all channels
+// before scaling down to 16 bits at wide+at, unless it is NULL,
+// and each channel's share of the mix at stems[i]+at
+void mix_block(player::Instance* p, sint16* buffer, signed int* wide, sint16* const* stems, int at, int len)
+{
+	if (stems == NULL && wide == NULL)
+	{
+		for (int i=at; i < at+len; ++i)
+			buffer[i] = mix(p);
+		return;
+	}
+
+	for (int i=at; i < at+len; ++i)
+	{
+		signed int output = 0;
+		for (int c=0; c < CHANNELS; ++c)
+		{
+			signed int voice = p->sampler[c].render(p->tuning);
+			if (stems != NULL && stems[c] != NULL) stems[c][i] = voice >> CHANNEL_POWER;
+			output += voice;
+		}
+		if (buffer != NULL) buffer[i] = output >> CHANNEL_POWER;
+		if (wide != NULL) wide[i] = output;
+	}
+}
+
 // internal play functions
 
-void play_beat()
+void play_column(player::Instance* p, int b)
 {
-	if (!playing) return;
-
+	const unsigned char* column = song_column(p->song, b);
 	for (int i=0; i<3; ++i)
 	{
-		unsigned char note = song->notes[(beat*6)+(i*2)+0];
-		unsigned char inst = song->notes[(beat*6)+(i*2)+1];
-
-		if (note >=1 && note <= 0x0D && inst <= 0x0E)
-			start_sample(i,note,inst);
+		if (column[i] != VOICE_EMPTY)
+			p->sampler[i].play(voice_note(column[i]),voice_inst(column[i]));
 	}
+}
+
+void play_beat(player::Instance* p)
+{
+	if (!p->playing) return;
 
-	++beat;
-	if (beat >= song->length)
+	play_column(p, p->beat);
+
+	++p->beat;
+	if (p->beat >= p->song->length)
 	{
-		if (song->loop) beat = 0;
-		else player::stop_song();
+		if (p->song->loop) p->beat = 0;
+		else p->playing = false;
 	}
 }
 
-void update_tempo()
+// samples per beat at 32000Hz, based on lengths measured empirically,
+// and then presuming tempo in mario paint is
+// implemented as a 14 + the song->tempo added
+// to an accumulater each frame that triggers a beat on overflow
+double beat_samples(int tempo)
+{
+	return 690892.8 / double(14 + tempo);
+}
+
+void update_tempo(player::Instance* p)
+{
+	p->beat_length = int(double(p->samplerate) * beat_samples(p->song->tempo) / 32000.0);
+}
+
+void set_samplerate(player::Instance* p, unsigned int sr)
+{
+	p->samplerate = sr;
+	p->tuning = uint32(65536.0 * 32000.0 / double(sr)); // 16 bit fixed point adjustment
+}
+
+void silence(player::Instance* p)
+{
+	for (int i=0; i < CHANNELS; ++i)
+		p->sampler[i].stop();
+}
+
+void setup(player::Instance* p, const Song* song)
+{
+	// unpacked by the first setup, which comes before the audio callback is set
+	if (samples == NULL) samples = (const sint16*)asset_block(ASSET_SAMPLES);
+
+	set_samplerate(p, 32000); // default samplerate
+	p->playing = false;
+	p->beat = 0;
+	p->next_beat = 0;
+	p->song = song;
+	silence(p);
+}
+
+void play_song(player::Instance* p)
+{
+	if (p->song == NULL) return;
+
+	silence(p);
+	update_tempo(p);
+	p->playing = true;
+	p->beat = 0;
+	p->next_beat = 0;
+}
+
+void render(player::Instance* p, sint16* buffer, signed int* wide, sint16* const* stems, int len)
 {
-	// samples per beat, based on lengths measured empirically,
-	// and then presuming tempo in mario paint is
-	// implemented as a 14 + the song->tempo added
-	// to an accumulater each frame that triggers a beat on overflow
-	double beat_samples = (690892.8 / double(14 + song->tempo));
-	beat_length = int(double(samplerate) * beat_samples / 32000.0);
+	if (!p->playing)
+	{
+		mix_block(p, buffer, wide, stems, 0, len);
+		return;
+	}
+
+	int at = 0;
+	while(len)
+	{
+		if (p->next_beat < len) // advance to beat if it occurs during len
+		{
+			if (p->next_beat > 0)
+			{
+				mix_block(p, buffer, wide, stems, at, p->next_beat);
+				at += p->next_beat;
+				len -= p->next_beat;
+				p->next_beat = 0;
+			}
+		}
+		else // otherwise finish render to end off len
+		{
+			p->next_beat -= len;
+			mix_block(p, buffer, wide, stems, at, len);
+			return;
+		}
+
+		// time to play a beat
+		while (p->next_beat <= 0)
+		{
+			play_beat(p);
+			p->next_beat += p->beat_length;
+		}
+	}
 }
 
 // public interface
@@ -153,143 +262,171 @@ void update_tempo()
 namespace player
 {
 
-void setup(const Song* song_)
+void setup(const Song* song)
 {
-	set_samplerate(32000); // default samplerate
-	playing = false;
-	beat = 0;
-	next_beat = 0;
-	song = song_;
-	silence();
+	AudioLock audio_lock;
+
+	::setup(&audio, song);
 }
 
 void set_samplerate(unsigned int sr)
 {
 	AudioLock audio_lock;
 
-	samplerate = sr;
-	tuning = uint32(65536.0 * 32000.0 / double(sr)); // 16 bit fixed point adjustment
+	::set_samplerate(&audio, sr);
 }
 
 void silence()
 {
 	AudioLock audio_lock;
 
-	for (int i=0; i < CHANNELS; ++i)
-		sampler[i].stop();
+	::silence(&audio);
 }
 
 void apply_tempo()
 {
 	AudioLock audio_lock;
 	
-	update_tempo();
+	update_tempo(&audio);
 }
 
 void set_beat(int beat_)
 {
 	AudioLock audio_lock;
 
-	if (beat_ <  0          ) beat_ = 0;
-	if (beat_ >= song->length) beat_ = song->length;
-	beat = beat_;
+	if (beat_ <  0                ) beat_ = 0;
+	if (beat_ >= audio.song->length) beat_ = audio.song->length;
+	audio.beat = beat_;
 }
 
 void play_song()
 {
-	AudioLock audio_lock;
+	// edits stop playback, so notes they moved are locked again here, outside
+	// the lock because touching the pages in can be slow
+	if (lock_notes && audio.song != NULL && audio.song->buffer != NULL)
+		os::lock_memory(audio.song->buffer, audio.song->capacity * COLUMN_SIZE);
 
-	if (song == NULL) return;
+	AudioLock audio_lock;
 
-	silence();
-	update_tempo();
-	playing = true;
-	beat = 0;
-	next_beat = 0;
+	::play_song(&audio);
 }
 
 void stop_song()
 {
 	AudioLock audio_lock;
 
-	playing = false;
+	audio.playing = false;
 }
 
 void play_note_immediate(unsigned char note, unsigned char inst)
 {
 	AudioLock audio_lock;
 
-	start_sample(3,note,inst);
+	audio.sampler[3].play(note,inst);
 }
 
 void play_beat_immediate(int b)
 {
 	AudioLock audio_lock;
 
-	if (b < 0 || b >= song->length) return;
-	for (int i=0; i<3; ++i)
-	{
-		unsigned char note = song->notes[(b*6)+(i*2)+0];
-		unsigned char inst = song->notes[(b*6)+(i*2)+1];
-
-		if (note >=1 && note <= 0x0D && inst <= 0x0E)
-			start_sample(i,note,inst);
-	}
+	if (b < 0 || b >= audio.song->length) return;
+	play_column(&audio, b);
 }
 
 void render(sint16* buffer, int len)
 {
 	// AudioLock audio_lock; render() is already called from a thread that has lock
+	// it only reads memory prepared before playback, and makes no allocations
+	// or system calls, so a realtime audio thread never waits on anything else
 
-	if (!playing)
-	{
-		while(len)
-		{
-			*buffer = mix();
-			++buffer;
-			--len;
-		}
-		return;
-	}
-
-	while(len)
-	{
-		if (next_beat < len) // advance to beat if it occurs during len
-		{
-			while (next_beat > 0)
-			{
-				*buffer = mix();
-				++buffer;
-				--len;
-				--next_beat;
-			}
-		}
-		else // otherwise finish render to end off len
-		{
-			next_beat -= len;
-			while (len)
-			{
-				*buffer = mix();
-				++buffer;
-				--len;
-			}
-			return;
-		}
+	::render(&audio, buffer, NULL, NULL, len);
+}
 
-		// time to play a beat
-		while (next_beat <= 0)
-		{
-			play_beat();
-			next_beat += beat_length;
-		}
-	}
+bool lock_memory()
+{
+	if (samples == NULL) return false;
+
+	bool locked = os::lock_memory(samples, assetdata[ASSET_SAMPLES].size);
+	locked = os::lock_memory(sampledata, sizeof(sampledata)) && locked;
+	locked = os::lock_memory(&audio, sizeof(audio)) && locked;
+	if (audio.song != NULL && audio.song->buffer != NULL)
+		locked = os::lock_memory(audio.song->buffer, audio.song->capacity * COLUMN_SIZE) && locked;
+	lock_notes = true;
+	return locked;
 }
 
 unsigned int get_beat_length()
 {
 	AudioLock audio_lock;
 
-	return beat_length;
+	return audio.beat_length;
+}
+
+Instance* create(const Song* song, unsigned int samplerate)
+{
+	Instance* p = (Instance*)malloc(sizeof(Instance));
+	if (p == NULL) return NULL;
+	::setup(p, song);
+	::set_samplerate(p, samplerate);
+	return p;
+}
+
+void destroy(Instance* p)
+{
+	free(p);
+}
+
+void play_song(Instance* p)
+{
+	::play_song(p);
+}
+
+void stop_song(Instance* p)
+{
+	p->playing = false;
+}
+
+void set_beat(Instance* p, int beat_)
+{
+	if (beat_ <  0             ) beat_ = 0;
+	if (beat_ >= p->song->length) beat_ = p->song->length;
+	p->beat = beat_;
+}
+
+void render(Instance* p, sint16* buffer, int len)
+{
+	::render(p, buffer, NULL, NULL, len);
+}
+
+void render(Instance* p, sint16* buffer, sint16* const* stems, int len)
+{
+	::render(p, buffer, NULL, stems, len);
+}
+
+void render_wide(Instance* p, signed int* wide, int len)
+{
+	::render(p, NULL, wide, NULL, len);
+}
+
+unsigned int get_beat_length(Instance* p)
+{
+	return p->beat_length;
+}
+
+unsigned int get_ring_length(Instance* p)
+{
+	uint32 longest = 0;
+	for (unsigned int i=0; i < (sizeof(sampledata) / sizeof(sampledata[0])); ++i)
+		if (sampledata[i].len > longest) longest = sampledata[i].len;
+
+	// a note sounds until its sample ends, and fades out under
+	// the note that interrupts it for FADE_LEN samples more
+	return uint32(double(longest) * 65536.0 / double(p->tuning)) + 1 + Sampler::FADE_LEN;
+}
+
+unsigned int get_song_ms(int length, int tempo)
+{
+	return (unsigned int)(double(length) * beat_samples(tempo) / 32.0);
 }
 
 } // namespace player
@@ -3,7 +3,7 @@
 // player.h
 //   audio generator for Song
 
-#include "editor.h" // Song
+#include "song.h" // Song
 #include "os.h" // sint16
 
 namespace player
@@ -26,9 +26,39 @@ extern void play_beat_immediate(int beat);
 // for output audio
 extern void render(sint16* buffer, int len);
 
+// keeps the sample bank, the audio thread's player and its song's notes in RAM,
+// call after setup(), from then on play_song() locks the notes of the song it
+// plays again, as they move when edits grow the song,
+// returns false if they could not all be locked
+extern bool lock_memory();
+
 // calculates samples per beat, call after play_song()
 extern unsigned int get_beat_length();
 
+// playing time of length beats at tempo, once through
+extern unsigned int get_song_ms(int length, int tempo);
+
+// independent players, for rendering away from the audio thread without locking,
+// the first must be created after setup() or on the main thread
+struct Instance;
+extern Instance* create(const Song* song, unsigned int samplerate); // NULL if out of memory
+extern void destroy(Instance* p);
+extern void play_song(Instance* p);
+extern void stop_song(Instance* p);
+extern void set_beat(Instance* p, int sx); // call after play_song(p)
+extern void render(Instance* p, sint16* buffer, int len);
+extern unsigned int get_beat_length(Instance* p);
+extern unsigned int get_ring_length(Instance* p); // samples a note can be heard, at most
+
+// render that also writes each voice's share of the mix to stems[i], unless it is NULL
+const int VOICES = 4; // channels A, B, C, then the preview voice
+extern void render(Instance* p, sint16* buffer, sint16* const* stems, int len);
+
+// render before the mix is scaled down to 16 bits, which is wide[i] >> WIDE_SHIFT,
+// for measuring and scaling the mix without losing precision
+const int WIDE_SHIFT = 2;
+extern void render_wide(Instance* p, signed int* wide, int len);
+
 }
 
 // end of file
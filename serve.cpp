@@ -0,0 +1,542 @@
+// serve.cpp
+//   render server on a local socket
+
+// Each connection sends any number of requests, one after another, each a line of text:
+//   sho FORMAT SAMPLERATE SIZE [LEVEL]    followed by SIZE bytes of a .sho file
+//   id FORMAT SAMPLERATE INDEX [LEVEL]    song INDEX of the library archive
+// FORMAT is wav, as save_file would write it, or pcm, only its 16-bit little endian samples.
+// LEVEL is optional: normalize to -16 LUFS with peaks under -1 dB, or limit to reach
+// -16 LUFS with a limiter holding true peaks at -1 dB.
+// Each reply is a line "ok SIZE" followed by SIZE bytes, or a line "error MESSAGE".
+//
+// A worker thread for each core accepts connections and renders with its own
+// player. Finished renders are kept in a cache shared by the workers, found by
+// the song's hash, and the least recently used are dropped when it is full.
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include "serve.h"
+#include "files.h"
+#include "player.h"
+#include "data.h"
+#include "os.h"
+
+#ifdef _WIN32
+
+namespace serve
+{
+
+int run(const char* socket_path, const char* library)
+{
+	fprintf(stderr, "--serve needs Unix domain sockets, which this platform does not have.\n");
+	return 1;
+}
+
+} // namespace serve
+
+#else
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+const int MAX_WORKERS = 64;
+const int CACHE_BUCKETS = 4096;
+const unsigned int CACHE_MAX = 256 * 1024 * 1024; // bytes of rendered data kept
+const unsigned int RENDER_MAX = 64 * 1024 * 1024; // longer renders are refused
+const unsigned int SHO_MAX = 1024 * 1024; // larger than any .sho
+const int IDLE_SECONDS = 10; // a connection that sends or takes nothing for this long is closed
+
+static int listener = -1;
+static const unsigned char* library_data = NULL;
+static unsigned int library_size = 0;
+
+// the cache, and files:: calls that set get_file_error(), are only used under this lock,
+// render_wav() is called without it as it leaves get_file_error() alone
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct CacheLock
+{
+	CacheLock() { pthread_mutex_lock(&cache_mutex); }
+	~CacheLock() { pthread_mutex_unlock(&cache_mutex); }
+};
+
+// render cache
+
+struct Render
+{
+	Render* next; // in the same bucket
+	Render* newer; // least recently used order
+	Render* older;
+	unsigned int hash;
+	unsigned int samplerate;
+	bool header;
+	int normalize;
+	Song song; // songs with the same hash are told apart by comparing them
+	unsigned char* data;
+	unsigned int size;
+	int users; // replies still sending it, so it can't be dropped yet
+};
+
+static Render* buckets[CACHE_BUCKETS];
+static Render* newest = NULL;
+static Render* oldest = NULL;
+static unsigned int cache_size = 0;
+
+int bucket(unsigned int hash, unsigned int samplerate, bool header, int normalize)
+{
+	return (hash ^ (samplerate * 2654435761u) ^ (header ? 1 : 0) ^ (normalize * 2)) % CACHE_BUCKETS;
+}
+
+void unlink_lru(Render* r)
+{
+	if (r->newer) r->newer->older = r->older; else newest = r->older;
+	if (r->older) r->older->newer = r->newer; else oldest = r->newer;
+	r->newer = NULL;
+	r->older = NULL;
+}
+
+void link_newest(Render* r)
+{
+	r->older = newest;
+	r->newer = NULL;
+	if (newest) newest->newer = r;
+	newest = r;
+	if (oldest == NULL) oldest = r;
+}
+
+// drops renders until size more bytes fit, call with the lock held
+void make_room(unsigned int size)
+{
+	Render* r = oldest;
+	while (r != NULL && (cache_size + size) > CACHE_MAX)
+	{
+		Render* newer = r->newer;
+		if (r->users == 0)
+		{
+			Render** link = &buckets[bucket(r->hash, r->samplerate, r->header, r->normalize)];
+			while (*link != r) link = &(*link)->next;
+			*link = r->next;
+			unlink_lru(r);
+			cache_size -= r->size;
+			song_free(&r->song);
+			free(r->data);
+			free(r);
+		}
+		r = newer;
+	}
+}
+
+// finds a render and marks it in use, call with the lock held
+Render* find_render(const Song* song, unsigned int hash, unsigned int samplerate, bool header,
+	int normalize)
+{
+	for (Render* r = buckets[bucket(hash, samplerate, header, normalize)]; r != NULL; r = r->next)
+	{
+		if (r->hash == hash &&
+			r->samplerate == samplerate &&
+			r->header == header &&
+			r->normalize == normalize &&
+			song_equal(&r->song, song))
+		{
+			unlink_lru(r);
+			link_newest(r);
+			++r->users;
+			return r;
+		}
+	}
+	return NULL;
+}
+
+// takes ownership of data, returns the render in use, NULL if out of memory
+Render* add_render(const Song* song, unsigned int hash, unsigned int samplerate, bool header,
+	int normalize, unsigned char* data, unsigned int size)
+{
+	CacheLock lock;
+
+	// another worker may have finished the same song first
+	Render* r = find_render(song, hash, samplerate, header, normalize);
+	if (r != NULL)
+	{
+		free(data);
+		return r;
+	}
+
+	r = (Render*)calloc(1, sizeof(Render));
+	if (r == NULL || !song_copy(&r->song, song))
+	{
+		if (r) song_free(&r->song);
+		free(r);
+		free(data);
+		return NULL;
+	}
+	make_room(size);
+
+	r->hash = hash;
+	r->samplerate = samplerate;
+	r->header = header;
+	r->normalize = normalize;
+	r->data = data;
+	r->size = size;
+	r->users = 1;
+	int b = bucket(hash, samplerate, header, normalize);
+	r->next = buckets[b];
+	buckets[b] = r;
+	link_newest(r);
+	cache_size += size;
+	return r;
+}
+
+void release_render(Render* r)
+{
+	CacheLock lock;
+	--r->users;
+	if (cache_size > CACHE_MAX) make_room(0); // it may have been kept over the limit
+}
+
+// rendering to memory
+
+struct RenderBuffer
+{
+	unsigned char* data;
+	unsigned int size;
+	unsigned int capacity;
+	const char* error; // why writing stopped, NULL if it didn't
+};
+
+bool write_buffer(const void* data, unsigned int size, void* user)
+{
+	RenderBuffer* b = (RenderBuffer*)user;
+	if (size > (RENDER_MAX - b->size))
+	{
+		b->error = "Song too long to render.";
+		return false;
+	}
+	if ((b->size + size) > b->capacity)
+	{
+		unsigned int capacity = (b->capacity < 65536) ? 65536 : b->capacity;
+		while (capacity < (b->size + size))
+			capacity = (capacity > (RENDER_MAX / 2)) ? RENDER_MAX : (capacity * 2);
+		unsigned char* grown = (unsigned char*)realloc(b->data, capacity);
+		if (grown == NULL)
+		{
+			b->error = "Out of memory.";
+			return false;
+		}
+		b->data = grown;
+		b->capacity = capacity;
+	}
+	memcpy(b->data + b->size, data, size);
+	b->size += size;
+	return true;
+}
+
+// bytes a render will take, known before making it: a quarter second of
+// leader, the song (twice if it loops) and 3 seconds of tail, 16-bit samples
+double render_size(const Song* song, unsigned int samplerate, bool header)
+{
+	double seconds = double(player::get_song_ms(song->length, song->tempo)) / 1000.0;
+	if (song->loop) seconds *= 2.0;
+	seconds += 0.25 + 3.0;
+	return (seconds * double(samplerate) * 2.0) + (header ? (44.0 + 68.0) : 0.0);
+}
+
+// connections
+
+struct Connection
+{
+	int fd;
+	unsigned char buffer[4096];
+	unsigned int pos;
+	unsigned int end;
+};
+
+// reads exactly size bytes, false if the connection ends first
+bool read_bytes(Connection* c, void* data, unsigned int size)
+{
+	unsigned char* d = (unsigned char*)data;
+	while (size)
+	{
+		if (c->pos >= c->end)
+		{
+			ssize_t got = read(c->fd, c->buffer, sizeof(c->buffer));
+			if (got < 0 && errno == EINTR) continue;
+			if (got <= 0) return false;
+			c->pos = 0;
+			c->end = (unsigned int)got;
+		}
+		unsigned int n = c->end - c->pos;
+		if (n > size) n = size;
+		memcpy(d, c->buffer + c->pos, n);
+		c->pos += n;
+		d += n;
+		size -= n;
+	}
+	return true;
+}
+
+// reads a line without its newline, false if the connection ends or it is too long
+bool read_line(Connection* c, char* line, unsigned int size)
+{
+	for (unsigned int i=0; i < size; ++i)
+	{
+		if (!read_bytes(c, line + i, 1)) return false;
+		if (line[i] == '\n')
+		{
+			line[i] = 0;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool write_bytes(int fd, const void* data, unsigned int size)
+{
+	const unsigned char* d = (const unsigned char*)data;
+	while (size)
+	{
+		ssize_t sent = write(fd, d, size);
+		if (sent < 0 && errno == EINTR) continue;
+		if (sent <= 0) return false;
+		d += sent;
+		size -= (unsigned int)sent;
+	}
+	return true;
+}
+
+// copies get_file_error(), call with the lock held
+void copy_error(char* message, unsigned int size)
+{
+	snprintf(message, size, "%s", files::get_file_error());
+}
+
+bool reply_error(int fd, const char* message)
+{
+	char line[256];
+	sprintf(line, "error %.240s\n", message);
+	return write_bytes(fd, line, strlen(line));
+}
+
+// handles one request, false if the connection should be closed
+bool serve_request(Connection* c)
+{
+	char line[128];
+	if (!read_line(c, line, sizeof(line))) return false;
+
+	char source[8];
+	char format[8];
+	unsigned int samplerate;
+	unsigned int value;
+	char level[16] = "";
+	if (4 > sscanf(line, "%7s %7s %u %u %15s", source, format, &samplerate, &value, level))
+	{
+		reply_error(c->fd, "Bad request.");
+		return false;
+	}
+
+	// a .sho is read before anything else, so a refused request leaves the next one readable
+	unsigned char* sho = NULL;
+	if (!strcmp(source, "sho"))
+	{
+		sho = (value <= SHO_MAX) ? (unsigned char*)malloc(value + 1) : NULL;
+		if (sho == NULL)
+		{
+			reply_error(c->fd, (value <= SHO_MAX) ? "Out of memory." : "File is unexpectedly large.");
+			return false;
+		}
+		if (!read_bytes(c, sho, value)) { free(sho); return false; }
+	}
+	else if (strcmp(source, "id"))
+	{
+		reply_error(c->fd, "Bad request.");
+		return false;
+	}
+
+	Song song;
+	memset(&song, 0, sizeof(song));
+	bool loaded = false;
+	char message[256] = "";
+	bool header = !strcmp(format, "wav");
+	int normalize = files::NORMALIZE_OFF;
+	if (!strcmp(level, "normalize")) normalize = files::NORMALIZE_PEAK;
+	else if (!strcmp(level, "limit")) normalize = files::NORMALIZE_LIMIT;
+
+	if (!header && strcmp(format, "pcm"))
+		strcpy(message, "Unknown format.");
+	else if (level[0] && normalize == files::NORMALIZE_OFF)
+		strcpy(message, "Unknown level.");
+	else if (samplerate < 8000 || samplerate > 192000)
+		strcpy(message, "Unsupported samplerate.");
+	else if (sho != NULL)
+	{
+		CacheLock lock;
+		loaded = files::read_sho(sho, value, &song);
+		if (!loaded) copy_error(message, sizeof(message));
+	}
+	else if (library_data == NULL)
+		strcpy(message, "No library.");
+	else
+	{
+		CacheLock lock;
+		loaded = files::read_archive(library_data, library_size, int(value), &song);
+		if (!loaded) copy_error(message, sizeof(message));
+	}
+	free(sho);
+
+	if (!loaded)
+	{
+		song_free(&song);
+		return reply_error(c->fd, message);
+	}
+
+	if (render_size(&song, samplerate, header) > double(RENDER_MAX))
+	{
+		song_free(&song);
+		return reply_error(c->fd, "Song too long to render.");
+	}
+
+	unsigned int hash = song_hash(&song);
+	Render* r;
+	{
+		CacheLock lock;
+		r = find_render(&song, hash, samplerate, header, normalize);
+	}
+	if (r == NULL)
+	{
+		RenderBuffer b = { NULL, 0, 0, NULL };
+		const char* error;
+		if (!files::render_wav(&song, samplerate, header, normalize, write_buffer, &b, &error))
+		{
+			free(b.data);
+			song_free(&song);
+			return reply_error(c->fd, (b.error != NULL) ? b.error : error);
+		}
+		r = add_render(&song, hash, samplerate, header, normalize, b.data, b.size);
+	}
+	song_free(&song);
+	if (r == NULL) return reply_error(c->fd, "Out of memory.");
+
+	char reply[32];
+	sprintf(reply, "ok %u\n", r->size);
+	bool result =
+		write_bytes(c->fd, reply, strlen(reply)) &&
+		write_bytes(c->fd, r->data, r->size);
+	release_render(r);
+	return result;
+}
+
+void* worker(void* data)
+{
+	Connection* c = (Connection*)malloc(sizeof(Connection));
+	if (c == NULL) return NULL;
+
+	while (true)
+	{
+		int fd = accept(listener, NULL, NULL);
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			perror("accept");
+			break;
+		}
+
+		// each worker serves one connection at a time, so a stalled client can't keep it
+		struct timeval idle = { IDLE_SECONDS, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle));
+
+		c->fd = fd;
+		c->pos = 0;
+		c->end = 0;
+		while (serve_request(c));
+		close(fd);
+	}
+	free(c);
+	return NULL;
+}
+
+// public interface
+
+namespace serve
+{
+
+int run(const char* socket_path, const char* library)
+{
+	if (library != NULL)
+	{
+		library_data = os::map_file(library, &library_size);
+		if (library_data == NULL)
+		{
+			fprintf(stderr, "Unable to read library: %s\n", library);
+			return 1;
+		}
+	}
+
+	// the first player unpacks the samples, which isn't safe on several threads at once
+	player::Instance* first = player::create(NULL, 32000);
+	if (first == NULL || asset_block(ASSET_SAMPLES) == NULL)
+	{
+		fprintf(stderr, "Unable to unpack samples.\n");
+		return 1;
+	}
+	player::destroy(first);
+
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(address.sun_path))
+	{
+		fprintf(stderr, "Socket path too long: %s\n", socket_path);
+		return 1;
+	}
+	strcpy(address.sun_path, socket_path);
+
+	// a socket left behind by an earlier server is replaced, other files are not
+	struct stat st;
+	if (0 == stat(socket_path, &st) && S_ISSOCK(st.st_mode))
+		unlink(socket_path);
+
+	signal(SIGPIPE, SIG_IGN); // a client hanging up fails the write instead
+
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0 ||
+		0 != bind(listener, (sockaddr*)&address, sizeof(address)) ||
+		0 != listen(listener, 64))
+	{
+		perror(socket_path);
+		return 1;
+	}
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int worker_count = (cores < 1) ? 1 : (cores > MAX_WORKERS) ? MAX_WORKERS : int(cores);
+	for (int i=1; i < worker_count; ++i)
+	{
+		pthread_t thread;
+		if (0 != pthread_create(&thread, NULL, worker, NULL))
+		{
+			worker_count = i;
+			break;
+		}
+		pthread_detach(thread);
+	}
+	fprintf(stderr, "Serving %s with %d workers.\n", socket_path, worker_count);
+
+	// this thread is a worker too, and returns only if accept fails
+	worker(NULL);
+
+	close(listener);
+	unlink(socket_path);
+	return 1;
+}
+
+} // namespace serve
+
+#endif
+
+// end of file
@@ -0,0 +1,16 @@
+#pragma once
+
+// serve.h
+//   render server, so other programs can render songs without starting the editor
+
+namespace serve
+{
+
+// renders songs for clients of a local socket until the process is stopped
+// library is a .shp archive whose songs can be requested by index, or NULL
+// returns a process exit code, after printing any error
+extern int run(const char* socket_path, const char* library);
+
+} // namespace serve
+
+// end of file
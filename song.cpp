@@ -0,0 +1,219 @@
+// song.cpp
+//   growable note storage for Song
+
+#include <cstring> // memcpy, memmove, memcmp, strlen, strcmp
+#include <cstdlib> // realloc, free
+#include "song.h"
+
+static const unsigned char BLANK[COLUMN_SIZE] = { VOICE_EMPTY, VOICE_EMPTY, VOICE_EMPTY };
+
+// internal helpers
+
+inline unsigned char* column_ptr(const Song* song, int sx)
+{
+	int at = (sx < song->gap) ? sx : (sx + (song->capacity - song->size));
+	return song->buffer + (at * COLUMN_SIZE);
+}
+
+void move_gap(Song* song, int sx)
+{
+	int gap_size = song->capacity - song->size;
+	if (gap_size > 0)
+	{
+		unsigned char* b = song->buffer;
+		if (sx < song->gap)
+			memmove(b + ((sx + gap_size) * COLUMN_SIZE), b + (sx * COLUMN_SIZE), (song->gap - sx) * COLUMN_SIZE);
+		else if (sx > song->gap)
+			memmove(b + (song->gap * COLUMN_SIZE), b + ((song->gap + gap_size) * COLUMN_SIZE), (sx - song->gap) * COLUMN_SIZE);
+	}
+	song->gap = sx;
+}
+
+// makes room for at least columns, doubling to keep appends cheap
+bool reserve_columns(Song* song, int columns)
+{
+	if (columns <= song->capacity) return true;
+
+	int capacity = (song->capacity < 96) ? 96 : (song->capacity * 2);
+	if (capacity < columns) capacity = columns;
+	if (capacity > SONG_MAX) capacity = SONG_MAX;
+	if (capacity < columns) return false;
+
+	move_gap(song, song->size); // the gap becomes the end of the new space
+	unsigned char* buffer = (unsigned char*)realloc(song->buffer, capacity * COLUMN_SIZE);
+	if (buffer == NULL) return false;
+	song->buffer = buffer;
+	song->capacity = capacity;
+	return true;
+}
+
+// public interface
+
+bool pack_columns(const unsigned char* pairs, int n, unsigned char* cols)
+{
+	bool clean = true;
+	for (int i=0; i < (n * 3); ++i)
+	{
+		unsigned char note = pairs[(i*2)+0];
+		unsigned char inst = pairs[(i*2)+1];
+
+		if (note >= 1 && note <= 13 && inst <= 14)
+			cols[i] = make_voice(note, inst);
+		else
+		{
+			cols[i] = VOICE_EMPTY;
+			if ((note < 1) ||
+			    (note > 13 && note != 0xFF) ||
+				(inst > 14 && inst != 0xDF))
+				clean = false;
+		}
+	}
+	return clean;
+}
+
+void unpack_columns(const unsigned char* cols, int n, unsigned char* pairs)
+{
+	for (int i=0; i < (n * 3); ++i)
+	{
+		if (cols[i] == VOICE_EMPTY)
+		{
+			pairs[(i*2)+0] = 0xFF;
+			pairs[(i*2)+1] = 0xDF;
+		}
+		else
+		{
+			pairs[(i*2)+0] = voice_note(cols[i]);
+			pairs[(i*2)+1] = voice_inst(cols[i]);
+		}
+	}
+}
+
+void song_free(Song* song)
+{
+	free(song->buffer);
+	song->buffer = NULL;
+	song->size = 0;
+	song->capacity = 0;
+	song->gap = 0;
+}
+
+bool song_copy(Song* dst, const Song* src)
+{
+	if (dst == src) return true;
+
+	unsigned char* buffer = dst->buffer;
+	int capacity = dst->capacity;
+	*dst = *src;
+	dst->buffer = buffer;
+	dst->capacity = capacity;
+	dst->size = 0;
+	dst->gap = 0;
+
+	if (!reserve_columns(dst, src->size)) return false;
+	song_read(src, 0, src->size, dst->buffer);
+	dst->size = src->size;
+	dst->gap = src->size;
+	return true;
+}
+
+const unsigned char* song_column(const Song* song, int sx)
+{
+	if (sx < 0 || sx >= song->size) return BLANK;
+	return column_ptr(song, sx);
+}
+
+unsigned char* song_edit(Song* song, int sx)
+{
+	if (sx < 0 || sx >= SONG_MAX) return NULL;
+	if (sx >= song->size && !song_resize(song, sx + 1)) return NULL;
+	return column_ptr(song, sx);
+}
+
+void song_read(const Song* song, int sx, int n, unsigned char* dst)
+{
+	for (int i=0; i < n; ++i)
+		memcpy(dst + (i * COLUMN_SIZE), song_column(song, sx + i), COLUMN_SIZE);
+}
+
+bool song_insert(Song* song, int sx, const unsigned char* cols, int n)
+{
+	if (sx < 0 || n < 1) return false;
+	if (sx >= SONG_MAX) return false;
+	if (n > (SONG_MAX - sx)) n = SONG_MAX - sx;
+	if (sx > song->size && !song_resize(song, sx)) return false;
+	if (song->size > (SONG_MAX - n)) // columns pushed past the end are lost
+		song_resize(song, SONG_MAX - n);
+	if (!reserve_columns(song, song->size + n)) return false;
+
+	move_gap(song, sx);
+	memcpy(song->buffer + (sx * COLUMN_SIZE), cols, n * COLUMN_SIZE);
+	song->gap += n;
+	song->size += n;
+	return true;
+}
+
+void song_delete(Song* song, int sx, int n)
+{
+	if (sx < 0 || sx >= song->size || n < 1) return;
+	if (n > (song->size - sx)) n = song->size - sx;
+
+	move_gap(song, sx);
+	song->size -= n; // the deleted columns join the gap
+}
+
+bool song_resize(Song* song, int size)
+{
+	if (size < 0) size = 0;
+	if (size > SONG_MAX) return false;
+
+	if (size < song->size)
+	{
+		song_delete(song, size, song->size - size);
+		return true;
+	}
+
+	if (!reserve_columns(song, size)) return false;
+	move_gap(song, song->size);
+	for (int i=song->size; i < size; ++i)
+		memcpy(song->buffer + (i * COLUMN_SIZE), BLANK, COLUMN_SIZE);
+	song->size = size;
+	song->gap = size;
+	return true;
+}
+
+// FNV-1a
+static unsigned int hash_bytes(unsigned int h, const void* data, int len)
+{
+	const unsigned char* d = (const unsigned char*)data;
+	for (int i=0; i < len; ++i)
+		h = (h ^ d[i]) * 16777619u;
+	return h;
+}
+
+unsigned int song_hash(const Song* song)
+{
+	int fields[5] = { song->tempo, song->metre, song->length, song->limit, song->loop ? 1 : 0 };
+	unsigned int h = 2166136261u;
+	h = hash_bytes(h, fields, sizeof(fields));
+	h = hash_bytes(h, song->title, strlen(song->title));
+	h = hash_bytes(h, song->author, strlen(song->author));
+	for (int sx=0; sx < song->length; ++sx)
+		h = hash_bytes(h, song_column(song, sx), COLUMN_SIZE);
+	return h;
+}
+
+bool song_equal(const Song* a, const Song* b)
+{
+	if (a->tempo  != b->tempo ) return false;
+	if (a->metre  != b->metre ) return false;
+	if (a->length != b->length) return false;
+	if (a->limit  != b->limit ) return false;
+	if (a->loop   != b->loop  ) return false;
+	if (strcmp(a->title,  b->title )) return false;
+	if (strcmp(a->author, b->author)) return false;
+	for (int sx=0; sx < a->length; ++sx)
+		if (memcmp(song_column(a, sx), song_column(b, sx), COLUMN_SIZE)) return false;
+	return true;
+}
+
+// end of file
@@ -0,0 +1,68 @@
+#pragma once
+
+// song.h
+//   Song data and its growable note storage
+
+const int SONG_MAX = 0xFFFF; // longest song in beats, limited by the .sho length field
+
+// Each voice is one byte, a note 1-13 in the high 4 bits and an instrument 0-14
+// in the low 4 bits, or VOICE_EMPTY. Files and savestates keep voices as pairs
+// of note and instrument bytes, 0xFF 0xDF when empty, converted as they are read
+// and written.
+const int COLUMN_SIZE = 3; // bytes per column
+const int PAIRS_SIZE = 6; // bytes per column as note/instrument pairs
+const unsigned char VOICE_EMPTY = 0xFF;
+
+inline unsigned char make_voice(int note, int inst) { return (unsigned char)((note << 4) | inst); }
+inline int voice_note(unsigned char v) { return v >> 4; } // 15 if empty
+inline int voice_inst(unsigned char v) { return v & 15; } // 15 if empty
+
+// converts n columns of pairs to voices, a pair that isn't a note 1-13 with an
+// instrument 0-14 becomes empty, returns false if any needed correcting
+// (a note outside 1-13 but not 0xFF, or an instrument outside 0-14 but not 0xDF)
+extern bool pack_columns(const unsigned char* pairs, int n, unsigned char* cols);
+// converts n columns of voices to pairs
+extern void unpack_columns(const unsigned char* cols, int n, unsigned char* pairs);
+
+// Notes are columns of 3 voices per beat, kept in a gap buffer: the columns
+// before the gap are at the start of buffer, and the rest at its end. Inserting
+// or deleting moves the gap to that column, so repeated edits in one place
+// don't shift the rest of the song.
+// Columns past size are blank. A zeroed Song is empty and ready to use.
+typedef struct
+{
+	unsigned char* buffer;
+	int size; // columns stored
+	int capacity; // columns allocated
+	int gap; // column where the gap begins
+	int tempo;
+	int metre;
+	int length;
+	int limit;
+	bool loop;
+	char title[32];
+	char author[32];
+	bool changed;
+} Song;
+
+extern void song_free(Song* song);
+extern bool song_copy(Song* dst, const Song* src); // all fields and notes
+
+// column sx, blank if past the stored columns
+extern const unsigned char* song_column(const Song* song, int sx);
+// column sx for modifying, storage grows if needed, NULL if out of memory
+extern unsigned char* song_edit(Song* song, int sx);
+// copies n columns starting at sx to dst
+extern void song_read(const Song* song, int sx, int n, unsigned char* dst);
+
+// structural changes, columns after sx move
+extern bool song_insert(Song* song, int sx, const unsigned char* cols, int n);
+extern void song_delete(Song* song, int sx, int n);
+extern bool song_resize(Song* song, int size); // truncates or adds blank columns
+
+// hash of everything saved with the song, to compare songs cheaply
+extern unsigned int song_hash(const Song* song);
+// true if everything saved with the songs is the same
+extern bool song_equal(const Song* a, const Song* b);
+
+// end of file
@@ -28,6 +28,11 @@ static const char* win32_masks(int mask_count, const char** masks)
 namespace os
 {
 
+void start_dialogs()
+{
+	// native dialogs are ready immediately
+}
+
 void alert(const char* message)
 {
 	MessageBox(NULL, message, "Alert!", MB_ICONEXCLAMATION | MB_OK);
@@ -121,6 +126,80 @@ const char* file_save(const char* default_name, int mask_count, const char** mas
 	return file;
 }
 
+bool list_dir(const char* path, void (*entry)(const char* name, bool folder, void* data), void* data)
+{
+	char search[1024];
+	if (strlen(path) >= (sizeof(search) - 3)) return false;
+	strcpy(search, path);
+	strcat(search, "\\*");
+
+	WIN32_FIND_DATA fd;
+	HANDLE find = FindFirstFile(search, &fd);
+	if (find == INVALID_HANDLE_VALUE) return false;
+
+	do
+	{
+		if (!strcmp(fd.cFileName,".") || !strcmp(fd.cFileName,"..")) continue;
+		entry(fd.cFileName, (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0, data);
+	} while (FindNextFile(find, &fd));
+
+	FindClose(find);
+	return true;
+}
+
+const unsigned char* map_file(const char* filename, unsigned int* size)
+{
+	HANDLE file = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return NULL;
+
+	DWORD file_size = GetFileSize(file, NULL);
+	if (file_size == INVALID_FILE_SIZE || file_size < 1)
+	{
+		CloseHandle(file);
+		return NULL;
+	}
+
+	HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping == NULL) return NULL;
+
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping); // view stays valid
+	if (view == NULL) return NULL;
+
+	*size = file_size;
+	return (const unsigned char*)view;
+}
+
+void unmap_file(const unsigned char* view, unsigned int size)
+{
+	if (view) UnmapViewOfFile(view);
+}
+
+bool lock_memory(const void* data, unsigned int size)
+{
+	// pages are faulted in even if they can't be locked
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	const volatile unsigned char* bytes = (const volatile unsigned char*)data;
+	for (unsigned int i=0; i < size; i += info.dwPageSize) (void)bytes[i];
+	if (size > 0) (void)bytes[size-1];
+
+	if (VirtualLock((LPVOID)data, size)) return true;
+
+	// the working set limits how much can be locked, so grow it to fit
+	SIZE_T low, high;
+	HANDLE process = GetCurrentProcess();
+	if (!GetProcessWorkingSetSize(process, &low, &high)) return false;
+	if (!SetProcessWorkingSetSize(process, low + size + info.dwPageSize, high + size + info.dwPageSize)) return false;
+	return VirtualLock((LPVOID)data, size) != 0;
+}
+
+bool raise_priority()
+{
+	return SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) != 0;
+}
+
 } // namespace os
 
 // end of file